@@ -1,80 +1,731 @@
 #pragma once
 
+#include <algorithm>
 #include <atomic>
-#include <condition_variable>
-#include <functional>
+#include <cassert>
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <cstring>
+#include <immintrin.h>
+#include <memory>
 #include <mutex>
-#include <queue>
+#include <new>
 #include <thread>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+#include "arena.h"
+#include "topology.h"
+
+class FrameContext;
+
+// Fixed size job with small-buffer storage (one cache line)
+// Trivially copyable callables that fit in the buffer (e.g. lambdas capturing pointers and indices) are stored inline,
+// anything else is moved to the heap and the buffer holds the pointer. The job itself is trivially copyable,
+// so the deques can move it around as plain words. It also carries the frame context it was enqueued under.
+class Job {
+    friend class ThreadPool;
+
+public:
+    static constexpr size_t STORAGE_SIZE = 48;  // Bytes available for an inline callable
+
+    // True if a callable of type F is stored inside the job rather than on the heap
+    template <typename F>
+    static constexpr bool storedInline = std::is_trivially_copyable_v<std::decay_t<F>> &&
+                                         sizeof(std::decay_t<F>) <= STORAGE_SIZE && alignof(std::decay_t<F>) <= 8;
+
+    Job() = default;
+
+    // Wrap a callable taking no arguments
+    // Input Variables:
+    // - f: Callable to run
+    template <typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, Job>>>
+    explicit Job(F&& f) {
+        using Fn = std::decay_t<F>;
+        if constexpr (storedInline<Fn>) {
+            ::new (static_cast<void*>(storage)) Fn(std::forward<F>(f));
+            invoke = [](unsigned char* s) { (*std::launder(reinterpret_cast<Fn*>(s)))(); };
+        }
+        else {
+            Fn* boxed = new Fn(std::forward<F>(f));
+            std::memcpy(storage, &boxed, sizeof(boxed));
+            invoke = [](unsigned char* s) {
+                Fn* fn;
+                std::memcpy(&fn, s, sizeof(fn));
+                (*fn)();
+                delete fn;
+            };
+        }
+    }
+
+    // Run the job (a job must be run exactly once, boxed callables are freed afterwards)
+    void operator()() { invoke(storage); }
+
+private:
+    void (*invoke)(unsigned char*) = nullptr;      // Type-erased call (and free) of the stored callable
+    FrameContext* context = nullptr;               // Set by ThreadPool::enqueue
+    alignas(8) unsigned char storage[STORAGE_SIZE];  // Inline callable, or pointer to the boxed one
+};
+static_assert(sizeof(Job) == 64, "Job should fill exactly one cache line");
+static_assert(std::is_trivially_copyable_v<Job>, "Job is copied word by word by the deques");
+
+// Chase-Lev work-stealing deque (Le, Pop, Cohen & Zappa Nardelli, "Correct and Efficient Work-Stealing for Weak Memory Models")
+// The owning thread pushes and pops at the bottom, any other thread steals from the top; only the single
+// remaining element is contended, and that is resolved with one CAS on 'top'.
+// Slots are stored as atomic words so a thief racing with a push into a reused slot reads a stale (and then
+// discarded) job rather than causing a data race.
+class WorkStealingDeque {
+    static constexpr size_t WORDS = sizeof(Job) / sizeof(std::uint64_t);
+
+    // One job per cache line, so neighbouring slots pushed and stolen by different threads never share a line
+    struct alignas(64) Slot {
+        std::atomic<std::uint64_t> words[WORDS];
+    };
+    static_assert(sizeof(Slot) == 64, "A deque slot should fill exactly one cache line");
+
+    struct Buffer {
+        size_t mask;                                       // Capacity - 1 (capacity is a power of two)
+        std::unique_ptr<Slot[]> slots;                     // Ring of preallocated job slots
+
+        explicit Buffer(size_t capacity) : mask(capacity - 1), slots(new Slot[capacity]) {}
+
+        void put(std::int64_t i, const Job& job) {
+            std::uint64_t raw[WORDS];
+            std::memcpy(raw, &job, sizeof(Job));
+            Slot& slot = slots[static_cast<size_t>(i) & mask];
+            for (size_t w = 0; w < WORDS; w++) slot.words[w].store(raw[w], std::memory_order_relaxed);
+        }
+
+        Job get(std::int64_t i) const {
+            std::uint64_t raw[WORDS];
+            const Slot& slot = slots[static_cast<size_t>(i) & mask];
+            for (size_t w = 0; w < WORDS; w++) raw[w] = slot.words[w].load(std::memory_order_relaxed);
+            Job job;
+            std::memcpy(&job, raw, sizeof(Job));
+            return job;
+        }
+    };
+
+    alignas(64) std::atomic<std::int64_t> top = 0;     // Next index to steal (written by thieves)
+    alignas(64) std::atomic<std::int64_t> bottom = 0;  // Next index to push (written by the owner)
+    std::atomic<Buffer*> buffer;
+    std::vector<std::unique_ptr<Buffer>> buffers;      // Every buffer ever used; old ones may still be read by a thief
+
+public:
+    // Input Variables:
+    // - capacity: Initial capacity in jobs (rounded up to a power of two), the deque grows when full
+    explicit WorkStealingDeque(size_t capacity = 1024) {
+        size_t size = 1;
+        while (size < capacity) size <<= 1;
+        buffers.push_back(std::make_unique<Buffer>(size));
+        buffer.store(buffers.back().get(), std::memory_order_relaxed);
+    }
+
+    // Owner only - push a job at the bottom
+    void push(const Job& job) {
+        std::int64_t b = bottom.load(std::memory_order_relaxed);
+        std::int64_t t = top.load(std::memory_order_acquire);
+        Buffer* a = buffer.load(std::memory_order_relaxed);
+
+        if (b - t > static_cast<std::int64_t>(a->mask)) {
+            // Full - double the capacity, the old buffer stays alive for thieves still reading it
+            buffers.push_back(std::make_unique<Buffer>(2 * (a->mask + 1)));
+            Buffer* grown = buffers.back().get();
+            for (std::int64_t i = t; i < b; i++) grown->put(i, a->get(i));
+            buffer.store(grown, std::memory_order_release);
+            a = grown;
+        }
+        a->put(b, job);
+        bottom.store(b + 1, std::memory_order_release);  // Publishes the slot to thieves
+    }
+
+    // Owner only - pop the most recently pushed job
+    // Input Variables:
+    // - accept: Predicate on the job, a job it rejects is left in the deque
+    // Returns false if the deque was empty (or the last job was stolen first, or rejected)
+    template <typename Accept>
+    bool pop(Job& job, Accept&& accept) {
+        std::int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+        Buffer* a = buffer.load(std::memory_order_relaxed);
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::int64_t t = top.load(std::memory_order_relaxed);
+
+        if (t > b) {
+            bottom.store(b + 1, std::memory_order_relaxed);  // Empty
+            return false;
+        }
+        job = a->get(b);
+        if (!accept(static_cast<const Job&>(job))) {
+            bottom.store(b + 1, std::memory_order_relaxed);  // Put back (a thief may still take it)
+            return false;
+        }
+        if (t == b) {
+            // Last job - race the thieves for it
+            bool won = top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return won;
+        }
+        return true;
+    }
+
+    bool pop(Job& job) { return pop(job, [](const Job&) { return true; }); }
+
+    // Any thread - steal the oldest job
+    // Input Variables:
+    // - accept: Predicate on the job, a job it rejects is left in the deque
+    // Returns false if the deque was empty, the job was rejected or another thread won the race
+    template <typename Accept>
+    bool steal(Job& job, Accept&& accept) {
+        std::int64_t t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::int64_t b = bottom.load(std::memory_order_acquire);
+        if (t >= b) return false;
+
+        Buffer* a = buffer.load(std::memory_order_acquire);
+        Job stolen = a->get(t);
+        if (!accept(static_cast<const Job&>(stolen))) return false;
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) return false;
+        job = stolen;
+        return true;
+    }
+
+    bool steal(Job& job) { return steal(job, [](const Job&) { return true; }); }
+
+    // Any thread - approximate emptiness check (used before going to sleep)
+    bool empty() const {
+        return bottom.load(std::memory_order_acquire) <= top.load(std::memory_order_acquire);
+    }
+};
+
+// Generation counter that threads can wait on, spinning before they park
+// A waiter reads the generation, re-checks its condition, then waits for the generation to move on, and every
+// event that may satisfy a waiter advances it. An advance made between the read and the wait is therefore never
+// missed, and nothing has to be reset between frames. Parking uses std::atomic::wait (a futex on Linux,
+// WaitOnAddress on Windows); the wake-up system call is skipped while nobody is parked.
+class Generation {
+    alignas(64) std::atomic<std::uint32_t> value = 0;
+    std::atomic<unsigned int> parked = 0;  // Threads currently sleeping on 'value'
+
+public:
+    // Returns the current generation
+    std::uint32_t current() const { return value.load(std::memory_order_seq_cst); }
+
+    // Move to the next generation and wake the parked threads
+    // Input Variables:
+    // - wakeAll: Wake every parked thread, or just one (e.g. one new job)
+    void advance(bool wakeAll = true) {
+        value.fetch_add(1, std::memory_order_seq_cst);
+        if (parked.load(std::memory_order_seq_cst) == 0) return;
+        if (wakeAll) value.notify_all();
+        else value.notify_one();
+    }
+
+    // Wait until the generation differs from 'seen'
+    // Input Variables:
+    // - seen: Generation read before the waiter's condition was checked
+    // - spin: How long to spin with _mm_pause before parking
+    void wait(std::uint32_t seen, std::chrono::nanoseconds spin) {
+        using Clock = std::chrono::steady_clock;
+        if (spin.count() > 0) {
+            Clock::time_point start = Clock::now();
+            for (unsigned int i = 1; value.load(std::memory_order_acquire) == seen; i++) {
+                _mm_pause();
+                if (i % 16 == 0 && Clock::now() - start >= spin) break;
+            }
+        }
+        if (value.load(std::memory_order_seq_cst) != seen) return;
+        parked.fetch_add(1, std::memory_order_seq_cst);
+        value.wait(seen, std::memory_order_seq_cst);
+        parked.fetch_sub(1, std::memory_order_relaxed);
+    }
+};
+
+// Time the workers of a pool spent running jobs, spinning for work and parked, summed over the workers
+struct PoolStats {
+    std::uint64_t busyNs = 0;   // Running jobs
+    std::uint64_t spinNs = 0;   // Looking for work without sleeping
+    std::uint64_t parkNs = 0;   // Parked until the next enqueue
+    std::uint64_t parks = 0;    // Number of times a worker parked
+    std::uint64_t slowBusyNs = 0;   // Part of busyNs spent by workers on slower cores (below FAST_CAPACITY)
+    std::uint64_t slowTotalNs = 0;  // Busy, spin and park time of the workers on slower cores
+};
+
+class ThreadPool;
+
+// Frame of one renderer (or one job of the render service): the frame arenas its threads allocate from, and
+// the jobs it has in flight
+// A thread bound to a context (see ThreadPool::bind) allocates from the context's arena for its thread slot,
+// and the jobs it enqueues belong to the context; whichever thread runs such a job is bound to the context for
+// as long as the job runs. Everything a frame allocates therefore lives in arenas of its own context, and is
+// only recycled when that context begins its next frame, whatever the other renderers on the pool are doing.
+// A context is driven by one thread at a time; destroying it waits for the jobs it still has queued.
+class FrameContext {
+    friend class ThreadPool;
+
+    FrameClock frames;
+    std::vector<std::unique_ptr<FrameArena>> arenas;     // One per thread slot of the pool, created on first use
+    ThreadPool* owner;                                   // Pool the context's jobs run on
+    alignas(64) std::atomic<std::int64_t> pending = 0;   // Jobs of the context enqueued but not finished yet
+
+    // Returns the arena of a thread slot (only ever used by the thread in that slot, see ThreadPool::threadSlot)
+    FrameArena* arena(size_t slot) {
+        if (!arenas[slot]) arenas[slot] = std::make_unique<FrameArena>(frames);
+        return arenas[slot].get();
+    }
+
+    // Context the calling thread is bound to, null if none
+    static FrameContext*& current() { thread_local FrameContext* context = nullptr; return context; }
+
+public:
+    // Input Variables:
+    // - pool: Pool the context's jobs run on
+    explicit FrameContext(ThreadPool& pool);
+
+    FrameContext(const FrameContext&) = delete;
+    FrameContext& operator=(const FrameContext&) = delete;
+
+    // Waits for the jobs of the context still queued (e.g. parallel_for helpers that had nothing left to claim)
+    ~FrameContext();
+
+    // Start a new frame: every arena of the context is recycled the next time it is used
+    // Call once the previous frame's data is no longer read and none of its jobs is running.
+    void beginFrame() { frames.advance(); }
+};
+
+// Work-stealing thread pool
+// Every worker owns a Chase-Lev deque: jobs enqueued from a worker go to its own deque, jobs enqueued from any
+// other thread go to a shared submission deque (the only place a lock is taken). Idle workers steal from
+// random victims for a configurable spin time, and only park once that has passed with every deque empty,
+// so workers stay awake across the short gaps between the stages (and frames) of a render.
+// On hybrid CPUs workers can be pinned to cores of known relative capacity (see CpuTopology). Slower workers
+// then hold back from stealing while a fast worker is idle, so queued jobs go to the fast cores first and the
+// slow cores only take a share once the fast ones are saturated. Work that is claimed from a shared list
+// (e.g. the raster lanes of FrameGraph) can weight its claims with threadCapacity(), and stats() splits the
+// busy time by core class so the effect can be checked.
+// Jobs run bound to the frame context they were enqueued under (see FrameContext). Threads outside the pool
+// only help with the jobs of their own context, so several threads can each drive a renderer on one pool.
 class ThreadPool {
+    friend class FrameContext;
+public:
+    static constexpr float FAST_CAPACITY = 0.9f;  // Workers at or above this capacity count as fast cores
+
 private:
+    static constexpr std::chrono::microseconds DEFAULT_SPIN_TIME{ 200 };  // Spin time before an idle worker parks
+
+    struct alignas(64) Worker {
+        WorkStealingDeque deque;
+        std::uint32_t rng = 0;  // xorshift state for picking victims
+        WorkerPlacement placement;
+        std::atomic<std::uint64_t> busyNs = 0, spinNs = 0, parkNs = 0, parks = 0;  // See PoolStats
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;  // One deque per worker, plus the submission deque at the end
+    std::vector<std::thread> slaves;               // Vector of slaves/worker threads
+    std::mutex submitMtx;                          // Serialises non-worker threads on the submission deque
+    alignas(64) std::atomic<std::int64_t> pending = 0;   // Jobs enqueued but not yet finished
+    Generation signal;                             // Advanced on every enqueue, parked workers wait on it
+    Generation idle;                               // Advanced whenever 'pending' (or that of a frame context) drops to zero
+    std::atomic<std::int64_t> spinNs = std::chrono::nanoseconds(DEFAULT_SPIN_TIME).count();
+    alignas(64) std::atomic<int> fastIdle = 0;     // Fast workers currently looking for work
     std::atomic<bool> stopThreadPool = false;
-    std::atomic<int> active_jobs = 0;
-    std::condition_variable cv;         // Condition Variable for Signaling Changes
-    std::condition_variable cv_finish;  // Condition Variable for Signaling Finish (use two different cv's to prevent crashes)
-    std::mutex mtx;                     // Mutex for Synchronization
-    std::queue<std::function<void()>> jobQueue;
-    std::vector<std::thread> slaves;    // Vector of slaves/worker threads
+
+    // Shared state of one parallel_for, reference counted by the caller and its helper jobs: a helper that
+    // only starts once the range is drained still reads the counter, so the last of them to let go of the
+    // state hands it back to the free list instead of the caller waiting for every helper job to have run
+    struct alignas(64) ForState {
+        alignas(64) std::atomic<size_t> next = 0;      // First unclaimed item
+        alignas(64) std::atomic<size_t> finished = 0;  // Items processed
+        std::atomic<size_t> refs = 0;                  // Caller and helper jobs still holding the state
+        size_t range = 0, grain = 1;
+        void* fn = nullptr;                            // Callable of the caller, only called on claimed items
+        void (*call)(void* fn, size_t begin, size_t end) = nullptr;
+
+        void claim() {
+            size_t done = 0;
+            for (size_t begin = next.fetch_add(grain, std::memory_order_relaxed); begin < range;
+                 begin = next.fetch_add(grain, std::memory_order_relaxed)) {
+                size_t end = std::min(begin + grain, range);
+                call(fn, begin, end);
+                done += end - begin;
+            }
+            if (done != 0) finished.fetch_add(done, std::memory_order_release);
+        }
+    };
+    std::mutex forStatesMtx;
+    std::vector<std::unique_ptr<ForState>> forStates;  // Every parallel_for state allocated so far
+    std::vector<ForState*> freeForStates;              // Those not held by any parallel_for
+
+    ForState* acquireForState() {
+        std::lock_guard<std::mutex> lock(forStatesMtx);
+        if (freeForStates.empty()) {
+            forStates.push_back(std::make_unique<ForState>());
+            return forStates.back().get();
+        }
+        ForState* state = freeForStates.back();
+        freeForStates.pop_back();
+        return state;
+    }
+
+    void releaseForState(ForState* state) {
+        if (state->refs.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+        std::lock_guard<std::mutex> lock(forStatesMtx);
+        freeForStates.push_back(state);
+    }
+
+    // Worker the calling thread belongs to (per pool), -1 for non-worker threads
+    int workerIndex() const {
+        return (currentPool() == this) ? currentWorker() : -1;
+    }
+    static const ThreadPool*& currentPool() { thread_local const ThreadPool* pool = nullptr; return pool; }
+    static int& currentWorker() { thread_local int index = -1; return index; }
+
+    bool isFast(int self) const { return workers[self]->placement.capacity >= FAST_CAPACITY; }
+
+    // Slot of a thread's per-thread data (see threadSlot)
+    size_t slotOf(int self) const { return (self >= 0) ? static_cast<size_t>(self) : slaves.size(); }
+
+    // Try to take a job: own deque first (if any), then steal starting from a random victim
+    // (slow workers leave stealing to the fast ones while any of them is idle, and non-worker threads only take
+    // jobs that 'accept' lets through)
+    template <typename Accept>
+    bool findJob(int self, std::uint32_t& rng, Job& job, Accept&& accept) {
+        if (self >= 0 && workers[self]->deque.pop(job)) return true;
+        if (self >= 0 && !isFast(self) && fastIdle.load(std::memory_order_relaxed) > 0) return false;
+
+        size_t count = workers.size();
+        rng ^= rng << 13; rng ^= rng >> 17; rng ^= rng << 5;
+        size_t start = rng % count;
+        for (size_t i = 0; i < count; i++) {
+            size_t victim = (start + i) % count;
+            if (static_cast<int>(victim) == self) continue;
+            if (workers[victim]->deque.steal(job, accept)) return true;
+        }
+        return false;
+    }
+
+    // Run a job bound to its frame context, then retire it
+    void run(int self, Job& job) {
+        FrameContext* context = job.context;
+        FrameContext* outer = FrameContext::current();
+        if (context == outer) {
+            job();
+        }
+        else {
+            FrameContext::current() = context;
+            FrameArena* outerArena = FrameArena::bind(context ? context->arena(slotOf(self)) : nullptr);
+            job();
+            FrameContext::current() = outer;
+            FrameArena::bind(outerArena);
+        }
+        // The context may be destroyed as soon as its count drops to zero, so this is the last access to it
+        bool drained = context != nullptr && context->pending.fetch_sub(1, std::memory_order_acq_rel) == 1;
+        if (pending.fetch_sub(1, std::memory_order_acq_rel) == 1 || drained) idle.advance();
+    }
+
+    // Run one queued job on the calling thread (non-worker threads also take from the submission deque, and
+    // only run jobs of the frame context they are bound to: their thread slot is only theirs within that context)
+    // Returns false if no job was found
+    bool tryRunOne(int self, std::uint32_t& rng) {
+        Job job;
+        bool found;
+        if (self >= 0) {
+            found = findJob(self, rng, job, [](const Job&) { return true; });
+        }
+        else {
+            const FrameContext* context = FrameContext::current();
+            auto own = [context](const Job& candidate) { return candidate.context == context; };
+            {
+                std::lock_guard<std::mutex> lock(submitMtx);
+                found = workers.back()->deque.pop(job, own);
+            }
+            if (!found) found = findJob(-1, rng, job, own);
+        }
+        if (found) run(self, job);
+        return found;
+    }
+
+    // Wait until a count of unfinished jobs drops to zero, running jobs meanwhile
+    void waitFor(const std::atomic<std::int64_t>& count) {
+        int self = workerIndex();
+        std::uint32_t rng = 0x2545F491u;
+        while (true) {
+            std::uint32_t seen = idle.current();
+            if (count.load(std::memory_order_acquire) == 0) return;
+            if (!tryRunOne(self, rng)) idle.wait(seen, spinTime());
+        }
+    }
+
+    bool anyWork() const {
+        for (const auto& w : workers)
+            if (!w->deque.empty()) return true;
+        return false;
+    }
+
+    void workerLoop(int self) {
+        using Clock = std::chrono::steady_clock;
+        currentPool() = this;
+        currentWorker() = self;
+        Worker& worker = *workers[self];
+        CpuTopology::pinCurrentThread(worker.placement.cpu);
+        bool fast = isFast(self);
+
+        auto elapsed = [](Clock::time_point from, Clock::time_point to) {
+            return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(to - from).count());
+        };
+
+        Clock::time_point idleSince = Clock::now();
+        unsigned int spins = 0;
+        if (fast) fastIdle.fetch_add(1, std::memory_order_relaxed);
+        while (true) {
+            Job job;
+            if (findJob(self, worker.rng, job, [](const Job&) { return true; })) {
+                if (fast) fastIdle.fetch_sub(1, std::memory_order_relaxed);
+                Clock::time_point start = Clock::now();
+                run(self, job);
+                Clock::time_point finish = Clock::now();
+                worker.spinNs.fetch_add(elapsed(idleSince, start), std::memory_order_relaxed);
+                worker.busyNs.fetch_add(elapsed(start, finish), std::memory_order_relaxed);
+                if (fast) fastIdle.fetch_add(1, std::memory_order_relaxed);
+                idleSince = finish;
+                spins = 0;
+                continue;
+            }
+            if (stopThreadPool.load(std::memory_order_acquire)) return;
+
+            // Keep looking for the configured spin time before parking, new work usually arrives in bursts
+            _mm_pause();
+            if (++spins % 16 != 0 || Clock::now() - idleSince < std::chrono::nanoseconds(spinNs.load(std::memory_order_relaxed)))
+                continue;
+
+            // Park until the next enqueue; re-check after reading 'signal' so an enqueue in between is not missed
+            std::uint32_t seen = signal.current();
+            if (anyWork() || stopThreadPool.load(std::memory_order_acquire)) continue;
+            Clock::time_point parkStart = Clock::now();
+            if (fast) fastIdle.fetch_sub(1, std::memory_order_relaxed);  // Parked workers do not take work
+            signal.wait(seen, std::chrono::nanoseconds(0));
+            if (fast) fastIdle.fetch_add(1, std::memory_order_relaxed);
+            Clock::time_point parkEnd = Clock::now();
+            worker.spinNs.fetch_add(elapsed(idleSince, parkStart), std::memory_order_relaxed);
+            worker.parkNs.fetch_add(elapsed(parkStart, parkEnd), std::memory_order_relaxed);
+            worker.parks.fetch_add(1, std::memory_order_relaxed);
+            idleSince = parkEnd;
+            spins = 0;
+        }
+    }
+
 public:
-    ThreadPool(size_t cpu) {
-        for (size_t i = 0; i < cpu; i++) {
-            slaves.emplace_back([this]() {
-                while (true) {
-                    std::function<void()> job;
-                    {
-                        // Safe syncronization for shared data
-                        std::unique_lock<std::mutex> lock(mtx);
-
-                        // Wait until a job or thread pool termination
-                        cv.wait(lock, [this]() -> bool { return stopThreadPool || !jobQueue.empty(); });
-                        if (stopThreadPool && jobQueue.empty()) return;
-
-                        // Obtain the next job
-                        job = std::move(jobQueue.front());
-                        jobQueue.pop();
-                        active_jobs++; // active_jobs += 1;
-                    }
-                    job();
-                    {
-                        // Safe syncronization for shared data
-                        std::unique_lock<std::mutex> lock(mtx);
-                        active_jobs--; //active_jobs -= 1;
-                        if (jobQueue.empty() && active_jobs == 0) cv_finish.notify_one();
-                    }
-                }
-            });
+    // Input Variables:
+    // - cpu: Number of worker threads
+    // - placement: Optional core and capacity of each worker (see CpuTopology::workerPlacement),
+    //   by default the workers are unpinned and treated as equally fast
+    ThreadPool(size_t cpu, const std::vector<WorkerPlacement>& placement = {}) {
+        for (size_t i = 0; i <= cpu; i++) {
+            workers.push_back(std::make_unique<Worker>());
+            workers.back()->rng = 0x9E3779B9u * static_cast<std::uint32_t>(i + 1);
+            if (i < placement.size()) workers.back()->placement = placement[i];
         }
+        for (size_t i = 0; i < cpu; i++)
+            slaves.emplace_back([this, i]() { workerLoop(static_cast<int>(i)); });
     }
 
     ~ThreadPool() {
-        // Safe update to stop thread pool
-        {
-            std::unique_lock<std::mutex> lock(mtx);
-            stopThreadPool = true;
-        }
-        cv.notify_all();
+        waitFor(pending);
+        stopThreadPool.store(true, std::memory_order_release);
+        signal.advance();
 
         // Make sure the workers/slaves finished their job
         for (auto& slave : slaves)
             slave.join();
     }
 
-    void enqueue(std::function<void()> job) {
-        // Safe update to enqueue job to the job queue
-        {
-            std::unique_lock<std::mutex> lock(mtx);
-            jobQueue.emplace(std::move(job));
+    // Returns the number of worker threads
+    size_t size() const { return slaves.size(); }
+
+    // Returns a per-thread slot in [0, size()] for indexing the per-thread data of a frame context (e.g. one
+    // renderer's layers): the worker index on the pool's workers, size() on any other thread. Non-worker
+    // threads only run the jobs of their own context and a context is driven by one thread at a time, so within
+    // a context every slot is used by one thread at a time.
+    size_t threadSlot() const { return slotOf(workerIndex()); }
+
+    // Returns the relative performance of the calling thread's core (see WorkerPlacement), 1 for threads
+    // outside the pool (the main thread is kept on the fastest core)
+    float threadCapacity() const {
+        int self = workerIndex();
+        return (self >= 0) ? workers[self]->placement.capacity : 1.f;
+    }
+
+    // Returns the summed capacity of the workers and one thread outside the pool, the throughput of the whole
+    // pool in units of the fastest core
+    float totalCapacity() const {
+        float total = 1.f;
+        for (size_t i = 0; i < slaves.size(); i++)
+            total += workers[i]->placement.capacity;
+        return total;
+    }
+
+    // Bind the calling thread to a frame context, or unbind it (null): it allocates from the context's arena for
+    // its thread slot, and the jobs it enqueues belong to the context (see FrameContext)
+    // Input Variables:
+    // - context: Frame context of this pool
+    void bind(FrameContext* context) {
+        assert((context == nullptr || context->owner == this) && "Frame context of another pool");
+        FrameContext::current() = context;
+        FrameArena::bind(context ? context->arena(threadSlot()) : nullptr);
+    }
+
+    // Set how long idle workers (and waiting threads) spin before parking
+    // A spin time longer than the gap between two frames keeps the workers persistent: they never go back
+    // to the OS between frames, at the cost of burning their cores while the main thread presents.
+    // Input Variables:
+    // - spin: Spin time, zero parks as soon as the deques are empty
+    void setSpinTime(std::chrono::nanoseconds spin) { spinNs.store(spin.count(), std::memory_order_relaxed); }
+
+    // Returns the current spin time
+    std::chrono::nanoseconds spinTime() const { return std::chrono::nanoseconds(spinNs.load(std::memory_order_relaxed)); }
+
+    // Returns the busy, spin and park time of the workers since the last resetStats()
+    PoolStats stats() const {
+        PoolStats total;
+        for (size_t i = 0; i < slaves.size(); i++) {
+            total.busyNs += workers[i]->busyNs.load(std::memory_order_relaxed);
+            total.spinNs += workers[i]->spinNs.load(std::memory_order_relaxed);
+            total.parkNs += workers[i]->parkNs.load(std::memory_order_relaxed);
+            total.parks += workers[i]->parks.load(std::memory_order_relaxed);
+            if (!isFast(static_cast<int>(i))) {
+                std::uint64_t busy = workers[i]->busyNs.load(std::memory_order_relaxed);
+                total.slowBusyNs += busy;
+                total.slowTotalNs += busy + workers[i]->spinNs.load(std::memory_order_relaxed) + workers[i]->parkNs.load(std::memory_order_relaxed);
+            }
         }
-        cv.notify_one();
+        return total;
     }
 
+    // Zero the worker statistics
+    void resetStats() {
+        for (size_t i = 0; i < slaves.size(); i++) {
+            workers[i]->busyNs.store(0, std::memory_order_relaxed);
+            workers[i]->spinNs.store(0, std::memory_order_relaxed);
+            workers[i]->parkNs.store(0, std::memory_order_relaxed);
+            workers[i]->parks.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    // Enqueue a job (any callable taking no arguments)
+    // Callables too large to be stored inline are boxed on the heap, use submit() on hot paths.
+    // Input Variables:
+    // - job: Callable to run on one of the workers
+    template <typename F>
+    void enqueue(F&& job) {
+        Job j(std::forward<F>(job));
+        j.context = FrameContext::current();
+        if (j.context != nullptr) j.context->pending.fetch_add(1, std::memory_order_relaxed);
+        pending.fetch_add(1, std::memory_order_relaxed);
+
+        int self = workerIndex();
+        if (self >= 0) {
+            workers[self]->deque.push(j);
+        }
+        else {
+            std::lock_guard<std::mutex> lock(submitMtx);
+            workers.back()->deque.push(j);
+        }
+
+        signal.advance(false);
+    }
+
+    // Enqueue a job that is guaranteed not to allocate: the callable is copied straight into a cache line
+    // slot of the worker's (preallocated) ring, and anything that would not fit is a compile error.
+    // Capture pointers and indices rather than objects (at most Job::STORAGE_SIZE bytes, trivially copyable).
+    // Input Variables:
+    // - job: Callable to run on one of the workers
+    template <typename F>
+    void submit(F&& job) {
+        static_assert(Job::storedInline<F>, "submit() callables must fit inline in a Job, capture pointers instead of objects");
+        enqueue(std::forward<F>(job));
+    }
+
+    // Awaitable returned by schedule()
+    struct ScheduleAwaiter {
+        ThreadPool& pool;
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> awaiting) { pool.submit([awaiting]() { awaiting.resume(); }); }
+        void await_resume() const noexcept {}
+    };
+
+    // Move a coroutine onto the pool: 'co_await pool.schedule()' suspends the coroutine and resumes it on
+    // whichever worker picks up the job (see coroutine.h)
+    ScheduleAwaiter schedule() { return ScheduleAwaiter{ *this }; }
+
+    // Wait until the jobs enqueued under the calling thread's frame context have finished (with the jobs they
+    // enqueued), or every job of the pool if the thread is not bound to a context
+    // The waiting thread helps by running jobs itself while there is work left, then spins and parks on the
+    // 'idle' generation until the jobs running elsewhere are done
     void wait() {
-        // Safe update to make thread pool wait
-        {
-            std::unique_lock<std::mutex> lock(mtx);
-            cv_finish.wait(lock, [this]() -> bool { return jobQueue.empty() && active_jobs == 0; });
+        FrameContext* context = FrameContext::current();
+        waitFor(context != nullptr ? context->pending : pending);
+    }
+
+    // Run one queued job on the calling thread, for threads waiting on something other than the pool itself
+    // (a non-worker thread only runs jobs of its own frame context)
+    // Returns false if there was nothing to run
+    bool runOne() {
+        thread_local std::uint32_t rng = 0x3C6EF372u;
+        return tryRunOne(workerIndex(), rng);
+    }
+
+    // Run fn(begin, end) over [0, range) in chunks of 'grain', returning once the whole range is done.
+    // Workers (and the calling thread) claim chunks from one shared atomic counter, so the range is balanced
+    // at chunk granularity with a single enqueue per helping worker rather than one job per chunk.
+    // Only waits for its own chunks, so it can be called from inside a job.
+    // Input Variables:
+    // - range: Number of items
+    // - grain: Items claimed per chunk (the last chunk may be smaller)
+    // - fn: Callable (size_t begin, size_t end) processing items [begin, end)
+    template <typename F>
+    void parallel_for(size_t range, size_t grain, F&& fn) {
+        if (range == 0) return;
+        if (grain == 0) grain = 1;
+
+        using Fn = std::remove_reference_t<F>;
+        ForState* state = acquireForState();
+        size_t chunks = (range + grain - 1) / grain;
+        size_t helpers = std::min(size(), chunks - 1);
+        state->next.store(0, std::memory_order_relaxed);
+        state->finished.store(0, std::memory_order_relaxed);
+        state->refs.store(helpers + 1, std::memory_order_relaxed);
+        state->range = range;
+        state->grain = grain;
+        state->fn = const_cast<void*>(static_cast<const void*>(&fn));
+        state->call = [](void* f, size_t begin, size_t end) { (*static_cast<Fn*>(f))(begin, end); };
+        for (size_t i = 0; i < helpers; i++) {
+            submit([this, state]() {
+                state->claim();
+                releaseForState(state);
+            });
+        }
+
+        state->claim();
+
+        // Only the chunks still being processed elsewhere are waited for, not the helper jobs that have not
+        // started yet (they find the counter past the range and let go of the state). Those chunks need
+        // nothing from this thread, so it spins on them rather than running other, possibly long, jobs.
+        while (state->finished.load(std::memory_order_acquire) != range) {
+            _mm_pause();
+            std::this_thread::yield();
         }
+        releaseForState(state);
+    }
+};
+
+inline FrameContext::FrameContext(ThreadPool& pool) : arenas(pool.size() + 1), owner(&pool) {}
+
+inline FrameContext::~FrameContext() {
+    owner->waitFor(pending);
+    if (current() == this) {
+        current() = nullptr;
+        FrameArena::bind(nullptr);
     }
-};
\ No newline at end of file
+}
@@ -3,6 +3,23 @@
 // Flags are ordered from most important to least important
 // Multithread Support
 #define OPT_MULTITHREAD_USE_MT true
+#define OPT_MULTITHREAD_PARALLEL_FOR true
+#define OPT_MULTITHREAD_TASK_GRAPH true
+#define OPT_MULTITHREAD_PERSISTENT_WORKERS true
+#define OPT_MULTITHREAD_TOPOLOGY true
+#define OPT_MULTITHREAD_TILE_COST_MODEL true   // Task graph tiles dispatched longest first from the previous frame's timings
+#define OPT_MULTITHREAD_ATOMIC_DEPTH true      // Lock-free depth writes in renderMT (when the task graph is off)
+#define OPT_MULTITHREAD_SORT_LAST false        // Per-thread layers merged after renderMT (replaces ATOMIC_DEPTH when on)
+#define OPT_MULTITHREAD_SORT_LAST_AVX2 true    // Merge the sort-last layers 8 pixels at a time
+#define OPT_MULTITHREAD_PIPELINED_FRAMES true  // Animate the next frame on the pool while the current one renders
+#define OPT_MULTITHREAD_COROUTINES true        // Run the renderMT frame as a coroutine (when the task graph is off)
+
+// Scene Culling Optimisation
+#define OPT_SCENE_BVH_CULLING true
+#define OPT_SCENE_OCCLUSION_CULLING true
+#define OPT_MESH_LOD true
+#define OPT_MESH_MESHLET_CULLING true
+#define OPT_SCENE_LIGHT_CULLING true  // Point lights binned to 16x16 screen tiles, a pixel only loops over its tile's lights
 
 // Triangle Class Optimisation
 #define OPT_TRIANGLE_BACKFACE_CULLING true
@@ -10,6 +27,13 @@
 #define OPT_TRIANGLE_SPLIT_BARYCENTRIC_CHECKS true
 #define OPT_TRIANGLE_EARLY_DEPTH_CHECK true
 #define OPT_TRIANGLE_EARLY_LIGHT_NORM true
+#define OPT_TRIANGLE_BATCH_SETUP true
+#define OPT_TRIANGLE_GOURAUD_LIGHTING true     // Scene meshes lit per vertex, the pixel loop only interpolates the colour
+#define OPT_TRIANGLE_FLAT_FAST_PATH true       // Constant normal + colour triangles shaded once, pixels are a depth test and a store
+
+// Texture Optimisation
+#define OPT_TEXTURE_MIPMAPS true               // Minified textures sampled from a prefiltered mip level chosen once per triangle
+#define OPT_TEXTURE_BLOCKED_LAYOUT true        // Texels stored in 4x4 blocks of one cache line instead of row by row
 
 // Raster.cpp Optimisation
 #define OPT_RASTER_ENABLE_VERTEX_CACHING true
@@ -31,4 +55,10 @@
 // Miscellaneous Optimizations
 #define OPT_DEPTH_BUFFER_CLEAR_AVX2 true		   // Z-buffer/Depth Buffer Class Optimisation
 #define OPT_COLOUR_DISABLE_FLOOR true			   // Colour Class Optimisation
-#define OPT_RENDERER_DISABLE_REDUNDANT_DIVS true   // Renderer Class Optimisation
\ No newline at end of file
+#define OPT_RENDERER_DISABLE_REDUNDANT_DIVS true   // Renderer Class Optimisation
+
+// Scenes
+#define SCENE_ONE_POINT_LIGHTS false  // Add 40 point lights to scene 1 (a light culling workload, not the benchmarked scene)
+
+// Debugging
+#define DEBUG_COUNT_ALLOCATIONS false  // Count operator new calls and print them with the frame times
\ No newline at end of file
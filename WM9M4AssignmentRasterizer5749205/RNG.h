@@ -2,18 +2,18 @@
 
 #include <random>
 
+// Random number generator owned by whoever draws from it (a scene, a fly-through), so scenes built on
+// different threads never share a sequence
 class RandomNumberGenerator {
 public:
+    // Input Variables:
+    // - seed: Seed of the sequence (the same seed gives the same sequence, e.g. in another process)
+    explicit RandomNumberGenerator(unsigned int seed = std::random_device{}()) : rng(seed) {}
+
     // Delete copy constructor and assignment operator
     RandomNumberGenerator(const RandomNumberGenerator&) = delete;
     RandomNumberGenerator& operator=(const RandomNumberGenerator&) = delete;
 
-    // Get the singleton instance
-    static RandomNumberGenerator& getInstance() {
-        static RandomNumberGenerator instance;
-        return instance;
-    }
-
     // Generate a random integer within a range
     int getRandomInt(int min, int max) {
         std::uniform_int_distribution<int> distribution(min, max);
@@ -26,10 +26,12 @@ public:
         return distribution(rng);
     }
 
-private:
-    // Private constructor for Singleton
-    RandomNumberGenerator() : rng(std::random_device{}()) {}
+    // Restart the sequence from a seed, so a scene can be rebuilt identically (e.g. in another process)
+    void seed(unsigned int value) {
+        rng.seed(value);
+    }
 
+private:
     // Mersenne Twister random number generator
     std::mt19937 rng;
 };
\ No newline at end of file
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Frame counter of one frame context (see FrameContext): every arena of the context is recycled when it moves on
+class FrameClock {
+    std::atomic<std::uint64_t> counter = 1;
+
+public:
+    // Start a new frame for every arena following the clock
+    void advance() { counter.fetch_add(1, std::memory_order_relaxed); }
+
+    // Returns the current frame
+    std::uint64_t now() const { return counter.load(std::memory_order_relaxed); }
+};
+
+// Linear (bump) allocator for data that only lives for one frame
+// A frame context (see FrameContext) owns one arena per thread slot, and a thread allocates from the arena of
+// the context it is bound to (see local()), so allocating is a pointer bump with no locking. Nothing is freed
+// individually: the whole arena is recycled the first time it is used after its context's clock advanced.
+// If a frame needs more than the arena holds, extra blocks are allocated for the rest of that frame and the
+// arena is regrown to the total when it is recycled, so once the largest frame has been seen the frame loop
+// no longer calls operator new.
+class FrameArena {
+    static constexpr size_t MIN_BLOCK = 64 * 1024;  // Smallest block allocated (bytes)
+
+    std::unique_ptr<std::byte[]> block;                    // Main block, reused every frame
+    size_t capacity = 0;                                   // Size of the main block
+    size_t used = 0;                                       // Bytes taken from the current block
+    std::byte* current = nullptr;                          // Block being allocated from (main or overflow)
+    size_t currentSize = 0;                                // Size of 'current'
+    std::vector<std::unique_ptr<std::byte[]>> overflow;    // Extra blocks of this frame
+    size_t overflowBytes = 0;                              // Total size of the extra blocks
+    std::uint64_t frame = 0;                               // Frame the arena was last recycled for
+    const FrameClock& clock;                               // Frames of the context owning the arena
+
+    // Arena of the frame context the calling thread is bound to, null while it is not bound to any
+    static FrameArena*& threadArena() {
+        thread_local FrameArena* arena = nullptr;
+        return arena;
+    }
+
+    // Drop this frame's allocations, folding any overflow into one larger main block
+    void recycle() {
+        if (overflowBytes > 0) {
+            capacity += overflowBytes;
+            block.reset(new std::byte[capacity]);
+            overflow.clear();
+            overflowBytes = 0;
+        }
+        current = block.get();
+        currentSize = capacity;
+        used = 0;
+    }
+
+public:
+    // Input Variables:
+    // - frames: Clock of the frame context owning the arena
+    explicit FrameArena(const FrameClock& frames) : clock(frames) {}
+    FrameArena(const FrameArena&) = delete;
+    FrameArena& operator=(const FrameArena&) = delete;
+
+    // Make the calling thread allocate from an arena (null unbinds it), see FrameContext
+    // Returns the arena the thread was bound to before
+    static FrameArena* bind(FrameArena* arena) {
+        return std::exchange(threadArena(), arena);
+    }
+
+    // Returns the arena of the calling thread's frame context, recycled if a new frame has begun since its
+    // last use, or null if the thread is not bound to a frame context
+    static FrameArena* bound() {
+        FrameArena* arena = threadArena();
+        if (arena != nullptr) {
+            std::uint64_t now = arena->clock.now();
+            if (arena->frame != now) {
+                arena->frame = now;
+                arena->recycle();
+            }
+        }
+        return arena;
+    }
+
+    // Returns the arena of the calling thread's frame context, recycled if a new frame has begun since its last use
+    // The thread must be bound to a frame context: by its renderer's beginFrame(), or by running one of the
+    // context's jobs (an unbound thread has no frame its allocations could be recycled with).
+    static FrameArena& local() {
+        FrameArena* arena = bound();
+        assert(arena != nullptr && "Frame arena used outside of a frame context (call beginFrame first)");
+        return *arena;
+    }
+
+    // Allocate raw memory that stays valid until the next frame begins
+    // Input Variables:
+    // - bytes: Size of the allocation
+    // - alignment: Required alignment (power of two)
+    // Returns the start of the allocation
+    void* allocate(size_t bytes, size_t alignment) {
+        size_t offset = (reinterpret_cast<std::uintptr_t>(current) + used + alignment - 1) & ~(alignment - 1);
+        offset -= reinterpret_cast<std::uintptr_t>(current);
+        if (current == nullptr || offset + bytes > currentSize) {
+            // Out of space - continue in an extra block for the rest of the frame
+            size_t size = std::max({ MIN_BLOCK, bytes + alignment, capacity });
+            overflow.emplace_back(new std::byte[size]);
+            overflowBytes += size;
+            current = overflow.back().get();
+            currentSize = size;
+            used = 0;
+            return allocate(bytes, alignment);
+        }
+        used = offset + bytes;
+        return current + offset;
+    }
+
+    // Allocate an array of 'count' default-initialised objects (plain data types are left uninitialised)
+    // The objects are never destroyed, so only types with a trivial destructor may be allocated.
+    template <typename T>
+    T* allocate(size_t count) {
+        static_assert(std::is_trivially_destructible_v<T>, "Frame arena allocations are never destroyed");
+        T* objects = static_cast<T*>(allocate(count * sizeof(T), alignof(T)));
+        std::uninitialized_default_construct_n(objects, count);
+        return objects;
+    }
+};
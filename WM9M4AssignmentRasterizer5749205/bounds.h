@@ -0,0 +1,163 @@
+#pragma once
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+#include "matrix.h"
+#include "vec4.h"
+
+// Axis-aligned bounding box, stored as plain floats to keep BVH nodes compact
+struct AABB {
+    float min[3] = { FLT_MAX, FLT_MAX, FLT_MAX };     // Minimum corner
+    float max[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };  // Maximum corner
+
+    // Grow the box to contain a point
+    // Input Variables:
+    // - p: Point to include
+    void extend(const vec4& p) {
+        for (unsigned int i = 0; i < 3; i++) {
+            min[i] = std::min(min[i], p[i]);
+            max[i] = std::max(max[i], p[i]);
+        }
+    }
+
+    // Grow the box to contain another box
+    // Input Variables:
+    // - b: Box to include
+    void extend(const AABB& b) {
+        for (unsigned int i = 0; i < 3; i++) {
+            min[i] = std::min(min[i], b.min[i]);
+            max[i] = std::max(max[i], b.max[i]);
+        }
+    }
+
+    // Returns the centre of the box along the given axis
+    float centre(unsigned int axis) const { return 0.5f * (min[axis] + max[axis]); }
+
+    // Returns the axis (0, 1 or 2) with the largest extent
+    unsigned int longestAxis() const {
+        float dx = max[0] - min[0], dy = max[1] - min[1], dz = max[2] - min[2];
+        if (dx >= dy && dx >= dz) return 0;
+        return (dy >= dz) ? 1 : 2;
+    }
+
+    // Exact comparison, used to stop a refit once the bounds stop changing
+    bool operator==(const AABB& b) const {
+        return min[0] == b.min[0] && min[1] == b.min[1] && min[2] == b.min[2] &&
+               max[0] == b.max[0] && max[1] == b.max[1] && max[2] == b.max[2];
+    }
+};
+
+// Bounding sphere (centre has w = 1)
+struct BoundingSphere {
+    vec4 centre;
+    float radius = 0.f;
+
+    // Transform the sphere by an affine matrix
+    // Rotations leave the radius untouched, scaling grows it by the largest axis scale
+    // Input Variables:
+    // - m: Object to world matrix
+    // Returns the transformed sphere
+    BoundingSphere transform(const matrix& m) const {
+        BoundingSphere s;
+        s.centre = m * centre;
+        float sx = m(0, 0) * m(0, 0) + m(1, 0) * m(1, 0) + m(2, 0) * m(2, 0);
+        float sy = m(0, 1) * m(0, 1) + m(1, 1) * m(1, 1) + m(2, 1) * m(2, 1);
+        float sz = m(0, 2) * m(0, 2) + m(1, 2) * m(1, 2) + m(2, 2) * m(2, 2);
+        s.radius = radius * std::sqrt(std::max(sx, std::max(sy, sz)));
+        return s;
+    }
+
+    // Returns the projected radius in pixels, or a negative value if the sphere crosses the near plane
+    // Input Variables:
+    // - vp: Combined perspective * camera matrix
+    // - viewportHeight: Height of the target in pixels
+    // - nearPlane: Near plane distance of the projection
+    float projectedRadius(const matrix& vp, float viewportHeight, float nearPlane) const {
+        float w = (vp * centre).w;
+        if (w - radius < nearPlane) return -1.f;
+        float focalY = std::sqrt(vp(1, 0) * vp(1, 0) + vp(1, 1) * vp(1, 1) + vp(1, 2) * vp(1, 2));  // Camera rotation does not change this
+        return radius * focalY * (0.5f * viewportHeight) / w;
+    }
+
+    // Returns the axis-aligned box enclosing the sphere
+    AABB toAABB() const {
+        AABB b;
+        for (unsigned int i = 0; i < 3; i++) {
+            b.min[i] = centre[i] - radius;
+            b.max[i] = centre[i] + radius;
+        }
+        return b;
+    }
+};
+
+// View frustum as six planes (a, b, c, d) with inward facing normals, so that
+// a point p is inside when a * p.x + b * p.y + c * p.z + d >= 0 for every plane.
+class Frustum {
+public:
+    enum Plane { LEFT = 0, RIGHT, BOTTOM, TOP, NEAR_PLANE, FAR_PLANE, PLANE_COUNT };
+    static constexpr unsigned int ALL_PLANES = (1u << PLANE_COUNT) - 1;  // Plane mask with every plane active
+
+    float planes[PLANE_COUNT][4];
+
+    // Extract the planes from a combined projection matrix (Gribb & Hartmann)
+    // Planes are in whichever space the matrix maps from, e.g. perspective * camera gives world space planes
+    // and perspective * camera * world gives object space planes.
+    // The projection maps the visible depth range to 0 <= z <= w (see matrix::makePerspective).
+    // Input Variables:
+    // - m: Combined projection matrix
+    Frustum(const matrix& m) {
+        for (unsigned int i = 0; i < 4; i++) {
+            planes[LEFT][i] = m(3, i) + m(0, i);
+            planes[RIGHT][i] = m(3, i) - m(0, i);
+            planes[BOTTOM][i] = m(3, i) + m(1, i);
+            planes[TOP][i] = m(3, i) - m(1, i);
+            planes[NEAR_PLANE][i] = m(2, i);
+            planes[FAR_PLANE][i] = m(3, i) - m(2, i);
+        }
+
+        // Normalise so plane distances are in world units (needed for the sphere tests)
+        for (unsigned int p = 0; p < PLANE_COUNT; p++) {
+            float invLength = 1.f / std::sqrt(planes[p][0] * planes[p][0] + planes[p][1] * planes[p][1] + planes[p][2] * planes[p][2]);
+            for (unsigned int i = 0; i < 4; i++)
+                planes[p][i] *= invLength;
+        }
+    }
+
+    // Test a box against the planes selected in the mask
+    // Input Variables:
+    // - b: Box to test
+    // - mask: Planes still to test (bit per plane), updated to drop planes the box is fully inside of
+    // Returns false if the box is completely outside one of the planes
+    bool intersects(const AABB& b, unsigned int& mask) const {
+        for (unsigned int p = 0; p < PLANE_COUNT; p++) {
+            if (!(mask & (1u << p))) continue;
+            const float* pl = planes[p];
+
+            // Distance of the corner furthest along the plane normal (p-vertex) and the nearest one (n-vertex)
+            float pDist = pl[3], nDist = pl[3];
+            for (unsigned int i = 0; i < 3; i++) {
+                pDist += pl[i] * ((pl[i] >= 0.f) ? b.max[i] : b.min[i]);
+                nDist += pl[i] * ((pl[i] >= 0.f) ? b.min[i] : b.max[i]);
+            }
+            if (pDist < 0.f) return false;
+            if (nDist >= 0.f) mask &= ~(1u << p);  // Fully inside - children do not need this plane
+        }
+        return true;
+    }
+
+    // Test a sphere against the planes selected in the mask
+    // Input Variables:
+    // - s: Sphere to test
+    // - mask: Planes to test (bit per plane)
+    // Returns false if the sphere is completely outside one of the planes
+    bool intersects(const BoundingSphere& s, unsigned int mask = ALL_PLANES) const {
+        for (unsigned int p = 0; p < PLANE_COUNT; p++) {
+            if (!(mask & (1u << p))) continue;
+            const float* pl = planes[p];
+            if (pl[0] * s.centre.x + pl[1] * s.centre.y + pl[2] * s.centre.z + pl[3] < -s.radius) return false;
+        }
+        return true;
+    }
+};
@@ -0,0 +1,199 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#include "bounds.h"
+#include "mesh.h"
+
+// Bounding volume hierarchy over the mesh instances of a scene.
+// Leaves bound the world space bounding spheres of their meshes, so spinning an object in place
+// (as the rotating cubes do) leaves the hierarchy untouched. Meshes that are moved or scaled are reported
+// with markMoved, and a refit only revisits those, so its cost follows the moving meshes, not the scene size.
+// Culling walks the tree top-down, so whole subtrees outside the frustum are rejected with one test
+// and subtrees fully inside it are accepted without testing their contents.
+class SceneBVH {
+    struct Node {
+        AABB bounds;               // Bounds of everything below this node
+        int left = -1;             // Left child index (internal nodes)
+        int right = -1;            // Right child index (internal nodes)
+        int parent = -1;           // Parent index (-1 for the root)
+        unsigned int first = 0;    // First entry in 'items' (leaves)
+        unsigned int count = 0;    // Number of meshes in the leaf, 0 for internal nodes
+    };
+
+    static constexpr unsigned int LEAF_SIZE = 4;  // Maximum meshes per leaf
+
+    std::vector<Node> nodes;               // Nodes in build order - children always come after their parent
+    std::vector<unsigned int> items;       // Mesh indices, grouped by leaf
+    std::vector<int> leafOf;               // Leaf node holding each mesh
+    std::vector<BoundingSphere> spheres;   // World space bounding sphere of each mesh at the last refit
+    std::vector<Mesh*> meshes;             // Scene the hierarchy was built over
+    std::vector<int> dirtyLeaves;          // Scratch list of leaves touched by the current refit
+    std::vector<unsigned int> movedMeshes; // Meshes reported by markMoved since the last refit
+    std::vector<unsigned char> movedFlags; // Set for the meshes in 'movedMeshes' (each is listed once)
+
+    // Recursively split items[first, first + count) at the median centroid of the longest axis
+    int subdivide(unsigned int first, unsigned int count, int parent) {
+        int index = static_cast<int>(nodes.size());
+        nodes.emplace_back();
+        nodes[index].parent = parent;
+
+        AABB bounds, centroids;
+        for (unsigned int i = first; i < first + count; i++) {
+            bounds.extend(spheres[items[i]].toAABB());
+            centroids.extend(spheres[items[i]].centre);
+        }
+        nodes[index].bounds = bounds;
+
+        if (count <= LEAF_SIZE) {
+            nodes[index].first = first;
+            nodes[index].count = count;
+            for (unsigned int i = first; i < first + count; i++)
+                leafOf[items[i]] = index;
+            return index;
+        }
+
+        unsigned int axis = centroids.longestAxis();
+        unsigned int mid = first + count / 2;
+        std::nth_element(items.begin() + first, items.begin() + mid, items.begin() + first + count,
+            [this, axis](unsigned int a, unsigned int b) { return spheres[a].centre[axis] < spheres[b].centre[axis]; });
+
+        // 'nodes' may reallocate during the recursion, so only index it afterwards
+        int left = subdivide(first, mid - first, index);
+        int right = subdivide(mid, first + count - mid, index);
+        nodes[index].left = left;
+        nodes[index].right = right;
+        return index;
+    }
+
+    // Recompute the bounds of a single node from its meshes or children
+    AABB nodeBounds(const Node& node) const {
+        AABB bounds;
+        if (node.count > 0) {
+            for (unsigned int i = node.first; i < node.first + node.count; i++)
+                bounds.extend(spheres[items[i]].toAABB());
+        }
+        else {
+            bounds = nodes[node.left].bounds;
+            bounds.extend(nodes[node.right].bounds);
+        }
+        return bounds;
+    }
+
+public:
+    // Build the hierarchy over a scene, using the current world matrices
+    // Input Variables:
+    // - scene: Meshes to build over (the pointers must outlive the BVH)
+    void build(const std::vector<Mesh*>& scene) {
+        meshes = scene;
+        nodes.clear();
+        nodes.reserve(2 * (scene.size() / LEAF_SIZE + 1));
+        items.resize(scene.size());
+        leafOf.assign(scene.size(), -1);
+        spheres.resize(scene.size());
+        dirtyLeaves.reserve(scene.size());  // Worst case, every mesh moves (refit never allocates)
+        movedMeshes.clear();
+        movedMeshes.reserve(scene.size());
+        movedFlags.assign(scene.size(), 0);
+
+        for (unsigned int i = 0; i < scene.size(); i++) {
+            items[i] = i;
+            spheres[i] = scene[i]->bounds.transform(scene[i]->world);
+        }
+        if (!scene.empty()) subdivide(0, static_cast<unsigned int>(scene.size()), -1);
+    }
+
+    // Report a mesh whose world matrix moved or scaled it, to be picked up by the next refit
+    // (rotating a mesh about its own centre needs no report). Call from the thread driving the frame.
+    // Input Variables:
+    // - index: Position of the mesh in the scene the hierarchy was built over
+    void markMoved(unsigned int index) {
+        if (movedFlags[index]) return;
+        movedFlags[index] = 1;
+        movedMeshes.push_back(index);
+    }
+
+    // Refit the hierarchy to the world matrices of the meshes reported with markMoved.
+    // Only leaves whose bounding sphere moved are recomputed, and each change is propagated
+    // towards the root until an ancestor's bounds stop changing.
+    // Returns the number of meshes that moved
+    unsigned int refit() {
+        unsigned int moved = 0;
+        dirtyLeaves.clear();
+
+        for (unsigned int i : movedMeshes) {
+            movedFlags[i] = 0;
+            BoundingSphere s = meshes[i]->bounds.transform(meshes[i]->world);
+            const BoundingSphere& old = spheres[i];
+            if (s.centre.x == old.centre.x && s.centre.y == old.centre.y && s.centre.z == old.centre.z && s.radius == old.radius)
+                continue;
+            spheres[i] = s;
+            dirtyLeaves.push_back(leafOf[i]);
+            moved++;
+        }
+        movedMeshes.clear();
+
+        for (int leaf : dirtyLeaves) {
+            for (int n = leaf; n != -1; n = nodes[n].parent) {
+                AABB bounds = nodeBounds(nodes[n]);
+                if (n != leaf && bounds == nodes[n].bounds) break;  // Nothing above this node changes
+                nodes[n].bounds = bounds;
+            }
+        }
+        return moved;
+    }
+
+    // Collect the meshes whose bounding spheres intersect the frustum
+    // Input Variables:
+    // - frustum: World space view frustum
+    // Output Variables:
+    // - visible: Cleared, then filled with the meshes that survive the test
+    void query(const Frustum& frustum, std::vector<Mesh*>& visible) const {
+        query(frustum, [](const AABB&) { return true; }, visible);
+    }
+
+    // Collect the meshes that intersect the frustum and pass an extra visibility test (e.g. occlusion).
+    // The test is applied to internal nodes as well, so a hidden subtree is rejected as a whole.
+    // Input Variables:
+    // - frustum: World space view frustum
+    // - isVisible: Callable taking a world space AABB, returning false if it is certainly hidden
+    // Output Variables:
+    // - visible: Cleared, then filled with the meshes that survive both tests
+    template <typename VisibilityTest>
+    void query(const Frustum& frustum, VisibilityTest&& isVisible, std::vector<Mesh*>& visible) const {
+        visible.clear();
+        if (nodes.empty()) return;
+
+        struct Entry { int node; unsigned int mask; };
+        Entry stack[64];
+        int top = 0;
+        stack[top++] = { 0, Frustum::ALL_PLANES };
+
+        while (top > 0) {
+            Entry e = stack[--top];
+            const Node& node = nodes[e.node];
+            unsigned int mask = e.mask;
+            if (mask != 0 && !frustum.intersects(node.bounds, mask)) continue;
+            if (!isVisible(node.bounds)) continue;
+
+            if (node.count > 0) {
+                for (unsigned int i = node.first; i < node.first + node.count; i++) {
+                    const BoundingSphere& s = spheres[items[i]];
+
+                    // Planes the leaf is fully inside of are already dropped from the mask
+                    if (mask != 0 && !frustum.intersects(s, mask)) continue;
+                    if (node.count > 1 && !isVisible(s.toAABB())) continue;  // A single mesh leaf was just tested
+                    visible.push_back(meshes[items[i]]);
+                }
+            }
+            else {
+                stack[top++] = { node.right, mask };
+                stack[top++] = { node.left, mask };
+            }
+        }
+    }
+
+    // Returns the number of meshes in the hierarchy
+    size_t size() const { return meshes.size(); }
+};
@@ -58,6 +58,14 @@ public:
         b = std::min(b, 1.f);
     }
 
+    // Compares the RGB components with another colour.
+    // Input Variables:
+    // - c: The other colour
+    // Returns true if every component is equal.
+    bool operator==(const colour& c) const {
+        return r == c.r && g == c.g && b == c.b;
+    }
+
     // Converts the floating-point RGB values to integer values (0-255).
     // Output Variables:
     // - cr: Red component as an unsigned char
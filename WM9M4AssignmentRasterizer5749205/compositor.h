@@ -0,0 +1,139 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <immintrin.h>
+#include <vector>
+
+#include "Multithread.h"
+#include "OptimisationProfiles.h"
+#include "renderer.h"
+#include "zbuffer.h"
+
+// Sort-last compositing: every thread of the pool draws into a private DepthLayer, with no synchronisation
+// while the frame is rasterized, and the layers are merged into the canvas and the Z-buffer afterwards.
+// The merge is split into TILE_SIZE x TILE_SIZE tiles run in parallel; each tile keeps the nearest depth of
+// every pixel over the layers drawn inside it (8 pixels at a time with AVX2) and clears those layers again
+// for the next frame.
+// Compared to binning and atomic depth writes, there is no contention at all during rasterization, but the
+// merge reads (and clears) 8 bytes per pixel per layer, so the memory traffic grows with the thread count.
+class SortLastCompositor {
+public:
+    static constexpr int TILE_SIZE = 64;        // Tile edge in pixels
+    static constexpr size_t STACK_LAYERS = 256; // Layers a tile lists on the stack, more threads spill to the heap
+
+private:
+    std::vector<DepthLayer> layers;
+    int width = 0, height = 0;
+
+    // Merge one tile of the layers into the canvas and the Z-buffer, clearing the layers behind it
+    void mergeTile(Renderer& renderer, int x0, int y0, int x1, int y1) {
+        // Layers drawn inside the tile, the others are already clear (the pool size is not bounded, so the list
+        // only stays on the stack while it fits)
+        DepthLayer* onStack[STACK_LAYERS];
+        std::vector<DepthLayer*> onHeap;
+        DepthLayer** drawn = onStack;
+        if (layers.size() > STACK_LAYERS) {
+            onHeap.resize(layers.size());
+            drawn = onHeap.data();
+        }
+        size_t count = 0;
+        for (DepthLayer& layer : layers)
+            if (layer.overlaps(x0, y0, x1, y1)) drawn[count++] = &layer;
+
+        unsigned char* image = renderer.getBackBuffer();
+        for (int y = y0; y < y1; y++) {
+            float* depthOut = &renderer.zbuffer(0, y);
+            unsigned char* colourOut = &image[static_cast<size_t>(y) * width * 3];
+            int x = x0;
+
+            #if OPT_MULTITHREAD_SORT_LAST_AVX2
+                // Optimisation - Depth compare 8 pixels of every layer at once, selecting the colours with the same mask
+                __m256 vOne = _mm256_set1_ps(1.f);
+                __m256 vZero = _mm256_setzero_ps();
+                for (; x + 7 < x1; x += 8) {
+                    __m256 best = vOne;
+                    __m256 colour = vZero;
+                    for (size_t l = 0; l < count; l++) {
+                        float* depth = drawn[l]->depthRow(y) + x;
+                        float* rgb = reinterpret_cast<float*>(drawn[l]->colourRow(y) + x);
+                        __m256 d = _mm256_loadu_ps(depth);
+                        __m256 nearer = _mm256_cmp_ps(d, best, _CMP_LT_OQ);
+                        best = _mm256_blendv_ps(best, d, nearer);
+                        colour = _mm256_blendv_ps(colour, _mm256_loadu_ps(rgb), nearer);
+                        _mm256_storeu_ps(depth, vOne);
+                        _mm256_storeu_ps(rgb, vZero);
+                    }
+                    _mm256_storeu_ps(depthOut + x, best);
+
+                    alignas(32) std::uint32_t packed[8];
+                    _mm256_store_ps(reinterpret_cast<float*>(packed), colour);
+                    for (int i = 0; i < 8; i++) {
+                        colourOut[3 * (x + i)] = static_cast<unsigned char>(packed[i] >> 16);
+                        colourOut[3 * (x + i) + 1] = static_cast<unsigned char>(packed[i] >> 8);
+                        colourOut[3 * (x + i) + 2] = static_cast<unsigned char>(packed[i]);
+                    }
+                }
+            #endif
+
+            // Base Rasterizer - One pixel at a time (and the pixels left over at the end of the row)
+            for (; x < x1; x++) {
+                float best = 1.f;
+                std::uint32_t colour = 0;
+                for (size_t l = 0; l < count; l++) {
+                    float& depth = drawn[l]->depth(x, y);
+                    std::uint32_t& rgb = drawn[l]->colour(x, y);
+                    if (depth < best) {
+                        best = depth;
+                        colour = rgb;
+                    }
+                    depth = 1.f;
+                    rgb = 0;
+                }
+                depthOut[x] = best;
+                colourOut[3 * x] = static_cast<unsigned char>(colour >> 16);
+                colourOut[3 * x + 1] = static_cast<unsigned char>(colour >> 8);
+                colourOut[3 * x + 2] = static_cast<unsigned char>(colour);
+            }
+        }
+    }
+
+public:
+    // Allocate one layer per thread (the pool's workers plus the thread calling merge) for a canvas size,
+    // does nothing if the layers already match
+    // Input Variables:
+    // - threads: Number of threads drawing into layers
+    // - w, h: Canvas size
+    void create(size_t threads, unsigned int w, unsigned int h) {
+        if (layers.size() == threads && width == static_cast<int>(w) && height == static_cast<int>(h)) return;
+        width = static_cast<int>(w);
+        height = static_cast<int>(h);
+        layers = std::vector<DepthLayer>(threads);
+        for (DepthLayer& layer : layers)
+            layer.create(w, h);
+    }
+
+    // Returns the layer of a thread
+    // Input Variables:
+    // - slot: Thread slot (see ThreadPool::threadSlot)
+    DepthLayer& layer(size_t slot) { return layers[slot]; }
+
+    // Merge every layer into the canvas and the Z-buffer of the renderer (replacing their contents), in parallel
+    // over tiles, and leave the layers cleared for the next frame
+    // Input Variables:
+    // - threads: Pool to merge on
+    // - renderer: Renderer whose canvas and Z-buffer receive the frame
+    void merge(ThreadPool& threads, Renderer& renderer) {
+        int tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+        int tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+        threads.parallel_for(static_cast<size_t>(tilesX) * tilesY, 1, [&](size_t begin, size_t end) {
+            for (size_t tile = begin; tile < end; tile++) {
+                int x0 = static_cast<int>(tile % tilesX) * TILE_SIZE;
+                int y0 = static_cast<int>(tile / tilesX) * TILE_SIZE;
+                mergeTile(renderer, x0, y0, std::min(x0 + TILE_SIZE, width), std::min(y0 + TILE_SIZE, height));
+            }
+        });
+        for (DepthLayer& layer : layers)
+            layer.resetBounds();
+    }
+};
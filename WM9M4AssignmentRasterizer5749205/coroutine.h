@@ -0,0 +1,224 @@
+#pragma once
+
+#include <atomic>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <immintrin.h>
+#include <utility>
+
+#include "arena.h"
+#include "Multithread.h"
+
+// Coroutine tasks on the thread pool
+// A Task is a lazily started coroutine: calling a Task function only creates its frame, and the body runs when
+// the task is awaited (co_await task), joined as a group (co_await whenAll(...)) or run by syncWait. Inside a
+// task, 'co_await pool.schedule()' moves the rest of the body onto a worker. Awaiting suspends the coroutine
+// instead of blocking a thread: the awaiter is resumed by whichever thread finishes the last thing it waits on.
+//
+//   Task<> frame() {
+//       co_await whenAll(threadpool, children, count);  // Children run on the pool, no thread waits for them
+//       ...                                             // Carries on in the thread of the last child
+//   }
+//   syncWait(threadpool, frame());                      // The calling thread runs jobs until the frame is done
+//
+// Coroutine frames are allocated from the FrameArena of the thread creating the task, so a task must finish
+// (and be destroyed) within the frame of the context it was created in. A thread that is not bound to a frame
+// context allocates them with operator new instead.
+
+// Completion counter shared by a group of tasks (whenAll) or by syncWait and its task
+struct TaskLatch {
+    std::atomic<size_t> count = 0;      // Tasks (plus the waiter, for whenAll) still to arrive
+    Generation event;                   // Advanced once the syncWait task has finished
+    std::atomic<bool> released = false; // Set after 'event' was advanced, the latch may be destroyed from then on
+};
+
+// Promise state common to every Task
+struct TaskPromiseBase {
+    std::coroutine_handle<> continuation;  // Coroutine resumed when the task finishes
+    TaskLatch* latch = nullptr;            // Group the task arrives at when it finishes, if any
+
+    // Optimisation - Coroutine frames come from the frame arena, no operator new per task
+    // A header in front of the frame records where it came from: unbound threads have no arena to recycle it
+    static constexpr size_t HEADER = __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+    static void* operator new(size_t size) {
+        FrameArena* arena = FrameArena::bound();
+        unsigned char* block = static_cast<unsigned char*>(arena != nullptr
+            ? arena->allocate(size + HEADER, __STDCPP_DEFAULT_NEW_ALIGNMENT__) : ::operator new(size + HEADER));
+        *block = (arena == nullptr);
+        return block + HEADER;
+    }
+    static void operator delete(void* frame, size_t) {
+        unsigned char* block = static_cast<unsigned char*>(frame) - HEADER;
+        if (*block) ::operator delete(block);  // Arena frames are recycled with the arena
+    }
+
+    // Resume the continuation straight from the final suspend point (symmetric transfer, no recursion)
+    struct FinalAwaiter {
+        bool await_ready() const noexcept { return false; }
+
+        template <typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> finished) noexcept {
+            TaskPromiseBase& promise = finished.promise();
+            if (promise.latch != nullptr) {
+                TaskLatch* latch = promise.latch;
+                // Only the last task of a group resumes the continuation
+                if (latch->count.fetch_sub(1, std::memory_order_acq_rel) != 1) return std::noop_coroutine();
+                if (!promise.continuation) {
+                    // syncWait - wake the waiting thread
+                    latch->event.advance();
+                    latch->released.store(true, std::memory_order_release);
+                    return std::noop_coroutine();
+                }
+            }
+            return promise.continuation ? promise.continuation : std::noop_coroutine();
+        }
+
+        void await_resume() const noexcept {}
+    };
+
+    std::suspend_always initial_suspend() const noexcept { return {}; }
+    FinalAwaiter final_suspend() const noexcept { return {}; }
+    void unhandled_exception() const noexcept { std::terminate(); }
+};
+
+template <typename T>
+struct TaskPromise : TaskPromiseBase {
+    T value{};
+
+    void return_value(T result) { value = std::move(result); }
+    T result() { return std::move(value); }
+};
+
+template <>
+struct TaskPromise<void> : TaskPromiseBase {
+    void return_void() const noexcept {}
+    void result() const noexcept {}
+};
+
+template <typename T = void>
+class Task {
+public:
+    struct promise_type : TaskPromise<T> {
+        Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+    };
+
+    using Handle = std::coroutine_handle<promise_type>;
+
+    Task() = default;
+    Task(Task&& other) noexcept : handle(std::exchange(other.handle, {})) {}
+    Task& operator=(Task&& other) noexcept {
+        if (this != &other) {
+            if (handle) handle.destroy();
+            handle = std::exchange(other.handle, {});
+        }
+        return *this;
+    }
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    ~Task() {
+        if (handle) handle.destroy();
+    }
+
+    // Awaiting a task starts it on the awaiting thread (until it schedules itself elsewhere) and resumes the
+    // awaiter with its result once it has finished
+    auto operator co_await() noexcept {
+        struct Awaiter {
+            Handle task;
+            bool await_ready() const noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+                task.promise().continuation = awaiting;
+                return task;
+            }
+            T await_resume() { return task.promise().result(); }
+        };
+        return Awaiter{ handle };
+    }
+
+    // Returns the coroutine of the task (see whenAll and syncWait)
+    Handle coroutine() const { return handle; }
+
+private:
+    explicit Task(Handle h) : handle(h) {}
+
+    Handle handle;
+};
+
+// Awaitable returned by whenAll()
+class WhenAll {
+    ThreadPool& pool;
+    Task<>* tasks;
+    size_t count;
+    TaskLatch latch;
+
+public:
+    WhenAll(ThreadPool& threads, Task<>* group, size_t n) : pool(threads), tasks(group), count(n) {}
+
+    bool await_ready() const noexcept { return count == 0; }
+
+    bool await_suspend(std::coroutine_handle<> awaiting) {
+        // One extra arrival for the awaiter itself, so no task can resume it before every task was submitted
+        latch.count.store(count + 1, std::memory_order_relaxed);
+        for (size_t i = 0; i < count; i++) {
+            Task<>::Handle task = tasks[i].coroutine();
+            task.promise().continuation = awaiting;
+            task.promise().latch = &latch;
+            pool.submit([task]() { task.resume(); });
+        }
+        // Stay suspended unless every task already finished, in which case carry on in this thread
+        return latch.count.fetch_sub(1, std::memory_order_acq_rel) != 1;
+    }
+
+    void await_resume() const noexcept {}
+};
+
+// Run a group of tasks concurrently on the pool, resuming the awaiter once all of them have finished
+// The tasks stay owned by the caller and must not have been started yet.
+// Input Variables:
+// - pool: Pool the tasks are started on
+// - tasks: First task of the group
+// - count: Number of tasks
+// Returns an awaitable: co_await whenAll(...)
+inline WhenAll whenAll(ThreadPool& pool, Task<>* tasks, size_t count) {
+    return WhenAll(pool, tasks, count);
+}
+
+// Start a task without waiting for it: the calling thread runs it until it first suspends (e.g. on
+// pool.schedule()), and the latch is released once it has finished
+// The task must stay alive (and its frame's arena unrecycled) until latch.released is set.
+// Input Variables:
+// - task: Task to start (not started yet)
+// - latch: Latch released when the task has finished (reset here)
+template <typename T>
+void launch(Task<T>& task, TaskLatch& latch) {
+    latch.count.store(1, std::memory_order_relaxed);
+    latch.released.store(false, std::memory_order_relaxed);
+    typename Task<T>::Handle handle = task.coroutine();
+    handle.promise().latch = &latch;
+    handle.resume();
+}
+
+// Run a task to completion from outside any coroutine
+// The calling thread starts the task and then works as one more thread of the pool, running jobs until the
+// task has finished, and only parks when there is nothing left to run.
+// Input Variables:
+// - pool: Pool the task (and its children) run on
+// - task: Task to run (not started yet)
+// Returns the result of the task
+template <typename T>
+T syncWait(ThreadPool& pool, Task<T> task) {
+    TaskLatch latch;
+    launch(task, latch);
+
+    while (!latch.released.load(std::memory_order_acquire)) {
+        std::uint32_t seen = latch.event.current();
+        if (latch.count.load(std::memory_order_acquire) == 0) {
+            // Finished - the last thread is releasing the latch, which is about to happen
+            _mm_pause();
+            continue;
+        }
+        if (!pool.runOne()) latch.event.wait(seen, pool.spinTime());
+    }
+    return task.coroutine().promise().result();
+}
@@ -0,0 +1,421 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "arena.h"
+#include "flythrough.h"
+#include "light.h"
+#include "multiview.h"
+#include "Multithread.h"
+#include "renderer.h"
+#include "sockets.h"
+#include "topology.h"
+
+#ifndef _WIN32
+    #include <csignal>
+    #include <poll.h>
+    #include <sys/types.h>
+    #include <sys/wait.h>
+    #include <unistd.h>
+    #ifdef __linux__
+        #include <sched.h>
+    #endif
+#endif
+
+// Settings of a distributed render of the scene3 fly-through
+struct DistributedOptions {
+    std::string address;               // "unix:/path", "tcp:host:port" or "host:port"
+    std::uint64_t firstFrame = 0;      // First frame of the sequence
+    std::uint64_t frameCount = 600;    // Number of frames
+    unsigned int chunk = 16;           // Frames handed to a worker at a time
+    unsigned int width = 1024, height = 768;
+    unsigned int seed = 1;             // Seed of the fly-through (every worker builds the same scene from it)
+    unsigned int spawn = 0;            // Local worker processes started by the coordinator
+    std::string output;                // File receiving the frames in order as binary PPMs, none if empty
+};
+
+// Frame-range distributed rendering - a coordinator process splits a range of frames of the fly-through into
+// chunks and hands them to worker processes over sockets (Unix or TCP). The workers render headless into a
+// RenderTarget and stream every frame back; the coordinator puts the frames back in order and writes them out.
+//
+//   coordinator:  listen -> (spawn local workers) -> hand out chunks on request -> reorder -> write frames
+//   worker:       connect -> Ready -> Job -> render and send every frame of the chunk -> Ready -> ... -> Done
+//
+// Chunks are pulled by the workers when they finish the previous one, so a fast worker takes more of the
+// sequence. A FlyThrough replays the scene deterministically, so a frame is the same whichever worker
+// renders it. If a worker disconnects, the frames of its chunk that never arrived are handed out again.
+// Spawned workers are each given their share of the coordinator's cores, so their thread pools do not
+// compete for the same CPUs.
+// Messages are raw structs: the coordinator and the workers run the same executable on the same (x86,
+// little-endian) architecture.
+// Sockets are POSIX only; on Windows the distributed modes report that they are unavailable.
+class DistributedRender {
+public:
+    // Start a distributed mode from the command line
+    //   --worker ADDRESS
+    //   --coordinator ADDRESS [--frames FIRST:COUNT] [--chunk N] [--size WxH] [--seed S] [--spawn N] [--out FILE]
+    //   --scaling ADDRESS MAX_WORKERS [same options] - spawn 1, 2, 4 ... MAX_WORKERS workers and compare throughput
+    // Input Variables:
+    // - pool: Thread pool of this process (used by the workers)
+    // - argc, argv: Command line
+    // Returns the exit code, or -1 if the command line does not ask for a distributed mode
+    static int run(ThreadPool& pool, int argc, char** argv) {
+        if (argc < 3) return -1;
+        std::string mode = argv[1];
+        if (mode != "--worker" && mode != "--coordinator" && mode != "--scaling") return -1;
+
+        #ifdef _WIN32
+            (void)pool;
+            std::cerr << "Distributed rendering needs POSIX sockets and is not available on Windows\n";
+            return 1;
+        #else
+            executablePath() = argv[0];
+            DistributedOptions options;
+            options.address = argv[2];
+            if (mode == "--worker") return runWorker(pool, options.address);
+
+            int next = 3;
+            unsigned int maxWorkers = 1;
+            if (mode == "--scaling") {
+                if (argc < 4) return usage();
+                maxWorkers = static_cast<unsigned int>(std::max(1, std::atoi(argv[3])));
+                next = 4;
+            }
+            for (int i = next; i < argc; i++) {
+                std::string option = argv[i];
+                if (i + 1 >= argc) return usage();
+                std::string value = argv[++i];
+                if (option == "--frames") {
+                    unsigned long long first = 0, count = 0;
+                    if (std::sscanf(value.c_str(), "%llu:%llu", &first, &count) != 2) return usage();
+                    if (first > FlyThrough::MAX_FRAME || count > FlyThrough::MAX_FRAME + 1 - first) return usage();
+                    options.firstFrame = first;
+                    options.frameCount = count;
+                }
+                else if (option == "--chunk") options.chunk = static_cast<unsigned int>(std::max(1, std::atoi(value.c_str())));
+                else if (option == "--size") {
+                    if (std::sscanf(value.c_str(), "%ux%u", &options.width, &options.height) != 2 || options.width == 0 || options.height == 0) return usage();
+                }
+                else if (option == "--seed") options.seed = static_cast<unsigned int>(std::strtoul(value.c_str(), nullptr, 10));
+                else if (option == "--spawn") options.spawn = static_cast<unsigned int>(std::max(0, std::atoi(value.c_str())));
+                else if (option == "--out") options.output = value;
+                else return usage();
+            }
+            if (mode == "--scaling") return runScaling(options, maxWorkers);
+            return runCoordinator(options, nullptr);
+        #endif
+    }
+
+#ifndef _WIN32
+private:
+    enum MessageType : std::uint32_t { READY = 1, JOB = 2, FRAME = 3, DONE = 4 };
+
+    struct JobMessage {
+        std::uint64_t first;     // First frame of the chunk
+        std::uint32_t count;     // Frames in the chunk
+        std::uint32_t width, height;
+        std::uint32_t seed;
+    };
+
+    struct FrameMessage {
+        std::uint64_t frame;
+        std::uint32_t width, height;  // Followed by width * height * 3 bytes of RGB
+    };
+
+    // Coordinator side of a worker connection
+    struct Connection {
+        int fd = -1;
+        std::uint64_t next = 0, end = 0;  // Frames of the current chunk still to arrive
+        std::uint64_t frames = 0;         // Frames received from the worker
+        bool done = false;                // Sent DONE, waiting for the worker to hang up
+    };
+
+    // Throughput of one coordinator run
+    struct Report {
+        double seconds = 0.0;
+        std::uint64_t frames = 0;
+    };
+
+    static int usage() {
+        std::cerr << "usage: --worker ADDRESS\n"
+                     "       --coordinator ADDRESS [--frames FIRST:COUNT] [--chunk N] [--size WxH] [--seed S] [--spawn N] [--out FILE]\n"
+                     "       --scaling ADDRESS MAX_WORKERS [coordinator options]\n"
+                     "ADDRESS is unix:/path, tcp:host:port or host:port, frames go from 0 to " << FlyThrough::MAX_FRAME << "\n";
+        return 2;
+    }
+
+    static bool sendMessage(int fd, MessageType type, const void* body = nullptr, size_t size = 0) {
+        std::uint32_t header = type;
+        return Socket::sendAll(fd, &header, sizeof(header)) && (size == 0 || Socket::sendAll(fd, body, size));
+    }
+
+    // Worker - render the chunks handed out by the coordinator until it says DONE
+    static int runWorker(ThreadPool& pool, const std::string& address) {
+        std::signal(SIGPIPE, SIG_IGN);
+        int fd = -1;
+        for (int attempt = 0; attempt < 100 && fd < 0; attempt++) {
+            fd = Socket::open(address, false);
+            if (fd < 0) std::this_thread::sleep_for(std::chrono::milliseconds(50));  // The coordinator may still be starting
+        }
+        if (fd < 0) {
+            std::cerr << "worker: cannot connect to " << address << "\n";
+            return 1;
+        }
+
+        Light L{ vec4(0.f, 1.f, 1.f, 0.f), colour(1.0f, 1.0f, 1.0f), colour(0.2f, 0.2f, 0.2f) };
+        std::unique_ptr<FlyThrough> flight;
+        unsigned int seed = 0;
+        RenderTarget target;
+        MultiViewRenderer renderer(pool);
+
+        bool ok = sendMessage(fd, READY);
+        while (ok) {
+            std::uint32_t type = 0;
+            if (!Socket::recvAll(fd, &type, sizeof(type)) || type != JOB) break;
+            JobMessage job;
+            if (!Socket::recvAll(fd, &job, sizeof(job))) break;
+            if (job.first > FlyThrough::MAX_FRAME || job.count > FlyThrough::MAX_FRAME + 1 - job.first) break;
+
+            if (!flight || seed != job.seed) {
+                flight.reset();
+                flight = std::make_unique<FlyThrough>(job.seed);
+                seed = job.seed;
+            }
+            if (target.getWidth() != job.width || target.getHeight() != job.height) target.create(job.width, job.height);
+
+            for (std::uint64_t frame = job.first; ok && frame < job.first + job.count; frame++) {
+                renderer.beginFrame();  // The previous frame's transient data is no longer needed
+                flight->seek(frame);
+                renderer.forgetLevels();  // Levels of detail only depend on this frame, whichever frames came before
+                View view{ flight->camera(), &target };
+                renderer.render(flight->scene, &view, 1, L);
+
+                FrameMessage message{ frame, job.width, job.height };
+                ok = sendMessage(fd, FRAME, &message, sizeof(message)) &&
+                     Socket::sendAll(fd, target.getBackBuffer(), static_cast<size_t>(job.width) * job.height * 3);
+            }
+            ok = ok && sendMessage(fd, READY);
+        }
+        close(fd);
+        return 0;
+    }
+
+    // Start a worker process, restricted to a set of CPUs (all of them if empty)
+    static pid_t spawnWorker(const std::string& address, const std::vector<int>& cpus) {
+        #ifdef __linux__
+            const char* program = "/proc/self/exe";
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            for (int id : cpus)
+                CPU_SET(id, &set);
+        #else
+            const char* program = executablePath().c_str();
+        #endif
+        pid_t pid = fork();
+        if (pid != 0) return pid;
+        // Child - only async-signal-safe calls until exec
+        #ifdef __linux__
+            if (!cpus.empty()) sched_setaffinity(0, sizeof(set), &set);
+        #endif
+        execl(program, program, "--worker", address.c_str(), static_cast<char*>(nullptr));
+        _exit(127);
+    }
+
+    // Path of this executable (argv[0]), used to start workers where /proc/self/exe does not exist
+    static std::string& executablePath() {
+        static std::string path = "raster";
+        return path;
+    }
+
+    // Split the cores this process may run on between the spawned workers (whole cores each)
+    // Returns the CPUs of every worker, all empty (unrestricted) if there are fewer cores than workers
+    static std::vector<std::vector<int>> partitionCpus(unsigned int workers) {
+        CpuTopology topology = CpuTopology::detect();
+        std::vector<int> cores;
+        for (const CpuTopology::Cpu& cpu : topology.cpus)
+            if (cpu.id >= 0 && std::find(cores.begin(), cores.end(), cpu.core) == cores.end()) cores.push_back(cpu.core);
+
+        std::vector<std::vector<int>> groups(workers);
+        if (cores.size() < workers) return groups;
+        for (unsigned int w = 0; w < workers; w++) {
+            size_t first = w * cores.size() / workers, last = (w + 1) * cores.size() / workers;
+            for (const CpuTopology::Cpu& cpu : topology.cpus)
+                for (size_t c = first; c < last; c++)
+                    if (cpu.core == cores[c]) groups[w].push_back(cpu.id);
+        }
+        return groups;
+    }
+
+    // Write one frame of the sequence (binary PPM) and fold it into the checksum
+    static void writeFrame(FILE* out, const std::vector<unsigned char>& pixels, unsigned int width, unsigned int height, std::uint64_t& checksum) {
+        for (unsigned char byte : pixels)
+            checksum = (checksum ^ byte) * 1099511628211ull;  // FNV-1a
+        if (out == nullptr) return;
+        std::fprintf(out, "P6\n%u %u\n255\n", width, height);
+        std::fwrite(pixels.data(), 1, pixels.size(), out);
+    }
+
+    // Coordinator - hand out the frame range, collect the frames and write them in order
+    static int runCoordinator(const DistributedOptions& options, Report* report) {
+        std::signal(SIGPIPE, SIG_IGN);
+        int listener = Socket::open(options.address, true);
+        if (listener < 0) {
+            std::cerr << "coordinator: cannot listen on " << options.address << "\n";
+            return 1;
+        }
+
+        FILE* out = nullptr;
+        if (!options.output.empty() && (out = std::fopen(options.output.c_str(), "wb")) == nullptr) {
+            std::cerr << "coordinator: cannot write " << options.output << "\n";
+            close(listener);
+            return 1;
+        }
+
+        std::vector<pid_t> children;
+        std::vector<std::vector<int>> cpus = partitionCpus(options.spawn);
+        for (unsigned int i = 0; i < options.spawn; i++) {
+            pid_t pid = spawnWorker(options.address, cpus[i]);
+            if (pid > 0) children.push_back(pid);
+        }
+
+        using Clock = std::chrono::steady_clock;
+        Clock::time_point start = Clock::now();
+        std::uint64_t end = options.firstFrame + options.frameCount;
+        std::vector<std::pair<std::uint64_t, std::uint64_t>> pending{ { options.firstFrame, end } };  // Frame ranges not handed out yet
+        std::map<std::uint64_t, std::vector<unsigned char>> reorder;  // Frames that arrived before the next one to write
+        std::uint64_t nextToWrite = options.firstFrame;
+        std::uint64_t checksum = 14695981039346656037ull;
+        size_t frameBytes = static_cast<size_t>(options.width) * options.height * 3;
+        std::vector<Connection> workers;
+        std::vector<pollfd> polled;
+        size_t exited = 0;
+        int result = 0;
+
+        while (nextToWrite < end) {
+            polled.assign(1, pollfd{ listener, POLLIN, 0 });
+            for (const Connection& worker : workers)
+                polled.push_back(pollfd{ worker.fd, POLLIN, 0 });
+            if (poll(polled.data(), polled.size(), 1000) < 0) continue;
+
+            if (polled[0].revents & POLLIN) {
+                int fd = accept(listener, nullptr, nullptr);
+                if (fd >= 0) {
+                    Connection worker;
+                    worker.fd = fd;
+                    workers.push_back(worker);
+                }
+            }
+
+            for (size_t i = polled.size() - 1; i >= 1; i--) {
+                if (polled[i].revents == 0) continue;
+                Connection& worker = workers[i - 1];
+                std::uint32_t type = 0;
+                bool alive = Socket::recvAll(worker.fd, &type, sizeof(type));
+
+                if (alive && type == READY) {
+                    worker.next = worker.end = 0;
+                    if (pending.empty()) {
+                        alive = sendMessage(worker.fd, DONE);
+                        worker.done = true;
+                    }
+                    else {
+                        std::pair<std::uint64_t, std::uint64_t>& range = pending.back();
+                        JobMessage job{ range.first, static_cast<std::uint32_t>(std::min<std::uint64_t>(options.chunk, range.second - range.first)),
+                                        options.width, options.height, options.seed };
+                        range.first += job.count;
+                        if (range.first == range.second) pending.pop_back();
+                        worker.next = job.first;
+                        worker.end = job.first + job.count;
+                        alive = sendMessage(worker.fd, JOB, &job, sizeof(job));
+                    }
+                }
+                else if (alive && type == FRAME) {
+                    FrameMessage message;
+                    std::vector<unsigned char> pixels;
+                    alive = Socket::recvAll(worker.fd, &message, sizeof(message)) && message.width == options.width && message.height == options.height;
+                    if (alive) {
+                        pixels.resize(frameBytes);
+                        alive = Socket::recvAll(worker.fd, pixels.data(), frameBytes);
+                    }
+                    if (alive) {
+                        worker.next = message.frame + 1;
+                        worker.frames++;
+                        if (message.frame >= nextToWrite) reorder.emplace(message.frame, std::move(pixels));  // Ignores repeats
+                        // Ordered assembly - write every frame that is now next in line
+                        while (!reorder.empty() && reorder.begin()->first == nextToWrite) {
+                            writeFrame(out, reorder.begin()->second, options.width, options.height, checksum);
+                            reorder.erase(reorder.begin());
+                            nextToWrite++;
+                        }
+                    }
+                }
+                else alive = false;
+
+                if (!alive) {
+                    // Gone - hand the rest of its chunk out again
+                    if (worker.next < worker.end) pending.push_back({ worker.next, worker.end });
+                    if (!worker.done) std::cerr << "coordinator: lost a worker after " << worker.frames << " frames\n";
+                    close(worker.fd);
+                    workers.erase(workers.begin() + static_cast<std::ptrdiff_t>(i - 1));
+                }
+            }
+
+            // Every spawned worker exited with frames left - nobody is coming to render them
+            while (exited < children.size() && waitpid(-1, nullptr, WNOHANG) > 0)
+                exited++;
+            if (!children.empty() && exited == children.size() && workers.empty() && nextToWrite < end) {
+                std::cerr << "coordinator: every worker exited, " << end - nextToWrite << " frames missing\n";
+                result = 1;
+                break;
+            }
+        }
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+        for (Connection& worker : workers) {
+            if (!worker.done) sendMessage(worker.fd, DONE);
+            close(worker.fd);
+        }
+        close(listener);
+        if (options.address.rfind("unix:", 0) == 0) unlink(options.address.substr(5).c_str());
+        for (size_t i = exited; i < children.size(); i++)
+            waitpid(-1, nullptr, 0);
+        if (out != nullptr) std::fclose(out);
+
+        std::uint64_t frames = nextToWrite - options.firstFrame;
+        if (report != nullptr) {
+            report->seconds = seconds;
+            report->frames = frames;
+        }
+        std::cout << "Rendered " << frames << " frames in " << seconds << "s: " << frames / seconds << " frames/s (checksum "
+                  << std::hex << checksum << std::dec << ")\n";
+        return result;
+    }
+
+    // Run the coordinator with a growing number of spawned workers and compare their throughput
+    static int runScaling(DistributedOptions options, unsigned int maxWorkers) {
+        options.output.clear();
+        double baseline = 0.0;
+        std::cout << "workers  frames/s  speedup  efficiency\n";
+        for (unsigned int workers = 1; workers <= maxWorkers; workers = (workers == maxWorkers) ? workers + 1 : std::min(workers * 2, maxWorkers)) {
+            options.spawn = workers;
+            Report report;
+            if (runCoordinator(options, &report) != 0) return 1;
+            double rate = report.frames / report.seconds;
+            if (workers == 1) baseline = rate;
+            std::cout << workers << "  " << rate << "  " << rate / baseline << "x  " << 100.0 * rate / (baseline * workers) << "%\n";
+        }
+        return 0;
+    }
+#endif
+};
@@ -0,0 +1,186 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <numbers>
+#include <vector>
+
+#include "matrix.h"
+#include "mesh.h"
+#include "OptimisationProfiles.h"
+#include "RNG.h"
+#include "texture.h"
+
+// The scene3 vortex warp: rings of cubes and spheres spinning at random speeds, with the camera flying down
+// the vortex and back. Besides building the scene for the interactive loop, a FlyThrough replays it as a
+// deterministic function of the frame number, so any range of frames can be rendered on its own (e.g. by
+// another process, see distributed.h) and match the frames of one sequential run.
+class FlyThrough {
+public:
+    // Rotation speed of a mesh about each axis (radians per frame)
+    struct Rotation { float x; float y; float z; };
+
+    static constexpr int RINGS = 100;              // Rings in the vortex
+    static constexpr int MESHES_PER_RING = 16;     // Meshes per ring, total of 1600 meshes
+    static constexpr float RING_RADIUS = 6.f;      // Radius of the ring
+    static constexpr float RING_DEPTH = 3.5f;      // Distance between two rings
+    static constexpr float START_Z = 8.f;          // Initial camera Z-offset
+    static constexpr float STEP = -0.15f;          // Step size for camera movement
+    static constexpr float MAX_DEPTH = -(static_cast<float>(RINGS) * RING_DEPTH) + 10.f;  // Turning point of the camera
+    // Last frame of the sequence: simulating a frame costs about 0.1ms, so reaching any frame from the start
+    // takes about a second at most (just over two round trips of the camera)
+    static constexpr std::uint64_t MAX_FRAME = 10000;
+    static constexpr std::uint64_t SNAPSHOT_INTERVAL = 250;  // Frames between two snapshots of the animation
+
+    // Returns the checkerboard texture of the vortex spheres
+    static Texture makeTexture() {
+        return Texture::checkerboard(256, 8, colour(1.f, 1.f, 1.f), colour(0.55f, 0.6f, 0.7f));
+    }
+
+    // Mesh generation for the vortex warp, consisting of cubes and spheres
+    // Input Variables:
+    // - rng: Generator the rotation speeds are drawn from
+    // - texture: Texture of the spheres (untextured if null, must outlive the meshes)
+    // Output Variables:
+    // - scene: Meshes of the vortex (allocated with new, owned by the caller)
+    // - rotations: Rotation speed of every mesh
+    static void build(RandomNumberGenerator& rng, std::vector<Mesh*>& scene, std::vector<Rotation>& rotations,
+                      const Texture* texture = nullptr) {
+        float pi = std::numbers::pi_v<float>;
+
+        // Pre-allocate memory for the scene & rotations
+        scene.reserve(scene.size() + RINGS * MESHES_PER_RING);
+        rotations.reserve(rotations.size() + RINGS * MESHES_PER_RING);
+
+        for (int i = 0; i < RINGS; i++) {
+            float offset = static_cast<float>(i) * 0.2f;
+            for (int j = 0; j < MESHES_PER_RING; j++) {
+                Mesh* m = new Mesh();
+
+                // Make every 5th object a sphere, else make it a cube
+                #if OPT_MESH_LOD
+                    if ((i * MESHES_PER_RING + j) % 5 == 0) *m = Mesh::makeSphereLOD(1.f, 15, 15);
+                #else
+                    if ((i * MESHES_PER_RING + j) % 5 == 0) *m = Mesh::makeSphere(1.f, 15, 15);
+                #endif
+                else *m = Mesh::makeCube(1.f);
+                #if OPT_TRIANGLE_GOURAUD_LIGHTING
+                    // Optimisation - Light the spheres per vertex (a cube face has one normal, it gains nothing)
+                    if ((i * MESHES_PER_RING + j) % 5 == 0) m->shading = ShadingMode::Gouraud;
+                #endif
+                // Only the spheres are textured, the cubes keep the flat triangle fast path
+                if ((i * MESHES_PER_RING + j) % 5 == 0) m->texture = texture;
+                scene.push_back(m);
+
+                // Find the current angle for polar coordinates
+                float theta = (static_cast<float>(j) / MESHES_PER_RING) * 2 * pi;
+                theta += offset;
+
+                // Calculate polar coordinates for the rings, and set the word position of the mesh
+                float x = std::cos(theta) * RING_RADIUS;
+                float y = std::sin(theta) * RING_RADIUS;
+                float z = -RING_DEPTH * static_cast<float>(i);
+                m->world = matrix::makeTranslation(x, y, z);
+
+                // Add rotation speed
+                Rotation r{ rng.getRandomFloat(-.1f, .1f), rng.getRandomFloat(-.1f, .1f) , rng.getRandomFloat(-.1f, .1f) };
+                rotations.push_back(r);
+            }
+        }
+    }
+
+    std::vector<Mesh*> scene;
+    std::vector<Rotation> rotations;
+
+private:
+    // State of the animation before a frame is simulated
+    struct Snapshot {
+        std::vector<matrix> worlds;     // World matrices of the meshes
+        float zoffset;
+        float step;
+    };
+
+    Texture texture;                    // Texture of the spheres
+    std::vector<Snapshot> snapshots;    // State before frame i * SNAPSHOT_INTERVAL, taken as the frames are reached
+    std::uint64_t nextFrame = 0;        // Frame the next advance() simulates
+    float zoffset = START_Z;
+    float step = STEP;
+    matrix view;                        // Camera of the last simulated frame
+
+    // Record the state before nextFrame
+    void takeSnapshot() {
+        Snapshot snapshot{ {}, zoffset, step };
+        snapshot.worlds.reserve(scene.size());
+        for (Mesh* m : scene)
+            snapshot.worlds.push_back(m->world);
+        snapshots.push_back(std::move(snapshot));
+    }
+
+    // Simulate one frame, in the same order as the scene3 loop: the camera, then the animation
+    void advance() {
+        view = matrix::makeTranslation(0.f, 0.f, -zoffset);
+        zoffset += step;
+        if (zoffset < MAX_DEPTH || zoffset > START_Z) step *= -1.f;
+        for (size_t i = 0; i < scene.size(); i++)
+            scene[i]->world = scene[i]->world * matrix::makeRotateXYZ(rotations[i].x, rotations[i].y, rotations[i].z);
+        nextFrame++;
+        if (nextFrame % SNAPSHOT_INTERVAL == 0 && nextFrame / SNAPSHOT_INTERVAL == snapshots.size()) takeSnapshot();
+    }
+
+public:
+    // Build the vortex from a seed (the same seed gives the same scene in every process)
+    // Input Variables:
+    // - seed: Seed of the rotation speeds
+    explicit FlyThrough(unsigned int seed) : texture(makeTexture()) {
+        RandomNumberGenerator rng(seed);
+        build(rng, scene, rotations, &texture);
+        snapshots.reserve(MAX_FRAME / SNAPSHOT_INTERVAL + 1);
+        takeSnapshot();
+    }
+
+    FlyThrough(const FlyThrough&) = delete;
+    FlyThrough& operator=(const FlyThrough&) = delete;
+
+    ~FlyThrough() {
+        for (Mesh* m : scene)
+            delete m;
+    }
+
+    // Move the meshes and the camera to a frame
+    // Frames are replayed one by one (the matrices are accumulated frame after frame, so this is the only way
+    // to reproduce them bit for bit), from the current frame or from the closest snapshot before the frame,
+    // whichever is later (nothing to do if the scene is already at the frame). Once a range has been reached, a seek within it replays fewer than SNAPSHOT_INTERVAL
+    // frames, and the first seek to a frame replays at most MAX_FRAME frames.
+    // Input Variables:
+    // - frame: Frame number, 0 being the first frame of the sequence, at most MAX_FRAME
+    void seek(std::uint64_t frame) {
+        assert(frame <= MAX_FRAME && "Frame beyond the end of the sequence");
+        size_t closest = static_cast<size_t>(std::min<std::uint64_t>(frame / SNAPSHOT_INTERVAL, snapshots.size() - 1));
+        std::uint64_t start = closest * SNAPSHOT_INTERVAL;
+        if (frame + 1 < nextFrame || start > nextFrame) {
+            const Snapshot& snapshot = snapshots[closest];
+            for (size_t i = 0; i < scene.size(); i++)
+                scene[i]->world = snapshot.worlds[i];
+            nextFrame = start;
+            zoffset = snapshot.zoffset;
+            step = snapshot.step;
+        }
+        while (nextFrame <= frame)
+            advance();
+    }
+
+    // Returns the number of frames seek(frame) would replay
+    // Input Variables:
+    // - frame: Frame number, at most MAX_FRAME
+    std::uint64_t seekCost(std::uint64_t frame) const {
+        size_t closest = static_cast<size_t>(std::min<std::uint64_t>(frame / SNAPSHOT_INTERVAL, snapshots.size() - 1));
+        std::uint64_t start = closest * SNAPSHOT_INTERVAL;
+        if (frame + 1 < nextFrame || start > nextFrame) return frame + 1 - start;
+        return frame + 1 - nextFrame;
+    }
+
+    // Returns the camera matrix of the frame the scene was moved to
+    const matrix& camera() const { return view; }
+};
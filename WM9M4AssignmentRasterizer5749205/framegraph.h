@@ -0,0 +1,462 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+#include "arena.h"
+#include "light.h"
+#include "matrix.h"
+#include "mesh.h"
+#include "Multithread.h"
+#include "OptimisationProfiles.h"
+#include "renderer.h"
+#include "taskgraph.h"
+#include "triangle.h"
+#include "trisetup.h"
+
+// One frame of rendering expressed as a task graph over the thread pool
+//
+//   tile clear (per tile) -------------------------------------------------+
+//                                                                          v
+//   animation (per group of meshes) -> visibility -> vertex (per chunk) -> binning (per chunk) -> tile raster (per tile) -> resolve
+//
+// The screen is split into TILE_SIZE x TILE_SIZE tiles. The vertex tasks transform the draw list and run the
+// batched triangle setup, the binning tasks sort the surviving triangles into the tiles their bounds overlap,
+// and every tile is then rasterized by exactly one task, so the canvas and the Z-buffer are written without
+// races. Clearing a tile has no dependencies at all and overlaps the animation and vertex work, and the
+// stages only wait on the tasks they actually read from instead of on a barrier across the whole pool.
+// The transformed vertices, setup triangles and bin lists of a frame are allocated from the frame arena of
+// the thread producing them.
+// With OPT_MULTITHREAD_TILE_COST_MODEL the tiles are not one task each: every thread runs a raster lane that
+// claims tiles from a list sorted by their raster time in the previous frame, most expensive first, and tiles
+// that took a large share of the frame are split into quarters. The dense tiles then start first and no
+// longer finish alone at the end of the frame while the other threads sit idle.
+class FrameGraph {
+public:
+    static constexpr int TILE_SIZE = 64;               // Tile edge in pixels
+    static constexpr size_t ANIMATION_GRAIN = 64;      // Meshes animated per task
+    static constexpr size_t CHUNKS_PER_THREAD = 4;     // Vertex/binning tasks per thread (evens out mesh sizes)
+    static constexpr std::uint64_t HOT_TILE_SHARE = 2; // A tile costing more than 1/HOT_TILE_SHARE of a lane's fair share is split
+
+    // Balance of the tile rasterization, summed over the frames since the last resetTileStats()
+    struct TileStats {
+        std::uint64_t frames = 0;
+        std::uint64_t slowestNs = 0;   // Raster time of the busiest lane
+        std::uint64_t meanNs = 0;      // Mean raster time of the lanes that drew tiles
+        double worstTail = 0.0;        // Largest slowest/mean ratio of a single frame
+        std::uint64_t splitTiles = 0;  // Hot tiles split into quarters
+    };
+
+private:
+    struct BinEntry {
+        unsigned int slot;      // Position of the mesh in the draw list
+        unsigned int triangle;  // Index into the mesh's setup triangles
+    };
+
+    // Array in a frame arena
+    template <typename T>
+    struct Span {
+        T* data = nullptr;
+        unsigned int count = 0;
+    };
+
+    ThreadPool& pool;
+    TaskGraph graph;
+    size_t chunks;                                   // Vertex and binning tasks per frame
+    int tilesX = 0, tilesY = 0;                      // Tile grid size
+    std::vector<Span<BinEntry>> bins;                // Triangles per (chunk, tile), chunk major
+    std::vector<Vertex*> caches;                     // Transformed vertices per draw list slot
+    std::vector<Span<SetupTriangle>> setups;         // Surviving triangles per draw list slot
+    MeshViews views;                                 // Level of detail and meshlet cull per draw list slot
+    std::vector<Mesh*>* drawList = nullptr;          // Set by the visibility task
+    Renderer* renderer = nullptr;
+    const matrix* camera = nullptr;
+    Light* light = nullptr;
+
+    #if OPT_MULTITHREAD_TILE_COST_MODEL
+        // Rectangle rasterized by a lane in one go - a whole tile, or a quarter of a hot one
+        struct TileWork {
+            int tile;
+            int x0, y0, x1, y1;
+            std::uint64_t predicted;  // Raster time expected from the previous frame (ns)
+        };
+
+        std::vector<std::uint64_t> tileCost;   // Raster time of every tile in the previous frame (ns)
+        std::vector<TileWork> work;            // Items of this frame, most expensive first
+        std::vector<std::uint64_t> workAfter;  // Predicted raster time of the items after each one (ns)
+        std::vector<std::uint64_t> workTime;   // Measured raster time of every item (ns)
+        std::vector<std::uint64_t> laneBusy;   // Raster time of every lane (ns)
+        alignas(64) std::atomic<size_t> nextWork = 0;  // Next item to claim
+        std::atomic<size_t> lanesLeft = 0;             // Lanes that may still claim items
+        TileStats lastFrameStats, totalStats;
+    #endif
+
+    // Draw list slots handled by a vertex/binning chunk
+    void chunkRange(size_t chunk, size_t& first, size_t& last) const {
+        size_t count = drawList->size();
+        first = chunk * count / chunks;
+        last = (chunk + 1) * count / chunks;
+    }
+
+    // Vertex stage of one mesh - transform its vertices and set up the triangles that survive culling
+    void processMesh(size_t slot) {
+        const Mesh* mesh = (*drawList)[slot];
+        MeshView& view = views[slot];
+        matrix p = renderer->perspective * *camera * mesh->world;
+        unsigned int width = renderer->getWidth(), height = renderer->getHeight();
+        FrameArena& arena = FrameArena::local();
+        Vertex* cache = arena.allocate<Vertex>(mesh->lodVertices(view.lod).size());
+        Span<SetupTriangle>& out = setups[slot];
+        caches[slot] = cache;
+
+        #if OPT_MESH_MESHLET_CULLING
+            mesh->cullMeshlets(view, *camera * mesh->world, p);
+            mesh->meshletVertexPreProcessing(view, cache, p, width, height, *light);
+
+            const MeshletSet& set = mesh->lodMeshlets(view.lod);
+            size_t capacity = 0;
+            for (unsigned int index : view.visibleMeshlets)
+                capacity += set.meshlets[index].triangleCount;
+            out.data = arena.allocate<SetupTriangle>(capacity);
+
+            unsigned int survivors = 0;
+            for (unsigned int index : view.visibleMeshlets) {
+                const Meshlet& meshlet = set.meshlets[index];
+                const unsigned int* meshletVertices = &set.vertices[meshlet.vertexOffset];
+                const unsigned char* local = &set.indices[meshlet.indexOffset];
+                survivors += setupTriangles(cache, meshlet.triangleCount,
+                    [meshletVertices, local](unsigned int t, unsigned int k) { return meshletVertices[local[3 * t + k]]; },
+                    static_cast<float>(width), static_cast<float>(height), out.data + survivors);
+            }
+            out.count = survivors;
+        #else
+            mesh->vertexPreProcessing(view.lod, cache, p, width, height, *light);
+
+            const std::vector<triIndices>& triangles = mesh->lodTriangles(view.lod);
+            out.data = arena.allocate<SetupTriangle>(triangles.size());
+            out.count = setupTriangles(cache, static_cast<unsigned int>(triangles.size()),
+                [&triangles](unsigned int t, unsigned int k) { return triangles[t].v[k]; },
+                static_cast<float>(width), static_cast<float>(height), out.data);
+        #endif
+    }
+
+    // Call fn(tile, slot, triangle) for every tile each triangle of a chunk overlaps
+    template <typename F>
+    void forEachOverlap(size_t chunk, F&& fn) const {
+        size_t first, last;
+        chunkRange(chunk, first, last);
+        for (size_t slot = first; slot < last; slot++) {
+            const Span<SetupTriangle>& triangles = setups[slot];
+            for (unsigned int i = 0; i < triangles.count; i++) {
+                const SetupTriangle& s = triangles.data[i];
+                int tx0 = s.minX / TILE_SIZE, tx1 = (s.maxX - 1) / TILE_SIZE;
+                int ty0 = s.minY / TILE_SIZE, ty1 = (s.maxY - 1) / TILE_SIZE;
+                for (int ty = ty0; ty <= ty1; ty++)
+                    for (int tx = tx0; tx <= tx1; tx++)
+                        fn(ty * tilesX + tx, static_cast<unsigned int>(slot), i);
+            }
+        }
+    }
+
+    // Binning stage of one chunk - append each triangle to every tile its bounds overlap
+    // The tiles are counted first, so every bin is allocated from the frame arena at its exact size.
+    void binChunk(size_t chunk) {
+        Span<BinEntry>* chunkBins = &bins[chunk * tilesX * tilesY];
+        for (int t = 0; t < tilesX * tilesY; t++)
+            chunkBins[t].count = 0;
+        forEachOverlap(chunk, [chunkBins](int tile, unsigned int, unsigned int) { chunkBins[tile].count++; });
+
+        FrameArena& arena = FrameArena::local();
+        for (int t = 0; t < tilesX * tilesY; t++) {
+            chunkBins[t].data = arena.allocate<BinEntry>(chunkBins[t].count);
+            chunkBins[t].count = 0;
+        }
+        forEachOverlap(chunk, [chunkBins](int tile, unsigned int slot, unsigned int triangle) {
+            Span<BinEntry>& bin = chunkBins[tile];
+            bin.data[bin.count++] = { slot, triangle };
+        });
+    }
+
+    // Pixel rectangle of a tile (max exclusive)
+    void tileRect(int tile, int& x0, int& y0, int& x1, int& y1) const {
+        x0 = (tile % tilesX) * TILE_SIZE;
+        y0 = (tile / tilesX) * TILE_SIZE;
+        x1 = std::min(x0 + TILE_SIZE, static_cast<int>(renderer->getWidth()));
+        y1 = std::min(y0 + TILE_SIZE, static_cast<int>(renderer->getHeight()));
+    }
+
+    // Raster stage of one tile - draw the tile's triangles in submission order, clipped to a rectangle
+    // inside the tile (the whole tile, or part of it)
+    void rasterTile(int tile, int x0, int y0, int x1, int y1) {
+        for (size_t chunk = 0; chunk < chunks; chunk++) {
+            const Span<BinEntry>& bin = bins[chunk * tilesX * tilesY + tile];
+            for (unsigned int i = 0; i < bin.count; i++) {
+                const BinEntry& entry = bin.data[i];
+                const Mesh* mesh = (*drawList)[entry.slot];
+                triangle::drawSetup(*renderer, *light, mesh->ka, mesh->kd, mesh->shading, mesh->texture, caches[entry.slot],
+                                    setups[entry.slot].data[entry.triangle], x0, y0, x1, y1);
+            }
+        }
+    }
+
+    #if OPT_MULTITHREAD_TILE_COST_MODEL
+        // Build this frame's raster items from the previous frame's tile costs: split the hot tiles and sort
+        // the items longest first (a tile with no history is predicted as free and goes last)
+        void planTiles(int tileCount) {
+            if (tileCost.size() != static_cast<size_t>(tileCount)) {
+                tileCost.assign(tileCount, 0);
+                work.reserve(static_cast<size_t>(tileCount) * 4);
+                workTime.reserve(static_cast<size_t>(tileCount) * 4);
+            }
+            std::uint64_t total = 0;
+            for (std::uint64_t cost : tileCost)
+                total += cost;
+            std::uint64_t hot = total / (laneBusy.size() * HOT_TILE_SHARE);
+
+            work.clear();
+            lastFrameStats.splitTiles = 0;
+            for (int tile = 0; tile < tileCount; tile++) {
+                int x0, y0, x1, y1;
+                tileRect(tile, x0, y0, x1, y1);
+                std::uint64_t cost = tileCost[tile];
+                int midX = std::min(x0 + TILE_SIZE / 2, x1), midY = std::min(y0 + TILE_SIZE / 2, y1);
+                if (total == 0 || cost <= hot || midX == x1 || midY == y1) {
+                    work.push_back({ tile, x0, y0, x1, y1, cost });
+                    continue;
+                }
+                // Optimisation - Quarter the hot tile, so it spreads over several lanes
+                work.push_back({ tile, x0, y0, midX, midY, cost / 4 });
+                work.push_back({ tile, midX, y0, x1, midY, cost / 4 });
+                work.push_back({ tile, x0, midY, midX, y1, cost / 4 });
+                work.push_back({ tile, midX, midY, x1, y1, cost / 4 });
+                lastFrameStats.splitTiles++;
+            }
+            std::sort(work.begin(), work.end(), [](const TileWork& a, const TileWork& b) {
+                if (a.predicted != b.predicted) return a.predicted > b.predicted;
+                if (a.tile != b.tile) return a.tile < b.tile;
+                return (a.y0 != b.y0) ? a.y0 < b.y0 : a.x0 < b.x0;
+            });
+            workTime.resize(work.size());
+            workAfter.resize(work.size());
+            std::uint64_t after = 0;
+            for (size_t i = work.size(); i-- > 0;) {
+                workAfter[i] = after;
+                after += work[i].predicted;
+            }
+            nextWork.store(0, std::memory_order_relaxed);
+            lanesLeft.store(laneBusy.size(), std::memory_order_relaxed);
+        }
+
+        // Leave the tiles to the other lanes, unless this is the last lane that may still claim them
+        // Returns true if the lane may stop
+        bool leaveLanes() {
+            size_t left = lanesLeft.load(std::memory_order_relaxed);
+            while (left > 1)
+                if (lanesLeft.compare_exchange_weak(left, left - 1, std::memory_order_relaxed)) return true;
+            return false;
+        }
+
+        // Raster lane - claim items in order until none are left, timing each of them
+        // Optimisation - Claims are weighted by the capacity of the core running the lane: a slower core only
+        // takes an item it is predicted to finish before the whole pool gets through the items left, so the
+        // slow cores take a share proportional to their capacity and the tail of the frame stays on the fast
+        // ones. The last lane still claiming always drains the list, whatever its core.
+        void rasterLane(size_t lane) {
+            using Clock = std::chrono::steady_clock;
+            std::uint64_t busy = 0;
+            float capacity = pool.threadCapacity();
+            bool slow = capacity < ThreadPool::FAST_CAPACITY;
+            float total = pool.totalCapacity();
+            bool left = false;
+            while (true) {
+                size_t i;
+                if (!slow) {
+                    i = nextWork.fetch_add(1, std::memory_order_relaxed);
+                }
+                else {
+                    i = nextWork.load(std::memory_order_relaxed);
+                    if (i < work.size()) {
+                        float alone = static_cast<float>(work[i].predicted) / capacity;
+                        float pooled = static_cast<float>(work[i].predicted + workAfter[i]) / total;
+                        if (alone > pooled && leaveLanes()) {
+                            left = true;
+                            break;
+                        }
+                    }
+                    if (i < work.size() && !nextWork.compare_exchange_weak(i, i + 1, std::memory_order_relaxed)) continue;
+                }
+                if (i >= work.size()) break;
+
+                const TileWork& item = work[i];
+                Clock::time_point start = Clock::now();
+                rasterTile(item.tile, item.x0, item.y0, item.x1, item.y1);
+                std::uint64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+                workTime[i] = elapsed;
+                busy += elapsed;
+            }
+            if (!left) lanesLeft.fetch_sub(1, std::memory_order_relaxed);
+            laneBusy[lane] = busy;
+        }
+
+        // Record the measured costs for the next frame and the balance of this one
+        void finishTiles() {
+            std::fill(tileCost.begin(), tileCost.end(), 0);
+            for (size_t i = 0; i < work.size(); i++)
+                tileCost[work[i].tile] += workTime[i];
+
+            std::uint64_t slowest = 0, total = 0, active = 0;
+            for (std::uint64_t busy : laneBusy) {
+                slowest = std::max(slowest, busy);
+                total += busy;
+                if (busy > 0) active++;
+            }
+            lastFrameStats.frames = 1;
+            lastFrameStats.slowestNs = slowest;
+            lastFrameStats.meanNs = (active > 0) ? total / active : 0;
+            lastFrameStats.worstTail = (lastFrameStats.meanNs > 0) ? static_cast<double>(slowest) / lastFrameStats.meanNs : 0.0;
+
+            totalStats.frames++;
+            totalStats.slowestNs += lastFrameStats.slowestNs;
+            totalStats.meanNs += lastFrameStats.meanNs;
+            totalStats.worstTail = std::max(totalStats.worstTail, lastFrameStats.worstTail);
+            totalStats.splitTiles += lastFrameStats.splitTiles;
+        }
+    #endif
+
+public:
+    // Input Variables:
+    // - threads: Pool the frames are executed on
+    explicit FrameGraph(ThreadPool& threads) : pool(threads), chunks(CHUNKS_PER_THREAD * (threads.size() + 1)) {
+        #if OPT_MULTITHREAD_TILE_COST_MODEL
+            laneBusy.resize(threads.size() + 1);
+        #endif
+    }
+
+    #if OPT_MULTITHREAD_TILE_COST_MODEL
+        // Returns the tile balance of the last frame (slowest lane against the mean, hot tiles split)
+        const TileStats& lastTileStats() const { return lastFrameStats; }
+
+        // Returns the tile balance summed over the frames since the last resetTileStats()
+        const TileStats& tileStats() const { return totalStats; }
+
+        // Start summing the tile balance from zero
+        void resetTileStats() { totalStats = TileStats(); }
+    #endif
+
+    // Animate, cull, render and present one frame, returning once it has been presented
+    // Input Variables:
+    // - target: Renderer to draw into (the canvas is cleared tile by tile, no clear() needed)
+    // - view: Camera matrix of the frame
+    // - L: Light of the frame
+    // - animatedCount: Number of meshes to animate
+    // - animate: Callable (size_t i) advancing mesh i by one frame, called once for every i < animatedCount
+    // - visibility: Callable returning the draw list (std::vector<Mesh*>&), called after the animation
+    template <typename AnimateFn, typename VisibilityFn>
+    void execute(Renderer& target, const matrix& view, Light& L, size_t animatedCount, AnimateFn& animate, VisibilityFn& visibility) {
+        renderer = &target;
+        camera = &view;
+        light = &L;
+
+        // Normalize the light only once, as the direction is fixed!
+        L.omega_i.normalise();
+
+        int width = static_cast<int>(target.getWidth()), height = static_cast<int>(target.getHeight());
+        tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+        tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+        int tileCount = tilesX * tilesY;
+        if (bins.size() < chunks * tileCount) bins.resize(chunks * tileCount);
+
+        FrameGraph* frame = this;
+        AnimateFn* animateFn = &animate;
+        VisibilityFn* visibilityFn = &visibility;
+        graph.clear();
+
+        // Visibility - collect the draw list once every mesh has moved, size the per mesh buffers and pick the
+        // level of detail of every mesh
+        TaskGraph::TaskId visible = graph.add([frame, visibilityFn]() {
+            frame->drawList = &(*visibilityFn)();
+            size_t count = frame->drawList->size();
+            if (frame->caches.size() < count) frame->caches.resize(count);
+            if (frame->setups.size() < count) frame->setups.resize(count);
+            #if OPT_MESH_LOD
+                // Optimisation - Pick each mesh's level of detail from its size on screen
+                const Renderer* r = frame->renderer;
+                frame->views.selectLODs(*frame->drawList, r->perspective * *frame->camera, static_cast<float>(r->getHeight()), r->getNear());
+            #else
+                frame->views.resize(count);
+            #endif
+        });
+
+        // Animation - groups of meshes, all of which must be done before the scene is culled
+        for (size_t first = 0; first < animatedCount; first += ANIMATION_GRAIN) {
+            size_t last = std::min(first + ANIMATION_GRAIN, animatedCount);
+            TaskGraph::TaskId task = graph.add([animateFn, first, last]() {
+                for (size_t i = first; i < last; i++)
+                    (*animateFn)(i);
+            });
+            graph.precede(task, visible);
+        }
+
+        // Vertex processing and binning - a chain per chunk of the draw list, joined before any tile is drawn
+        TaskGraph::TaskId binned = graph.add([]() {});
+        for (size_t chunk = 0; chunk < chunks; chunk++) {
+            TaskGraph::TaskId vertex = graph.add([frame, chunk]() {
+                size_t first, last;
+                frame->chunkRange(chunk, first, last);
+                for (size_t slot = first; slot < last; slot++)
+                    frame->processMesh(slot);
+            });
+            TaskGraph::TaskId bin = graph.add([frame, chunk]() { frame->binChunk(chunk); });
+            graph.precede(visible, vertex);
+            graph.precede(vertex, bin);
+            graph.precede(bin, binned);
+        }
+
+        // Resolve - present the finished canvas (the window belongs to the calling thread)
+        TaskGraph::TaskId resolve = graph.add([frame]() { frame->renderer->present(); }, true);
+
+        #if OPT_MULTITHREAD_TILE_COST_MODEL
+            // Tiles - clear as soon as the frame starts, then one raster lane per thread claims the tiles
+            // longest first once binning is done
+            planTiles(tileCount);
+            for (int tile = 0; tile < tileCount; tile++) {
+                TaskGraph::TaskId clear = graph.add([frame, tile]() {
+                    int x0, y0, x1, y1;
+                    frame->tileRect(tile, x0, y0, x1, y1);
+                    frame->renderer->clearTile(x0, y0, x1, y1);
+                });
+                graph.precede(clear, binned);
+            }
+            for (size_t lane = 0; lane < laneBusy.size(); lane++) {
+                TaskGraph::TaskId raster = graph.add([frame, lane]() { frame->rasterLane(lane); });
+                graph.precede(binned, raster);
+                graph.precede(raster, resolve);
+            }
+
+            graph.run(pool);
+            finishTiles();
+        #else
+            // Tiles - clear as soon as the frame starts, rasterize once binning is done
+            for (int tile = 0; tile < tileCount; tile++) {
+                TaskGraph::TaskId clear = graph.add([frame, tile]() {
+                    int x0, y0, x1, y1;
+                    frame->tileRect(tile, x0, y0, x1, y1);
+                    frame->renderer->clearTile(x0, y0, x1, y1);
+                });
+                TaskGraph::TaskId raster = graph.add([frame, tile]() {
+                    int x0, y0, x1, y1;
+                    frame->tileRect(tile, x0, y0, x1, y1);
+                    frame->rasterTile(tile, x0, y0, x1, y1);
+                });
+                graph.precede(clear, raster);
+                graph.precede(binned, raster);
+                graph.precede(raster, resolve);
+            }
+
+            graph.run(pool);
+        #endif
+    }
+};
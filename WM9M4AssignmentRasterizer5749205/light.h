@@ -5,9 +5,40 @@
 #include "colour.h"
 #include "vec4.h"
 
+class LightTiles;
+
 // Keep light straightforward - struct for storing information
 struct Light {
     vec4 omega_i;    // light direction
     colour L;        // light colour
     colour ambient;  // ambient light component
-};
\ No newline at end of file
+    const LightTiles* tiles = nullptr;  // Additional lights binned to the screen tiles being drawn (none if null)
+};
+
+// Kind of an additional light source
+enum class LightType {
+    Directional,  // Lights every pixel from one direction
+    Point         // Lights the pixels within its range, fading out towards the range
+};
+
+// Additional light source of a scene, on top of the main directional light
+struct LightSource {
+    LightType type;
+    vec4 v;             // Direction towards the light (directional) or position in world space (point)
+    colour L;           // Light colour
+    float range = 0.f;  // Distance the light reaches (point lights only)
+
+    // Returns a directional light shining along -direction (direction points towards the light)
+    static LightSource directional(vec4 direction, colour c) {
+        direction.normalise();
+        return { LightType::Directional, direction, c, 0.f };
+    }
+
+    // Returns a point light at a world space position
+    static LightSource point(const vec4& position, colour c, float range) {
+        return { LightType::Point, position, c, range };
+    }
+};
+
+// Additional lights of a scene
+using LightList = std::vector<LightSource>;
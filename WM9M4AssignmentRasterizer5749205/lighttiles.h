@@ -0,0 +1,221 @@
+#pragma once
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <immintrin.h>
+#include <vector>
+
+#include "colour.h"
+#include "light.h"
+#include "matrix.h"
+#include "OptimisationProfiles.h"
+#include "vec4.h"
+
+// Tiled light culling - the point lights of a LightList binned to the screen tiles their range can reach,
+// so a pixel only loops over the lights of its own tile instead of every light of the scene.
+// Built once per frame (and target) before the draws; the draws only read it, from any number of threads.
+class LightTiles {
+public:
+    static constexpr unsigned int TILE_SIZE = 16;  // Tile edge in pixels
+
+    // Point lights reaching a tile, as indices into the light list
+    struct Tile {
+        const unsigned int* begin;
+        const unsigned int* end;
+    };
+
+private:
+    struct Rect { int x0, y0, x1, y1; };  // Tiles covered by a light (max exclusive)
+
+    const LightList* lights = nullptr;
+    std::vector<unsigned int> directional;  // Directional lights (every tile)
+    std::vector<unsigned int> offsets;      // First entry of every tile in 'indices', followed by the total
+    std::vector<unsigned int> indices;      // Point lights of every tile, tile after tile
+    std::vector<unsigned int> cursor;       // Next free entry of every tile while filling 'indices'
+    std::vector<Rect> rects;                // Tiles covered by every light
+    unsigned int tilesX = 0, tilesY = 0;
+    unsigned int tileWidth = TILE_SIZE, tileHeight = TILE_SIZE;
+    __m128 unproject[4];                    // Pixel (x, y, depth, 1) to homogeneous world space, one column each
+
+    // Screen space rectangle of the tiles a point light can reach
+    // The corners of the light's view space bounding box are projected, so the rectangle is conservative.
+    Rect cover(const LightSource& light, const matrix& camera, const matrix& perspective, float width, float height, float nearPlane) const {
+        vec4 centre = camera * light.v;
+        float depth = -centre.z;
+        if (depth + light.range < nearPlane) return { 0, 0, 0, 0 };  // Entirely behind the camera
+        if (depth - light.range < nearPlane) return { 0, 0, static_cast<int>(tilesX), static_cast<int>(tilesY) };  // Crosses the near plane
+
+        float minX = FLT_MAX, minY = FLT_MAX, maxX = -FLT_MAX, maxY = -FLT_MAX;
+        for (unsigned int i = 0; i < 8; i++) {
+            vec4 corner(centre.x + ((i & 1) ? light.range : -light.range),
+                        centre.y + ((i & 2) ? light.range : -light.range),
+                        centre.z + ((i & 4) ? light.range : -light.range));
+            vec4 clip = perspective * corner;
+            clip.divideW();
+            float x = (clip.x + 1.f) * 0.5f * width;
+            float y = height - (clip.y + 1.f) * 0.5f * height;  // Invert y-axis
+            minX = std::min(minX, x);
+            minY = std::min(minY, y);
+            maxX = std::max(maxX, x);
+            maxY = std::max(maxY, y);
+        }
+
+        // Off the target
+        if (maxX < 0.f || maxY < 0.f || minX >= width || minY >= height) return { 0, 0, 0, 0 };
+        Rect r;
+        r.x0 = static_cast<int>(std::max(minX, 0.f)) / static_cast<int>(tileWidth);
+        r.y0 = static_cast<int>(std::max(minY, 0.f)) / static_cast<int>(tileHeight);
+        r.x1 = std::min(static_cast<int>(std::min(maxX, width - 1.f)) / static_cast<int>(tileWidth) + 1, static_cast<int>(tilesX));
+        r.y1 = std::min(static_cast<int>(std::min(maxY, height - 1.f)) / static_cast<int>(tileHeight) + 1, static_cast<int>(tilesY));
+        return r;
+    }
+
+    // Adds the Lambert term of a point light, fading out smoothly towards its range
+    static void addPoint(colour& a, const LightSource& light, const vec4& position, const vec4& normal, colour albedo) {
+        vec4 d = light.v - position;
+        float distanceSq = vec4::dot(d, d);
+        float rangeSq = light.range * light.range;
+        if (distanceSq >= rangeSq || distanceSq < 1e-12f) return;
+        float dot = vec4::dot(d, normal) / std::sqrt(distanceSq);
+        if (dot <= 0.f) return;
+        float falloff = 1.f - distanceSq / rangeSq;
+        colour c = light.L;
+        a = a + (albedo * c) * (dot * falloff * falloff);
+    }
+
+public:
+    // Bin the lights of a frame to the tiles of a target
+    // Input Variables:
+    // - list: Lights of the frame (must outlive the draws)
+    // - camera: Camera matrix of the frame
+    // - perspective: Projection of the target
+    // - width, height: Size of the target in pixels
+    // - nearPlane: Near clipping plane distance of the projection
+    void build(const LightList& list, const matrix& camera, const matrix& perspective, unsigned int width, unsigned int height, float nearPlane) {
+        lights = &list;
+
+        // Inverse of perspective * camera with the pixel to NDC mapping folded in
+        // (ndc.x = 2x / width - 1, ndc.y = 1 - 2y / height), so unprojecting a pixel is three FMAs
+        matrix screenToWorld = (perspective * camera).inverse();
+        float sx = 2.f / static_cast<float>(std::max(width, 1u)), sy = -2.f / static_cast<float>(std::max(height, 1u));
+        auto column = [&screenToWorld](unsigned int c, float scale) {
+            return _mm_set_ps(screenToWorld(3, c) * scale, screenToWorld(2, c) * scale, screenToWorld(1, c) * scale, screenToWorld(0, c) * scale);
+        };
+        unproject[0] = column(0, sx);
+        unproject[1] = column(1, sy);
+        unproject[2] = column(2, 1.f);
+        unproject[3] = _mm_add_ps(column(3, 1.f), _mm_sub_ps(column(1, 1.f), column(0, 1.f)));
+        #if OPT_SCENE_LIGHT_CULLING
+            tileWidth = tileHeight = TILE_SIZE;
+        #else
+            // Base Rasterizer - one tile covering the whole target, every pixel loops over every point light
+            tileWidth = std::max(width, 1u);
+            tileHeight = std::max(height, 1u);
+        #endif
+        tilesX = (width + tileWidth - 1) / tileWidth;
+        tilesY = (height + tileHeight - 1) / tileHeight;
+        size_t tileCount = static_cast<size_t>(tilesX) * tilesY;
+
+        // Count the lights of every tile
+        directional.clear();
+        rects.resize(list.size());
+        offsets.assign(tileCount + 1, 0);
+        for (size_t i = 0; i < list.size(); i++) {
+            if (list[i].type == LightType::Directional) {
+                directional.push_back(static_cast<unsigned int>(i));
+                rects[i] = { 0, 0, 0, 0 };
+                continue;
+            }
+            rects[i] = cover(list[i], camera, perspective, static_cast<float>(width), static_cast<float>(height), nearPlane);
+            for (int y = rects[i].y0; y < rects[i].y1; y++)
+                for (int x = rects[i].x0; x < rects[i].x1; x++)
+                    offsets[static_cast<size_t>(y) * tilesX + x + 1]++;
+        }
+
+        // Prefix sum, then fill the lists in light order
+        for (size_t t = 0; t < tileCount; t++)
+            offsets[t + 1] += offsets[t];
+        indices.resize(offsets[tileCount]);
+        cursor.assign(offsets.begin(), offsets.end() - 1);
+        for (size_t i = 0; i < list.size(); i++)
+            for (int y = rects[i].y0; y < rects[i].y1; y++)
+                for (int x = rects[i].x0; x < rects[i].x1; x++)
+                    indices[cursor[static_cast<size_t>(y) * tilesX + x]++] = static_cast<unsigned int>(i);
+    }
+
+    // Returns the point lights reaching the tile of pixel (x, y)
+    Tile tile(int x, int y) const {
+        size_t t = static_cast<size_t>(y / static_cast<int>(tileHeight)) * tilesX + x / static_cast<int>(tileWidth);
+        return { indices.data() + offsets[t], indices.data() + offsets[t + 1] };
+    }
+
+    // Returns true if a point light reaches any tile of a pixel rectangle (max exclusive)
+    bool pointLightsIn(int minX, int minY, int maxX, int maxY) const {
+        int x0 = std::max(minX, 0) / static_cast<int>(tileWidth), x1 = std::min((maxX - 1) / static_cast<int>(tileWidth) + 1, static_cast<int>(tilesX));
+        int y0 = std::max(minY, 0) / static_cast<int>(tileHeight), y1 = std::min((maxY - 1) / static_cast<int>(tileHeight) + 1, static_cast<int>(tilesY));
+        for (int y = y0; y < y1; y++)
+            for (int x = x0; x < x1; x++)
+                if (offsets[static_cast<size_t>(y) * tilesX + x + 1] != offsets[static_cast<size_t>(y) * tilesX + x]) return true;
+        return false;
+    }
+
+    // Returns the light the directional lights add to a surface (the same at every pixel of a flat triangle)
+    // Input Variables:
+    // - normal: Normalised world space normal
+    // - albedo: Diffuse colour of the surface (colour * kd)
+    colour shadeDirectional(const vec4& normal, const colour& albedo) const {
+        colour a(0.f, 0.f, 0.f);
+        for (unsigned int i : directional) {
+            const LightSource& light = (*lights)[i];
+            float dot = std::max(vec4::dot(light.v, normal), 0.f);
+            colour c = light.L;
+            a = a + (colour(albedo) * c) * dot;
+        }
+        return a;
+    }
+
+    // Returns the world space position of a pixel, unprojected from its depth
+    // (so the vertices do not have to carry one)
+    // Input Variables:
+    // - x, y: Pixel coordinates
+    // - depth: Depth of the pixel (z / w, as stored in the Z-buffer)
+    vec4 position(int x, int y, float depth) const {
+        __m128 h = _mm_fmadd_ps(unproject[0], _mm_set1_ps(static_cast<float>(x)),
+                   _mm_fmadd_ps(unproject[1], _mm_set1_ps(static_cast<float>(y)),
+                   _mm_fmadd_ps(unproject[2], _mm_set1_ps(depth), unproject[3])));
+        vec4 p;
+        _mm_storeu_ps(p.v, _mm_div_ps(h, _mm_shuffle_ps(h, h, _MM_SHUFFLE(3, 3, 3, 3))));  // Divide by w (w becomes 1)
+        return p;
+    }
+
+    // Returns the light the additional lights add at a pixel, looping only over the point lights of its tile
+    // Input Variables:
+    // - x, y: Pixel coordinates
+    // - depth: Depth of the pixel (only unprojected if a point light reaches the tile)
+    // - normal: Normalised world space normal
+    // - albedo: Diffuse colour of the surface (colour * kd)
+    colour shade(int x, int y, float depth, const vec4& normal, const colour& albedo) const {
+        colour a = shadeDirectional(normal, albedo);
+        Tile t = tile(x, y);
+        if (t.begin != t.end) {
+            vec4 p = position(x, y, depth);
+            for (const unsigned int* i = t.begin; i != t.end; i++)
+                addPoint(a, (*lights)[*i], p, normal, albedo);
+        }
+        return a;
+    }
+
+    // Returns the light every additional light adds at a vertex (Gouraud shading - a vertex has no tile,
+    // and may light pixels of tiles its own position is not in)
+    // Input Variables:
+    // - position: World space position of the vertex
+    // - normal: Normalised world space normal
+    // - albedo: Diffuse colour of the surface (colour * kd)
+    colour shadeVertex(const vec4& position, const vec4& normal, const colour& albedo) const {
+        colour a = shadeDirectional(normal, albedo);
+        for (const LightSource& light : *lights)
+            if (light.type == LightType::Point) addPoint(a, light, position, normal, albedo);
+        return a;
+    }
+};
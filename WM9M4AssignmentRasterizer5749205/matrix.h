@@ -27,6 +27,13 @@ public:
         return m[row][col];
     }
 
+    // Access matrix elements by row and column (const version)
+    float operator()(unsigned int row, unsigned int col) const {
+        assert((row >= 0 && row <= 3) && "There is no such row component!");
+        assert((col >= 0 && col <= 3) && "There is no such column component!");
+        return m[row][col];
+    }
+
     // Display the matrix elements in a readable format
     void display() const {
         for (unsigned int i = 0; i < 4; i++) {
@@ -323,6 +330,36 @@ public:
         return m;
     }
 
+    // Invert the matrix (cofactor expansion, accumulated in double precision)
+    // Returns the inverse, or the identity if the matrix is singular
+    matrix inverse() const {
+        double c[16];
+        c[0] = (double)a[5] * a[10] * a[15] - (double)a[5] * a[11] * a[14] - (double)a[9] * a[6] * a[15] + (double)a[9] * a[7] * a[14] + (double)a[13] * a[6] * a[11] - (double)a[13] * a[7] * a[10];
+        c[4] = -(double)a[4] * a[10] * a[15] + (double)a[4] * a[11] * a[14] + (double)a[8] * a[6] * a[15] - (double)a[8] * a[7] * a[14] - (double)a[12] * a[6] * a[11] + (double)a[12] * a[7] * a[10];
+        c[8] = (double)a[4] * a[9] * a[15] - (double)a[4] * a[11] * a[13] - (double)a[8] * a[5] * a[15] + (double)a[8] * a[7] * a[13] + (double)a[12] * a[5] * a[11] - (double)a[12] * a[7] * a[9];
+        c[12] = -(double)a[4] * a[9] * a[14] + (double)a[4] * a[10] * a[13] + (double)a[8] * a[5] * a[14] - (double)a[8] * a[6] * a[13] - (double)a[12] * a[5] * a[10] + (double)a[12] * a[6] * a[9];
+        c[1] = -(double)a[1] * a[10] * a[15] + (double)a[1] * a[11] * a[14] + (double)a[9] * a[2] * a[15] - (double)a[9] * a[3] * a[14] - (double)a[13] * a[2] * a[11] + (double)a[13] * a[3] * a[10];
+        c[5] = (double)a[0] * a[10] * a[15] - (double)a[0] * a[11] * a[14] - (double)a[8] * a[2] * a[15] + (double)a[8] * a[3] * a[14] + (double)a[12] * a[2] * a[11] - (double)a[12] * a[3] * a[10];
+        c[9] = -(double)a[0] * a[9] * a[15] + (double)a[0] * a[11] * a[13] + (double)a[8] * a[1] * a[15] - (double)a[8] * a[3] * a[13] - (double)a[12] * a[1] * a[11] + (double)a[12] * a[3] * a[9];
+        c[13] = (double)a[0] * a[9] * a[14] - (double)a[0] * a[10] * a[13] - (double)a[8] * a[1] * a[14] + (double)a[8] * a[2] * a[13] + (double)a[12] * a[1] * a[10] - (double)a[12] * a[2] * a[9];
+        c[2] = (double)a[1] * a[6] * a[15] - (double)a[1] * a[7] * a[14] - (double)a[5] * a[2] * a[15] + (double)a[5] * a[3] * a[14] + (double)a[13] * a[2] * a[7] - (double)a[13] * a[3] * a[6];
+        c[6] = -(double)a[0] * a[6] * a[15] + (double)a[0] * a[7] * a[14] + (double)a[4] * a[2] * a[15] - (double)a[4] * a[3] * a[14] - (double)a[12] * a[2] * a[7] + (double)a[12] * a[3] * a[6];
+        c[10] = (double)a[0] * a[5] * a[15] - (double)a[0] * a[7] * a[13] - (double)a[4] * a[1] * a[15] + (double)a[4] * a[3] * a[13] + (double)a[12] * a[1] * a[7] - (double)a[12] * a[3] * a[5];
+        c[14] = -(double)a[0] * a[5] * a[14] + (double)a[0] * a[6] * a[13] + (double)a[4] * a[1] * a[14] - (double)a[4] * a[2] * a[13] - (double)a[12] * a[1] * a[6] + (double)a[12] * a[2] * a[5];
+        c[3] = -(double)a[1] * a[6] * a[11] + (double)a[1] * a[7] * a[10] + (double)a[5] * a[2] * a[11] - (double)a[5] * a[3] * a[10] - (double)a[9] * a[2] * a[7] + (double)a[9] * a[3] * a[6];
+        c[7] = (double)a[0] * a[6] * a[11] - (double)a[0] * a[7] * a[10] - (double)a[4] * a[2] * a[11] + (double)a[4] * a[3] * a[10] + (double)a[8] * a[2] * a[7] - (double)a[8] * a[3] * a[6];
+        c[11] = -(double)a[0] * a[5] * a[11] + (double)a[0] * a[7] * a[9] + (double)a[4] * a[1] * a[11] - (double)a[4] * a[3] * a[9] - (double)a[8] * a[1] * a[7] + (double)a[8] * a[3] * a[5];
+        c[15] = (double)a[0] * a[5] * a[10] - (double)a[0] * a[6] * a[9] - (double)a[4] * a[1] * a[10] + (double)a[4] * a[2] * a[9] + (double)a[8] * a[1] * a[6] - (double)a[8] * a[2] * a[5];
+
+        double det = a[0] * c[0] + a[1] * c[4] + a[2] * c[8] + a[3] * c[12];
+        matrix ret;
+        if (det == 0.0) return ret;
+        double invDet = 1.0 / det;
+        for (unsigned int i = 0; i < 16; i++)
+            ret.a[i] = static_cast<float>(c[i] * invDet);
+        return ret;
+    }
+
 private:
     // Set all elements of the matrix to 0
     void zero() {
@@ -1,11 +1,19 @@
 ﻿#pragma once
 
+#include <algorithm>
+#include <cfloat>
 #include <iostream>
 #include <numbers>
+#include <unordered_map>
 #include <vector>
 
+#include "bounds.h"
 #include "colour.h"
+#include "light.h"
+#include "lighttiles.h"
 #include "matrix.h"
+#include "OptimisationProfiles.h"
+#include "texture.h"
 #include "vec4.h"
 
 // Represents a vertex in a 3D mesh, including its position, normal, and color
@@ -13,6 +21,14 @@ struct Vertex {
     vec4 p;         // Position of the vertex in 3D space
     vec4 normal;    // Normal vector for the vertex
     colour rgb;     // Color of the vertex
+    float u = 0.f;  // Texture coordinates
+    float v = 0.f;
+};
+
+// Where the lighting of a mesh is evaluated
+enum class ShadingMode {
+    Phong,    // Per pixel - the normal is interpolated, normalised and lit at every pixel
+    Gouraud   // Per vertex - every transformed vertex is lit once, the pixel loop only interpolates the colour
 };
 
 // Stores indices of vertices that form a triangle in a mesh
@@ -27,15 +43,235 @@ struct triIndices {
     }
 };
 
+// A small cluster of triangles that is culled as a unit.
+// Vertex and triangle limits follow the usual mesh shader sizes, so local indices fit in a byte
+// and a meshlet's transformed vertices fit in a small array on the stack.
+struct Meshlet {
+    static constexpr unsigned int MAX_VERTICES = 64;    // Maximum vertices referenced by one meshlet
+    static constexpr unsigned int MAX_TRIANGLES = 124;  // Maximum triangles in one meshlet
+
+    unsigned int vertexOffset = 0;    // First entry in MeshletSet::vertices
+    unsigned int indexOffset = 0;     // First entry in MeshletSet::indices
+    unsigned int vertexCount = 0;     // Number of vertices referenced by the meshlet
+    unsigned int triangleCount = 0;   // Number of triangles in the meshlet
+    BoundingSphere bounds;            // Object space bounding sphere of the meshlet's vertices
+    vec4 coneApex;                    // Apex of the normal cone, every triangle plane passes in front of it (object space)
+    vec4 coneAxis = vec4(0.f, 0.f, 0.f, 0.f);  // Average facing direction of the triangles (object space)
+    float coneCutoff = 1.f;           // Sine of the normal cone's half angle, 1 if the cone cannot be used for culling
+};
+
+// Meshlets covering every triangle of a mesh (or of one of its levels of detail)
+struct MeshletSet {
+    static constexpr float MIN_CONE_SPREAD = 0.1f;  // Cones wider than acos(0.1) (~84 degrees) never cull, so are disabled
+    static constexpr float MIN_FACING_ALIGNMENT = 0.9f;  // Triangles facing more than acos(0.9) (~25 degrees) away from a meshlet are not added to it
+
+    std::vector<Meshlet> meshlets;        // List of meshlets
+    std::vector<unsigned int> vertices;   // Mesh vertex index of each meshlet local vertex
+    std::vector<unsigned char> indices;   // Meshlet local vertex indices, 3 per triangle
+
+    // Greedily split a mesh into meshlets
+    // Each meshlet starts at the first unassigned triangle and grows through triangles sharing its vertices,
+    // preferring those adding the fewest new vertices, then those closest to its centre and facing the same way.
+    // Triangles turned too far from the meshlet's average direction start a new meshlet instead, as compact,
+    // flat meshlets give tight bounding spheres and narrow normal cones.
+    // Input Variables:
+    // - meshVertices: Vertices of the mesh
+    // - meshTriangles: Triangles of the mesh
+    void build(const std::vector<Vertex>& meshVertices, const std::vector<triIndices>& meshTriangles) {
+        meshlets.clear();
+        vertices.clear();
+        indices.clear();
+
+        unsigned int vertexTotal = static_cast<unsigned int>(meshVertices.size());
+        unsigned int triangleTotal = static_cast<unsigned int>(meshTriangles.size());
+        if (triangleTotal == 0) return;
+
+        // Triangles using each vertex, as offsets into one flat array
+        std::vector<unsigned int> adjacencyOffset(vertexTotal + 1, 0), adjacency(triangleTotal * 3);
+        for (const triIndices& t : meshTriangles)
+            for (unsigned int k = 0; k < 3; k++) adjacencyOffset[t.v[k] + 1]++;
+        for (unsigned int i = 0; i < vertexTotal; i++)
+            adjacencyOffset[i + 1] += adjacencyOffset[i];
+        std::vector<unsigned int> cursor(adjacencyOffset.begin(), adjacencyOffset.end() - 1);
+        for (unsigned int i = 0; i < triangleTotal; i++)
+            for (unsigned int k = 0; k < 3; k++) adjacency[cursor[meshTriangles[i].v[k]]++] = i;
+
+        // Centroid and unit facing direction of each triangle
+        // The renderer keeps triangles that are clockwise on screen, so the direction a kept triangle faces
+        // (towards the viewer) is (v2 - v0) x (v1 - v0). Degenerate triangles get a zero direction.
+        AABB meshBox;
+        std::vector<vec4> centroids(triangleTotal), facing(triangleTotal);
+        for (unsigned int i = 0; i < triangleTotal; i++) {
+            const vec4& a = meshVertices[meshTriangles[i].v[0]].p;
+            const vec4& b = meshVertices[meshTriangles[i].v[1]].p;
+            const vec4& c = meshVertices[meshTriangles[i].v[2]].p;
+            centroids[i] = vec4((a.x + b.x + c.x) / 3.f, (a.y + b.y + c.y) / 3.f, (a.z + b.z + c.z) / 3.f, 1.f);
+            vec4 n = vec4::cross(c - a, b - a);
+            float lengthSq = vec4::dot(n, n);
+            if (lengthSq > 0.f) n = n * (1.f / std::sqrt(lengthSq));
+            facing[i] = n;
+            meshBox.extend(a); meshBox.extend(b); meshBox.extend(c);
+        }
+        // Distances are scored relative to the mesh size, so the score does not depend on the mesh's units
+        float invSize = 1.f / std::max(FLT_MIN, std::max(meshBox.max[0] - meshBox.min[0], std::max(meshBox.max[1] - meshBox.min[1], meshBox.max[2] - meshBox.min[2])));
+
+        std::vector<bool> used(triangleTotal, false);
+        std::vector<int> local(vertexTotal, -1);  // Local index of each vertex in the meshlet being built
+        unsigned int seed = 0;
+
+        for (unsigned int remaining = triangleTotal; remaining > 0;) {
+            while (used[seed]) seed++;
+
+            Meshlet meshlet;
+            meshlet.vertexOffset = static_cast<unsigned int>(vertices.size());
+            meshlet.indexOffset = static_cast<unsigned int>(indices.size());
+            vec4 centroidSum(0.f, 0.f, 0.f, 0.f), facingSum(0.f, 0.f, 0.f, 0.f);
+
+            for (int next = static_cast<int>(seed); next >= 0;) {
+                // Add the chosen triangle
+                const triIndices& t = meshTriangles[next];
+                for (unsigned int k = 0; k < 3; k++) {
+                    if (local[t.v[k]] < 0) {
+                        local[t.v[k]] = static_cast<int>(meshlet.vertexCount++);
+                        vertices.push_back(t.v[k]);
+                    }
+                    indices.push_back(static_cast<unsigned char>(local[t.v[k]]));
+                }
+                used[next] = true;
+                remaining--;
+                meshlet.triangleCount++;
+                centroidSum = centroidSum + centroids[next];
+                facingSum = facingSum + facing[next];
+                if (meshlet.triangleCount == Meshlet::MAX_TRIANGLES) break;
+
+                // Pick the next triangle among the unused neighbours of the meshlet's vertices
+                float invCount = 1.f / static_cast<float>(meshlet.triangleCount);
+                vec4 centre = centroidSum * invCount;
+                vec4 axis = facingSum;
+                float axisLengthSq = vec4::dot(axis, axis);
+                if (axisLengthSq > 0.f) axis = axis * (1.f / std::sqrt(axisLengthSq));
+
+                next = -1;
+                unsigned int bestExtra = 4;
+                float bestScore = FLT_MAX;
+                for (unsigned int lv = meshlet.vertexOffset; lv < vertices.size(); lv++) {
+                    unsigned int v = vertices[lv];
+                    for (unsigned int j = adjacencyOffset[v]; j < adjacencyOffset[v + 1]; j++) {
+                        unsigned int candidate = adjacency[j];
+                        if (used[candidate]) continue;
+
+                        const triIndices& ct = meshTriangles[candidate];
+                        unsigned int extra = (local[ct.v[0]] < 0) + (local[ct.v[1]] < 0) + (local[ct.v[2]] < 0);
+                        if (meshlet.vertexCount + extra > Meshlet::MAX_VERTICES) continue;
+
+                        float alignment = vec4::dot(facing[candidate], axis);
+                        if (alignment < MIN_FACING_ALIGNMENT && vec4::dot(facing[candidate], facing[candidate]) > 0.f) continue;  // Degenerate triangles fit anywhere
+
+                        vec4 d = centroids[candidate] - centre;
+                        float score = std::sqrt(vec4::dot(d, d)) * invSize + (1.f - vec4::dot(facing[candidate], axis));
+                        if (extra < bestExtra || (extra == bestExtra && score < bestScore)) {
+                            next = static_cast<int>(candidate);
+                            bestExtra = extra;
+                            bestScore = score;
+                        }
+                    }
+                }
+            }
+
+            // Bounding sphere - centre of the vertex AABB, radius to the furthest vertex
+            AABB box;
+            for (unsigned int i = meshlet.vertexOffset; i < vertices.size(); i++)
+                box.extend(meshVertices[vertices[i]].p);
+            meshlet.bounds.centre = vec4(box.centre(0), box.centre(1), box.centre(2), 1.f);
+            float radiusSq = 0.f;
+            for (unsigned int i = meshlet.vertexOffset; i < vertices.size(); i++) {
+                vec4 d = meshVertices[vertices[i]].p - meshlet.bounds.centre;
+                radiusSq = std::max(radiusSq, vec4::dot(d, d));
+                local[vertices[i]] = -1;  // Reset for the next meshlet
+            }
+            meshlet.bounds.radius = std::sqrt(radiusSq);
+
+            // Normal cone - the average facing direction and the widest angle any triangle makes with it
+            float axisLengthSq = vec4::dot(facingSum, facingSum);
+            if (axisLengthSq > 0.f) {
+                vec4 axis = facingSum * (1.f / std::sqrt(axisLengthSq));
+                float minDot = 1.f, maxT = 0.f;
+                for (unsigned int i = 0; i < meshlet.triangleCount; i++) {
+                    // Recover the triangle from its local indices
+                    const unsigned char* tri = &indices[meshlet.indexOffset + 3 * i];
+                    const vec4& a = meshVertices[vertices[meshlet.vertexOffset + tri[0]]].p;
+                    const vec4& b = meshVertices[vertices[meshlet.vertexOffset + tri[1]]].p;
+                    const vec4& c = meshVertices[vertices[meshlet.vertexOffset + tri[2]]].p;
+                    vec4 n = vec4::cross(c - a, b - a);
+                    float lengthSq = vec4::dot(n, n);
+                    if (lengthSq <= 0.f) continue;
+
+                    float dn = vec4::dot(n, axis);
+                    minDot = std::min(minDot, dn / std::sqrt(lengthSq));
+                    // Distance along -axis from the sphere centre to this triangle's plane
+                    if (dn > 0.f) maxT = std::max(maxT, vec4::dot(meshlet.bounds.centre - a, n) / dn);
+                }
+                if (minDot > MIN_CONE_SPREAD) {
+                    // Moving the apex behind every triangle plane makes the test exact for any camera position:
+                    // a camera inside the cone opposite the axis at the apex sees the back of every triangle
+                    vec4 apex = meshlet.bounds.centre - axis * maxT;
+                    meshlet.coneApex = vec4(apex.x, apex.y, apex.z, 1.f);
+                    meshlet.coneAxis = axis;
+                    meshlet.coneCutoff = std::sqrt(1.f - minDot * minDot);
+                }
+            }
+            meshlets.push_back(meshlet);
+        }
+    }
+};
+
+// A coarser version of a mesh's geometry, used while the mesh is small on screen
+struct MeshLOD {
+    std::vector<Vertex> vertices;       // List of vertices in this level
+    std::vector<triIndices> triangles;  // List of triangles in this level
+    MeshletSet meshlets;                // Meshlets of this level
+    float maxScreenRadius;              // Projected radius (pixels) below which this level is used
+};
+
+// Drawing state of one mesh in one renderer (one slot of its draw list) - the level of detail it is drawn at
+// and the meshlets that survived this frame's cull. Kept by the renderer rather than on the Mesh, so renderers
+// sharing meshes can draw them at the same time.
+struct MeshView {
+    unsigned int lod = 0;                       // Selected level of detail, 0 is the full detail geometry
+    std::vector<unsigned int> visibleMeshlets;  // Meshlets of the selected level that survived this frame's cull
+    std::vector<unsigned int> vertexStamp;      // Last cull that referenced each vertex (reused by every mesh in the slot)
+    unsigned int cullStamp = 0;                 // Incremented by every cull, so stamps never need clearing
+};
+
 // Class representing a 3D mesh made up of vertices and triangles
 class Mesh {
 public:
+    static constexpr float LOD_HYSTERESIS = 0.15f;  // Fraction a switch radius must be crossed by before changing level
+
     colour col;       // Uniform color for the mesh
     float kd;         // Diffuse reflection coefficient
     float ka;         // Ambient reflection coefficient
+    ShadingMode shading = ShadingMode::Phong;  // Per pixel or per vertex lighting
+    const Texture* texture = nullptr;          // Texture modulating the vertex colours (not owned, none if null)
     matrix world;     // Transformation matrix for the mesh
-    std::vector<Vertex> vertices;       // List of vertices in the mesh
-    std::vector<triIndices> triangles;  // List of triangles in the mesh
+    std::vector<Vertex> vertices;       // List of vertices in the mesh (full detail)
+    std::vector<triIndices> triangles;  // List of triangles in the mesh (full detail)
+    BoundingSphere bounds;              // Object space bounding sphere (used for scene culling)
+    std::vector<MeshLOD> lods;          // Coarser levels of detail, lods[i] is level i + 1 with decreasing switch radii
+    MeshletSet meshlets;                // Meshlets of the full detail geometry
+
+    // The level drawn and the meshlets that survive culling depend on the view, so they are kept by each
+    // renderer (see MeshView) and passed in; the render side of the mesh is read only and can be drawn by
+    // several renderers at once.
+
+    // Returns the vertices of a level of detail (0 is the full detail geometry)
+    const std::vector<Vertex>& lodVertices(unsigned int lod) const { return (lod == 0) ? vertices : lods[lod - 1].vertices; }
+
+    // Returns the triangles of a level of detail
+    const std::vector<triIndices>& lodTriangles(unsigned int lod) const { return (lod == 0) ? triangles : lods[lod - 1].triangles; }
+
+    // Returns the meshlets of a level of detail
+    const MeshletSet& lodMeshlets(unsigned int lod) const { return (lod == 0) ? meshlets : lods[lod - 1].meshlets; }
 
     // Set the uniform color and reflection coefficients for the mesh
     // Input Variables:
@@ -63,6 +299,15 @@ public:
         vertices.push_back(v);
     }
 
+    // Add a vertex with its normal and texture coordinates to the mesh
+    // Input Variables:
+    // - vertex: Position of the vertex
+    // - normal: Normal vector for the vertex
+    // - u, v: Texture coordinates of the vertex
+    void addVertex(const vec4& vertex, const vec4& normal, float u, float v) {
+        vertices.push_back({ vertex, normal, col, u, v });
+    }
+
     // Add a triangle to the mesh
     // Input Variables:
     // - v1, v2, v3: Indices of the vertices forming the triangle
@@ -70,6 +315,89 @@ public:
         triangles.emplace_back(v1, v2, v3);
     }
 
+    // Compute the object space bounding sphere from the current vertices
+    // Centre is the middle of the vertex AABB, radius the distance to the furthest vertex
+    void computeBounds() {
+        AABB box;
+        for (const Vertex& v : vertices)
+            box.extend(v.p);
+
+        bounds.centre = vec4(box.centre(0), box.centre(1), box.centre(2), 1.f);
+        float radiusSq = 0.f;
+        for (const Vertex& v : vertices) {
+            vec4 d = v.p - bounds.centre;
+            radiusSq = std::max(radiusSq, vec4::dot(d, d));
+        }
+        bounds.radius = std::sqrt(radiusSq);
+    }
+
+    // Split the full detail geometry into meshlets
+    // Must be called again if the vertices or triangles change
+    void buildMeshlets() {
+        meshlets.build(vertices, triangles);
+    }
+
+    // Collect the meshlets of the view's level of detail that may be visible this frame.
+    // A meshlet is rejected if its bounding sphere is outside the view frustum, or (with backface
+    // culling enabled) if its normal cone shows every triangle in it faces away from the camera.
+    // Input Variables:
+    // - view: Level of detail of the mesh in the renderer
+    // - modelView: camera * world matrix, the camera sits at the origin of this space
+    // - p: perspective * camera * world matrix
+    // Output Variables:
+    // - view.visibleMeshlets: Indices of the surviving meshlets
+    void cullMeshlets(MeshView& view, const matrix& modelView, const matrix& p) const {
+        const MeshletSet& set = lodMeshlets(view.lod);
+        Frustum frustum(p);  // Object space frustum
+        std::vector<unsigned int>& visibleMeshlets = view.visibleMeshlets;
+        visibleMeshlets.clear();
+        visibleMeshlets.reserve(set.meshlets.size());  // Only allocates the first time a slot sees a larger mesh
+
+        // Uniform scale of the model view matrix (rotations and translations do not change lengths)
+        float scale = BoundingSphere{ vec4(0.f, 0.f, 0.f, 1.f), 1.f }.transform(modelView).radius;
+
+        for (unsigned int i = 0; i < set.meshlets.size(); i++) {
+            const Meshlet& meshlet = set.meshlets[i];
+            if (!frustum.intersects(meshlet.bounds)) continue;
+
+            #if OPT_TRIANGLE_BACKFACE_CULLING
+                if (meshlet.coneCutoff < 1.f) {
+                    // Every triangle faces away if the direction from the eye (view space origin) to the cone apex
+                    // is within the cone's complement around the axis: dot(apex - eye, axis) >= cutoff * |apex - eye|.
+                    // The view space axis is scaled by 'scale', so the right hand side is scaled to match.
+                    vec4 apex = modelView * meshlet.coneApex;
+                    vec4 axis = modelView * meshlet.coneAxis;
+                    if (vec4::dot(apex, axis) >= meshlet.coneCutoff * std::sqrt(vec4::dot(apex, apex)) * scale) continue;
+                }
+            #endif
+            visibleMeshlets.push_back(i);
+        }
+    }
+
+    // Append a coarser level of detail
+    // Input Variables:
+    // - coarse: Mesh providing the geometry of the level
+    // - maxScreenRadius: Projected radius (pixels) below which the level is used, smaller than the previous level's
+    void addLOD(const Mesh& coarse, float maxScreenRadius) {
+        lods.push_back({ coarse.vertices, coarse.triangles, coarse.meshlets, maxScreenRadius });
+    }
+
+    // Select the level of detail from the projected size of the mesh
+    // A level only changes once its switch radius is crossed by LOD_HYSTERESIS, so meshes hovering
+    // around a threshold do not flicker between levels every frame.
+    // Input Variables:
+    // - current: Level the mesh was last drawn at by the renderer
+    // - screenRadius: Projected bounding sphere radius in pixels
+    // Returns the level to draw the mesh at
+    unsigned int selectLOD(unsigned int current, float screenRadius) const {
+        unsigned int level = std::min(current, static_cast<unsigned int>(lods.size()));
+        while (level < lods.size() && screenRadius < lods[level].maxScreenRadius * (1.f - LOD_HYSTERESIS))
+            level++;
+        while (level > 0 && screenRadius > lods[level - 1].maxScreenRadius * (1.f + LOD_HYSTERESIS))
+            level--;
+        return level;
+    }
+
     // Display the vertices and triangles of the mesh
     void display() const {
         std::cout << "Vertices and Normals:\n";
@@ -107,15 +435,17 @@ public:
         normal.normalise();
 
         // Add vertices with the calculated normal
-        mesh.addVertex(v1, normal);
-        mesh.addVertex(v2, normal);
-        mesh.addVertex(v3, normal);
-        mesh.addVertex(v4, normal);
+        mesh.addVertex(v1, normal, 0.f, 1.f);
+        mesh.addVertex(v2, normal, 1.f, 1.f);
+        mesh.addVertex(v3, normal, 1.f, 0.f);
+        mesh.addVertex(v4, normal, 0.f, 0.f);
 
         // Add two triangles forming the rectangle
         mesh.addTriangle(0, 2, 1);
         mesh.addTriangle(0, 3, 2);
 
+        mesh.computeBounds();
+        mesh.buildMeshlets();
         return mesh;
     }
 
@@ -170,17 +500,19 @@ public:
             int v2 = faceIndices[i][2];
             int v3 = faceIndices[i][3];
 
-            // Add vertices with their normals
-            mesh.addVertex(positions[v0], normals[i]);
-            mesh.addVertex(positions[v1], normals[i]);
-            mesh.addVertex(positions[v2], normals[i]);
-            mesh.addVertex(positions[v3], normals[i]);
+            // Add vertices with their normals, each face maps the whole texture
+            mesh.addVertex(positions[v0], normals[i], 0.f, 1.f);
+            mesh.addVertex(positions[v1], normals[i], 1.f, 1.f);
+            mesh.addVertex(positions[v2], normals[i], 1.f, 0.f);
+            mesh.addVertex(positions[v3], normals[i], 0.f, 0.f);
 
             // Add two triangles for the face
             int baseIndex = i * 4;
             mesh.addTriangle(baseIndex, baseIndex + 2, baseIndex + 1);
             mesh.addTriangle(baseIndex, baseIndex + 3, baseIndex + 2);
         }
+        mesh.computeBounds();
+        mesh.buildMeshlets();
         return mesh;
     }
 
@@ -229,7 +561,8 @@ public:
                 normal.normalise();
                 normal[3] = 0.f;
 
-                mesh.addVertex(position, normal);
+                // Longitude along u, latitude along v (the seam has a vertex on both sides)
+                mesh.addVertex(position, normal, lon * invLongitudeDivisions, lat * invLatitudeDivisions);
             }
         }
 
@@ -245,27 +578,170 @@ public:
                 mesh.addTriangle(v1, v3, v2);
             }
         }
+        mesh.computeBounds();
+        mesh.buildMeshlets();
         return mesh;
     }
 
+    // Generate a sphere mesh with a chain of coarser levels of detail
+    // Each level halves the divisions of the previous one (down to the makeSphere minimum) and is used
+    // once the finer level's triangle edges would be shorter than 'edgePixels' on screen.
+    // Input Variables:
+    // - radius: Radius of the sphere
+    // - latitudeDivisions: Number of divisions along the latitude at full detail
+    // - longitudeDivisions: Number of divisions along the longitude at full detail
+    // - edgePixels: Target on-screen edge length in pixels
+    // Returns a Mesh object representing the sphere, with its levels of detail
+    static Mesh makeSphereLOD(float radius, int latitudeDivisions, int longitudeDivisions, float edgePixels = 8.f) {
+        Mesh mesh = makeSphere(radius, latitudeDivisions, longitudeDivisions);
+        float invTwoPi = 0.5f / std::numbers::pi_v<float>;
+
+        int lat = latitudeDivisions, lon = longitudeDivisions;
+        while (lat > 2 || lon > 3) {
+            // Edge length along the equator is 2 * pi * r / lon, so the finer level is too dense below this radius
+            float switchRadius = edgePixels * static_cast<float>(lon) * invTwoPi;
+            lat = std::max(2, (lat + 1) / 2);
+            lon = std::max(3, (lon + 1) / 2);
+            mesh.addLOD(makeSphere(radius, lat, lon), switchRadius);
+        }
+        return mesh;
+    }
+
+    // Optimisation - Gouraud shading; light a vertex with the same Lambert term as the pixel loop, once per vertex
+    // instead of once per pixel, leaving the lit colour in its rgb (the normal is no longer needed)
+    // Input Variables:
+    // - vertex: Vertex with its normal in world space
+    // - position: Object space position of the vertex (only moved to world space when additional lights are drawn)
+    // - L: Light source
+    void lightVertex(Vertex& vertex, const vec4& position, Light& L) const {
+        colour c = vertex.rgb;
+        c.clampColour();
+        #if !OPT_TRIANGLE_EARLY_LIGHT_NORM
+            L.omega_i.normalise();
+        #endif
+        float dot = std::max(vec4::dot(L.omega_i, vertex.normal), 0.f);
+        vertex.rgb = (c * kd) * (L.L * dot) + (L.ambient * ka);
+        if (L.tiles) {
+            vertex.rgb = vertex.rgb + L.tiles->shadeVertex(world * position, vertex.normal, c * kd);
+            vertex.rgb.clampColour();
+        }
+    }
+
+    // Transform a single vertex to screen space, with its normal in world space
+    // Input Variables:
+    // - in: Object space vertex
+    // - p: perspective * camera * world matrix
+    // - half_width, half_height: Half the canvas size
+    // - height: Canvas height
+    // - L: Light source (used by Gouraud shaded meshes)
+    // Returns the transformed vertex
+    Vertex transformVertex(const Vertex& in, const matrix& p, float half_width, float half_height, float height, Light& L) const {
+        Vertex vertex;
+        vertex.p = p * in.p;   // Apply transformations
+        vertex.p.divideW();    // Perspective division to normalize coordinates
+
+        // Transform normals into world space for accurate lighting
+        vertex.normal = world * in.normal;
+        vertex.normal.normalise();
+
+        // Map normalized device coordinates to screen space
+        vertex.p[0] = (vertex.p[0] + 1.f) * half_width;
+        vertex.p[1] = height - (vertex.p[1] + 1.f) * half_height;  // Invert y-axis
+
+        // Copy vertex colours and texture coordinates
+        vertex.rgb = in.rgb;
+        vertex.u = in.u;
+        vertex.v = in.v;
+        if (shading == ShadingMode::Gouraud) lightVertex(vertex, in.p, L);
+        return vertex;
+    }
+
+    // Call fn(v) once for every vertex of the view's level of detail referenced by the meshlets that survived
+    // cullMeshlets (vertices shared between meshlets are only visited by the first)
+    // Input Variables:
+    // - view: Level of detail and surviving meshlets of the mesh (its vertex stamps are updated)
+    // - fn: Callable (unsigned int v) taking the index of a vertex in lodVertices(view.lod)
+    template <typename F>
+    void forEachMeshletVertex(MeshView& view, F&& fn) const {
+        const MeshletSet& set = lodMeshlets(view.lod);
+        std::vector<unsigned int>& vertexStamp = view.vertexStamp;
+        if (vertexStamp.size() < vertices.size()) vertexStamp.resize(vertices.size(), 0);  // Full detail is the largest level
+        unsigned int stamp = ++view.cullStamp;
+
+        for (unsigned int index : view.visibleMeshlets) {
+            const Meshlet& meshlet = set.meshlets[index];
+            for (unsigned int i = meshlet.vertexOffset; i < meshlet.vertexOffset + meshlet.vertexCount; i++) {
+                unsigned int v = set.vertices[i];
+                if (vertexStamp[v] == stamp) continue;  // Already visited for an earlier meshlet
+                vertexStamp[v] = stamp;
+                fn(v);
+            }
+        }
+    }
+
+    // Optimisation - Transform only the vertices referenced by the meshlets that survived cullMeshlets.
+    // Vertices shared between meshlets are transformed once; the rest of the cache is left untouched.
+    // Input Variables:
+    // - view: Level of detail and surviving meshlets of the mesh (its vertex stamps are updated)
+    // - p: perspective * camera * world matrix
+    // - width, height: Canvas size
+    // - L: Light source (used by Gouraud shaded meshes)
+    // Output Variables:
+    // - vertexCache: Transformed vertices, indexed like lodVertices(view.lod) (at least that many entries)
+    void meshletVertexPreProcessing(MeshView& view, Vertex* vertexCache, const matrix& p, unsigned int width, unsigned int height, Light& L) const {
+        const std::vector<Vertex>& source = lodVertices(view.lod);
+        float half_width = 0.5f * static_cast<float>(width);
+        float half_height = 0.5f * static_cast<float>(height);
+        forEachMeshletVertex(view, [&](unsigned int v) {
+            vertexCache[v] = transformVertex(source[v], p, half_width, half_height, static_cast<float>(height), L);
+        });
+    }
+
+    // Optimisation - Transform only the vertices referenced by one meshlet of a level of detail
+    // Meshlets can be transformed independently (e.g. on different threads), at the cost of transforming
+    // vertices on meshlet borders more than once.
+    // Input Variables:
+    // - lod: Level of detail the meshlet belongs to
+    // - meshlet: Meshlet to transform
+    // - p: perspective * camera * world matrix
+    // - width, height: Canvas size
+    // - L: Light source (used by Gouraud shaded meshes)
+    // Output Variables:
+    // - vertexCache: Transformed vertices in meshlet local order (at least Meshlet::MAX_VERTICES entries)
+    void meshletPreProcessing(unsigned int lod, const Meshlet& meshlet, Vertex* vertexCache, const matrix& p, unsigned int width, unsigned int height, Light& L) const {
+        const std::vector<Vertex>& source = lodVertices(lod);
+        const unsigned int* meshletVertices = &lodMeshlets(lod).vertices[meshlet.vertexOffset];
+        float half_width = 0.5f * static_cast<float>(width);
+        float half_height = 0.5f * static_cast<float>(height);
+
+        for (unsigned int i = 0; i < meshlet.vertexCount; i++)
+            vertexCache[i] = transformVertex(source[meshletVertices[i]], p, half_width, half_height, static_cast<float>(height), L);
+    }
+
     // Optimisation - Vertex Caching to avoid redundant calculations (e.g. re-calculating same vertices)
-    void vertexPreProcessing(std::vector<Vertex>& vertexCache, matrix& p, unsigned int width, unsigned int height) {
-        // Allocate memory in the cache, according to the vertices size
-        vertexCache.resize(vertices.size());
+    // Input Variables:
+    // - lod: Level of detail to transform
+    // - p: perspective * camera * world matrix
+    // - width, height: Canvas size
+    // - L: Light source (Gouraud shaded meshes are lit here, once per vertex)
+    // Output Variables:
+    // - vertexCache: Transformed vertices (at least lodVertices(lod).size() entries, e.g. from the frame arena)
+    void vertexPreProcessing(unsigned int lod, Vertex* vertexCache, const matrix& p, unsigned int width, unsigned int height, Light& L) const {
+        const std::vector<Vertex>& source = lodVertices(lod);
         #if OPT_RASTER_DISABLE_REDUNDANT_HALF_WIDTH_HEIGH_MUL
             float half_width = 0.5f * static_cast<float>(width);
             float half_height = 0.5f * static_cast<float>(height);
         #endif
 
         // Transform each vertex of the triangle
-        for (unsigned int i = 0; i < vertices.size(); i++) {
+        for (unsigned int i = 0; i < source.size(); i++) {
             Vertex vertex;
-            vertex.p = p * vertices[i].p;  // Apply transformations
+            vertex.p = p * source[i].p;  // Apply transformations
             vertex.p.divideW();            // Perspective division to normalize coordinates
 
             // Transform normals into world space for accurate lighting
             // no need for perspective correction as no shearing or non-uniform scaling
-            vertex.normal = world * vertices[i].normal;
+            vertex.normal = world * source[i].normal;
             vertex.normal.normalise();
 
             // Map normalized device coordinates to screen space
@@ -278,9 +754,54 @@ public:
             #endif
             vertex.p[1] = height - vertex.p[1]; // Invert y-axis
 
-            // Copy vertex colours
-            vertex.rgb = vertices[i].rgb;
+            // Copy vertex colours and texture coordinates
+            vertex.rgb = source[i].rgb;
+            vertex.u = source[i].u;
+            vertex.v = source[i].v;
+            if (shading == ShadingMode::Gouraud) lightVertex(vertex, source[i].p, L);
             vertexCache[i] = vertex;
         }
     }
-};
\ No newline at end of file
+};
+
+// Per renderer drawing state of a draw list - a MeshView for every slot, and the level each mesh was last drawn
+// at. The draw list changes as meshes are culled, so the level is also remembered per mesh for the hysteresis
+// of Mesh::selectLOD to carry over between frames.
+class MeshViews {
+    std::vector<MeshView> slots;
+    std::unordered_map<const Mesh*, unsigned int> levels;  // Last level of every mesh drawn with a level of detail
+
+public:
+    // Make room for a draw list of 'count' meshes (the views of earlier frames are kept)
+    void resize(size_t count) {
+        if (slots.size() < count) slots.resize(count);
+    }
+
+    MeshView& operator[](size_t slot) { return slots[slot]; }
+
+    // Pick the level of detail of every slot of a draw list from the projected size of its mesh
+    // Input Variables:
+    // - drawList: Meshes about to be rendered
+    // - vp: perspective * camera matrix
+    // - height: Canvas height in pixels
+    // - nearPlane: Near plane distance of the projection
+    void selectLODs(const std::vector<Mesh*>& drawList, const matrix& vp, float height, float nearPlane) {
+        resize(drawList.size());
+        for (size_t i = 0; i < drawList.size(); i++) {
+            const Mesh* m = drawList[i];
+            slots[i].lod = 0;
+            if (m->lods.empty()) continue;
+            float radius = m->bounds.transform(m->world).projectedRadius(vp, height, nearPlane);
+            unsigned int& level = levels[m];
+            level = m->selectLOD(level, (radius < 0.f) ? FLT_MAX : radius);  // Crossing the near plane - use full detail
+            slots[i].lod = level;
+        }
+    }
+
+    // Forget the levels of earlier frames, so the next selection only depends on its own frame
+    void forgetLevels() {
+        levels.clear();
+        for (MeshView& view : slots)
+            view.lod = 0;
+    }
+};
@@ -0,0 +1,270 @@
+#pragma once
+
+#include <algorithm>
+#include <cfloat>
+#include <cstdint>
+#include <vector>
+
+#include "arena.h"
+#include "bounds.h"
+#include "light.h"
+#include "lighttiles.h"
+#include "matrix.h"
+#include "mesh.h"
+#include "Multithread.h"
+#include "renderer.h"
+#include "triangle.h"
+#include "trisetup.h"
+
+// One viewpoint of a multi-view frame
+struct View {
+    matrix camera;          // Camera matrix of the view
+    RenderTarget* target;   // Target the view is drawn into (with its own size and projection)
+};
+
+// Multi-view rendering - draw the same scene from N cameras into N render targets in one pass
+//
+//   shared (per group of meshes):  bounding sphere, frustum test against every view, LOD, world space vertices
+//   per view (per view x mesh):    meshlet cull, projection to the target's screen, batched triangle setup
+//   per view (per view x band):    clear and rasterize BAND_ROWS rows of the target
+//
+// The per-mesh work is done once however many views there are: the world space sphere is tested against
+// every view's frustum into a bit mask, and the vertices are moved to world space (normals included) once,
+// so each view only applies its view-projection matrix. The views then set up and rasterize in parallel;
+// every band of a target is drawn by one task in submission order, so the result matches drawing each view
+// on its own. The level of detail is chosen once per mesh, for the view it appears largest in, while the
+// meshlets are culled per view: each (view, mesh) pair keeps its own list of surviving meshlets, and only
+// projects the vertices and sets up the triangles of those.
+class MultiViewRenderer {
+public:
+    static constexpr size_t MAX_VIEWS = 32;        // Views per frame (one bit each in the visibility masks)
+    static constexpr size_t MESH_GRAIN = 8;        // Meshes per task in the shared stage
+    static constexpr size_t SETUP_GRAIN = 8;       // (view, mesh) pairs per task in the setup stage
+    static constexpr unsigned int BAND_ROWS = 64;  // Rows of a target rasterized per task
+
+private:
+    // Triangles of one mesh as seen from one view
+    struct ViewMesh {
+        Vertex* vertices = nullptr;       // Screen space vertices
+        SetupTriangle* setups = nullptr;  // Surviving triangles
+        unsigned int count = 0;
+    };
+
+    ThreadPool& pool;
+    FrameContext frames;                       // Arenas and jobs of the renderer's frames
+    std::vector<Frustum> frusta;               // World space frustum of every view
+    std::vector<matrix> viewProjections;       // perspective * camera of every view
+    std::vector<std::uint32_t> masks;          // Views each mesh is visible in (bit per view)
+    std::vector<Vertex*> worldVertices;        // World space vertices of every visible mesh
+    MeshViews meshViews;                       // Level of detail of every mesh (the scene order is fixed, so it carries over)
+    std::vector<MeshView> meshletViews;        // Meshlet cull per (view, mesh), view major
+    std::vector<ViewMesh> viewMeshes;          // Per (view, mesh), view major
+    std::vector<size_t> bandOffsets;           // First (view, band) task of every view, followed by the total
+    std::vector<LightTiles> lightTiles;        // Additional lights binned to the tiles of every view
+    std::vector<Light> viewLights;             // Light of the frame, with the tiles of every view
+
+    // Shared stage of one mesh - cull it against every view, pick its level of detail and move its vertices to world space
+    // (Gouraud meshes are also lit here, the directional light does not depend on the view)
+    void shareMesh(Mesh* mesh, size_t index, const View* views, size_t viewCount, Light& L) {
+        BoundingSphere sphere = mesh->bounds.transform(mesh->world);
+        std::uint32_t mask = 0;
+        float radius = 0.f;
+        for (size_t v = 0; v < viewCount; v++) {
+            if (!frusta[v].intersects(sphere)) continue;
+            mask |= 1u << v;
+            float r = sphere.projectedRadius(viewProjections[v], static_cast<float>(views[v].target->getHeight()), views[v].target->getNear());
+            radius = (r < 0.f || radius == FLT_MAX) ? FLT_MAX : std::max(radius, r);  // Crossing a near plane - use full detail
+        }
+        masks[index] = mask;
+        if (mask == 0) return;
+
+        #if OPT_MESH_LOD
+            meshViews[index].lod = mesh->selectLOD(meshViews[index].lod, radius);
+        #endif
+
+        const std::vector<Vertex>& source = mesh->lodVertices(meshViews[index].lod);
+        Vertex* out = FrameArena::local().allocate<Vertex>(source.size());
+        for (size_t i = 0; i < source.size(); i++) {
+            out[i].p = mesh->world * source[i].p;
+            out[i].normal = mesh->world * source[i].normal;
+            out[i].normal.normalise();
+            out[i].rgb = source[i].rgb;
+            out[i].u = source[i].u;
+            out[i].v = source[i].v;
+            if (mesh->shading == ShadingMode::Gouraud) mesh->lightVertex(out[i], source[i].p, L);
+        }
+        worldVertices[index] = out;
+    }
+
+    // Setup stage of one mesh in one view - project its world space vertices and set up its triangles
+    // (only those of the meshlets that survive the view's cull with OPT_MESH_MESHLET_CULLING)
+    void setupViewMesh(const std::vector<Mesh*>& scene, const View* views, size_t view, size_t index) {
+        ViewMesh& out = viewMeshes[view * scene.size() + index];
+        out.count = 0;
+        if (!(masks[index] & (1u << view))) return;
+
+        const Mesh* mesh = scene[index];
+        unsigned int lod = meshViews[index].lod;
+        RenderTarget& target = *views[view].target;
+        const matrix& vp = viewProjections[view];
+        const Vertex* world = worldVertices[index];
+        size_t vertexCount = mesh->lodVertices(lod).size();
+        float half_width = 0.5f * static_cast<float>(target.getWidth());
+        float half_height = 0.5f * static_cast<float>(target.getHeight());
+
+        FrameArena& arena = FrameArena::local();
+        out.vertices = arena.allocate<Vertex>(vertexCount);
+        Vertex* vertices = out.vertices;
+        auto project = [&](size_t i) {
+            Vertex& vertex = vertices[i];
+            vertex.p = vp * world[i].p;
+            vertex.p.divideW();
+            vertex.p[0] = (vertex.p[0] + 1.f) * half_width;
+            vertex.p[1] = static_cast<float>(target.getHeight()) - (vertex.p[1] + 1.f) * half_height;  // Invert y-axis
+            vertex.normal = world[i].normal;
+            vertex.rgb = world[i].rgb;
+            vertex.u = world[i].u;
+            vertex.v = world[i].v;
+        };
+
+        #if OPT_MESH_MESHLET_CULLING
+            // Optimisation - Reject the meshlets outside this view or facing away from its camera, then only project
+            // the vertices the survivors use
+            MeshView& cull = meshletViews[view * scene.size() + index];
+            cull.lod = lod;
+            mesh->cullMeshlets(cull, views[view].camera * mesh->world, vp * mesh->world);
+            mesh->forEachMeshletVertex(cull, project);
+
+            const MeshletSet& set = mesh->lodMeshlets(lod);
+            size_t capacity = 0;
+            for (unsigned int m : cull.visibleMeshlets)
+                capacity += set.meshlets[m].triangleCount;
+            out.setups = arena.allocate<SetupTriangle>(capacity);
+
+            for (unsigned int m : cull.visibleMeshlets) {
+                const Meshlet& meshlet = set.meshlets[m];
+                const unsigned int* meshletVertices = &set.vertices[meshlet.vertexOffset];
+                const unsigned char* local = &set.indices[meshlet.indexOffset];
+                out.count += setupTriangles(vertices, meshlet.triangleCount,
+                    [meshletVertices, local](unsigned int t, unsigned int k) { return meshletVertices[local[3 * t + k]]; },
+                    static_cast<float>(target.getWidth()), static_cast<float>(target.getHeight()), out.setups + out.count);
+            }
+        #else
+            for (size_t i = 0; i < vertexCount; i++)
+                project(i);
+
+            const std::vector<triIndices>& triangles = mesh->lodTriangles(lod);
+            out.setups = arena.allocate<SetupTriangle>(triangles.size());
+            out.count = setupTriangles(vertices, static_cast<unsigned int>(triangles.size()),
+                [&triangles](unsigned int t, unsigned int k) { return triangles[t].v[k]; },
+                static_cast<float>(target.getWidth()), static_cast<float>(target.getHeight()), out.setups);
+        #endif
+    }
+
+    // Raster stage of one band of a view - clear the rows, then draw the view's triangles clipped to them
+    void rasterBand(const std::vector<Mesh*>& scene, const View* views, size_t view, unsigned int band) {
+        Light& L = viewLights[view];
+        RenderTarget& target = *views[view].target;
+        int y0 = static_cast<int>(band * BAND_ROWS);
+        int y1 = std::min(y0 + static_cast<int>(BAND_ROWS), static_cast<int>(target.getHeight()));
+        int width = static_cast<int>(target.getWidth());
+        target.clearRect(0, y0, width, y1);
+
+        for (size_t index = 0; index < scene.size(); index++) {
+            const ViewMesh& mesh = viewMeshes[view * scene.size() + index];
+            for (unsigned int i = 0; i < mesh.count; i++) {
+                const SetupTriangle& s = mesh.setups[i];
+                if (s.maxY <= y0 || s.minY >= y1) continue;
+                triangle::drawSetupView(target, L, scene[index]->ka, scene[index]->kd, scene[index]->shading, scene[index]->texture, mesh.vertices, s, 0, y0, width, y1);
+            }
+        }
+    }
+
+public:
+    // Input Variables:
+    // - threads: Pool the views are rendered on
+    explicit MultiViewRenderer(ThreadPool& threads) : pool(threads), frames(threads) {
+        frusta.reserve(MAX_VIEWS);
+    }
+
+    // Start a new frame (recycles the renderer's frame arenas) and bind the calling thread to it, so this thread
+    // drives the frame. Call once the previous frame's data is no longer needed.
+    void beginFrame() {
+        frames.beginFrame();
+        pool.bind(&frames);
+    }
+
+    // Frame context the renderer's jobs run under, for a thread that helps run them (see ThreadPool::bind)
+    FrameContext& context() { return frames; }
+
+    // Forget the levels of detail of earlier frames, so the next frame is drawn as if it were the first
+    // (for frames drawn out of order, e.g. after FlyThrough::seek)
+    void forgetLevels() { meshViews.forgetLevels(); }
+
+    // Draw a scene from every view into its render target
+    // The meshes must already be animated for the frame; the per-frame buffers come from the frame arena, so
+    // beginFrame() must have been called on this thread.
+    // Input Variables:
+    // - scene: Meshes to draw
+    // - views: Cameras and their render targets
+    // - viewCount: Number of views (at most MAX_VIEWS)
+    // - L: Light of the frame (its tiles are ignored, every view bins 'lights' to its own tiles)
+    // - lights: Additional lights of the frame (optional)
+    void render(const std::vector<Mesh*>& scene, const View* views, size_t viewCount, Light& L, const LightList* lights = nullptr) {
+        viewCount = std::min(viewCount, MAX_VIEWS);
+        size_t meshCount = scene.size();
+
+        // Normalize the light only once, as the direction is fixed!
+        L.omega_i.normalise();
+
+        // Bin the additional lights to the tiles of every view
+        lightTiles.resize(std::max(lightTiles.size(), viewCount));
+        viewLights.assign(viewCount, L);
+        for (size_t v = 0; v < viewCount; v++) {
+            viewLights[v].tiles = nullptr;
+            if (!lights) continue;
+            RenderTarget& target = *views[v].target;
+            lightTiles[v].build(*lights, views[v].camera, target.perspective, target.getWidth(), target.getHeight(), target.getNear());
+            viewLights[v].tiles = &lightTiles[v];
+        }
+        Light& shared = viewCount > 0 ? viewLights[0] : L;  // Gouraud lighting only needs the light list
+
+        frusta.clear();
+        viewProjections.resize(viewCount);
+        bandOffsets.resize(viewCount + 1);
+        bandOffsets[0] = 0;
+        for (size_t v = 0; v < viewCount; v++) {
+            viewProjections[v] = views[v].target->perspective * views[v].camera;
+            frusta.emplace_back(viewProjections[v]);
+            unsigned int bands = (views[v].target->getHeight() + BAND_ROWS - 1) / BAND_ROWS;
+            bandOffsets[v + 1] = bandOffsets[v] + bands;
+        }
+        if (masks.size() < meshCount) masks.resize(meshCount);
+        if (worldVertices.size() < meshCount) worldVertices.resize(meshCount);
+        meshViews.resize(meshCount);
+        if (viewMeshes.size() < viewCount * meshCount) viewMeshes.resize(viewCount * meshCount);
+        #if OPT_MESH_MESHLET_CULLING
+            if (meshletViews.size() < viewCount * meshCount) meshletViews.resize(viewCount * meshCount);
+        #endif
+
+        // Shared - once per mesh for every view
+        pool.parallel_for(meshCount, MESH_GRAIN, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++)
+                shareMesh(scene[i], i, views, viewCount, shared);
+        });
+
+        // Per view - project and set up
+        pool.parallel_for(viewCount * meshCount, SETUP_GRAIN, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++)
+                setupViewMesh(scene, views, i / meshCount, i % meshCount);
+        });
+
+        // Per view - rasterize the bands of every target
+        pool.parallel_for(bandOffsets[viewCount], 1, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                size_t view = std::upper_bound(bandOffsets.begin(), bandOffsets.end(), i) - bandOffsets.begin() - 1;
+                rasterBand(scene, views, view, static_cast<unsigned int>(i - bandOffsets[view]));
+            }
+        });
+    }
+};
@@ -0,0 +1,251 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <immintrin.h>
+#include <utility>
+#include <vector>
+
+#include "bounds.h"
+#include "matrix.h"
+#include "mesh.h"
+
+// Low resolution software occlusion buffer (in the spirit of masked occlusion culling).
+// Large occluders are rasterized conservatively: a pixel is only written if it is fully covered by the occluder,
+// and it stores the occluder's furthest depth. Any mesh whose screen rectangle is behind every stored depth
+// is guaranteed to be hidden in the full resolution Z-buffer too, so it can be skipped before vertex processing.
+// Depth uses the same convention as the Z-buffer (z / w, 0 = near, 1 = far).
+class OcclusionBuffer {
+public:
+    static constexpr int WIDTH = 256;   // Buffer width in pixels (multiple of 8 for the AVX loops)
+    static constexpr int HEIGHT = 128;  // Buffer height in pixels
+    static constexpr int MASK_WORDS = WIDTH / 64;  // 64-bit coverage words per row
+
+private:
+    std::vector<float> depth;  // WIDTH * HEIGHT depth values, row major
+    float nearPlane;           // Clip space w below which geometry is treated as crossing the near plane
+    std::vector<std::pair<float, Mesh*>> occluders;  // Scratch list of occluder candidates (projected radius, mesh)
+    std::vector<vec4> transformed;                   // Scratch buffer space vertices of the current occluder
+    std::vector<uint64_t> coverage;                  // Coverage bit mask of the current occluder, one bit per pixel
+
+    // Transform a point to buffer space (x, y in pixels, z = depth, w = clip space w)
+    // Uses the same NDC to screen mapping as the renderer (including the inverted y-axis)
+    vec4 toBuffer(const matrix& p, const vec4& v) const {
+        vec4 c = p * v;
+        float invW = 1.f / c.w;
+        return vec4((c.x * invW + 1.f) * (0.5f * WIDTH), HEIGHT - (c.y * invW + 1.f) * (0.5f * HEIGHT), c.z * invW, c.w);
+    }
+
+public:
+    // Input Variables:
+    // - n: Near plane distance of the projection used with this buffer
+    OcclusionBuffer(float n = 0.1f) : depth(WIDTH * HEIGHT), nearPlane(n), coverage(HEIGHT * MASK_WORDS) {
+        clear();
+    }
+
+    // Reset every pixel to the far plane
+    void clear() {
+        __m256 vOne = _mm256_set1_ps(1.f);
+        for (size_t i = 0; i < depth.size(); i += 8)
+            _mm256_storeu_ps(&depth[i], vOne);
+    }
+
+    // Rasterize the front faces of a mesh as an occluder
+    // The faces are first rasterized (sampling pixel centres) into a coverage bit mask, which is then eroded by one pixel:
+    // a pixel whose 3x3 neighbourhood centres are all covered is fully covered by the (convex) projected mesh,
+    // so seams between triangles are filled in while silhouettes stay conservative.
+    // Covered pixels receive the furthest front face depth of the mesh.
+    // The full detail geometry is used, the level of detail a mesh is drawn at belongs to each renderer.
+    // Input Variables:
+    // - mesh: Occluder mesh
+    // - p: Combined perspective * camera * world matrix of the mesh
+    void rasterizeOccluder(const Mesh& mesh, const matrix& p) {
+        const __m256 xOffsets = _mm256_setr_ps(0.5f, 1.5f, 2.5f, 3.5f, 4.5f, 5.5f, 6.5f, 7.5f);
+        const __m256 vZero = _mm256_setzero_ps();
+
+        // Transform each vertex once, triangles share them
+        const std::vector<Vertex>& vertices = mesh.vertices;
+        transformed.resize(vertices.size());
+        for (size_t i = 0; i < vertices.size(); i++)
+            transformed[i] = toBuffer(p, vertices[i].p);
+
+        int boundsX0 = WIDTH, boundsX1 = -1, boundsY0 = HEIGHT, boundsY1 = -1;
+        float occluderDepth = 0.f;
+
+        for (const triIndices& ind : mesh.triangles) {
+            const vec4 v[3] = { transformed[ind.v[0]], transformed[ind.v[1]], transformed[ind.v[2]] };
+
+            // Skip rather than clip triangles crossing the near plane, which keeps the result conservative
+            if (v[0].w < nearPlane || v[1].w < nearPlane || v[2].w < nearPlane) continue;
+
+            // Same winding test as the renderer's backface culling
+            float signedArea = (v[1].x - v[0].x) * (v[2].y - v[0].y) - (v[1].y - v[0].y) * (v[2].x - v[0].x);
+            if (signedArea <= 0.f) continue;
+            occluderDepth = std::max({ occluderDepth, v[0].z, v[1].z, v[2].z });
+
+            int x0 = std::max(0, static_cast<int>(std::floor(std::min({ v[0].x, v[1].x, v[2].x }))));
+            int x1 = std::min(WIDTH - 1, static_cast<int>(std::ceil(std::max({ v[0].x, v[1].x, v[2].x }))));
+            int y0 = std::max(0, static_cast<int>(std::floor(std::min({ v[0].y, v[1].y, v[2].y }))));
+            int y1 = std::min(HEIGHT - 1, static_cast<int>(std::ceil(std::max({ v[0].y, v[1].y, v[2].y }))));
+            if (x0 > x1 || y0 > y1) continue;
+
+            // Clear the mask rows the first time the occluder's bounds grow over them
+            int newY0 = std::min(boundsY0, y0), newY1 = std::max(boundsY1, y1);
+            for (int y = newY0; y <= newY1; y++) {
+                if (y >= boundsY0 && y <= boundsY1) continue;
+                for (int w = 0; w < MASK_WORDS; w++)
+                    coverage[y * MASK_WORDS + w] = 0;
+            }
+            boundsX0 = std::min(boundsX0, x0); boundsX1 = std::max(boundsX1, x1);
+            boundsY0 = newY0; boundsY1 = newY1;
+
+            // Edge functions E(x, y) = A * x + B * y + C, positive inside (matches triangle::getC)
+            float A[3], B[3], C[3];
+            for (unsigned int e = 0; e < 3; e++) {
+                const vec4& a = v[e];
+                const vec4& b = v[(e + 1) % 3];
+                A[e] = a.y - b.y;
+                B[e] = b.x - a.x;
+                C[e] = -(A[e] * a.x + B[e] * a.y);
+            }
+
+            __m256 vA0 = _mm256_set1_ps(A[0]), vA1 = _mm256_set1_ps(A[1]), vA2 = _mm256_set1_ps(A[2]);
+            int xStart = x0 & ~7;
+
+            for (int y = y0; y <= y1; y++) {
+                float yc = static_cast<float>(y) + 0.5f;
+                __m256 row0 = _mm256_set1_ps(B[0] * yc + C[0]);
+                __m256 row1 = _mm256_set1_ps(B[1] * yc + C[1]);
+                __m256 row2 = _mm256_set1_ps(B[2] * yc + C[2]);
+                uint64_t* line = &coverage[y * MASK_WORDS];
+
+                for (int x = xStart; x <= x1; x += 8) {
+                    __m256 xs = _mm256_add_ps(_mm256_set1_ps(static_cast<float>(x)), xOffsets);
+                    __m256 e0 = _mm256_fmadd_ps(vA0, xs, row0);
+                    __m256 e1 = _mm256_fmadd_ps(vA1, xs, row1);
+                    __m256 e2 = _mm256_fmadd_ps(vA2, xs, row2);
+                    __m256 inside = _mm256_and_ps(_mm256_cmp_ps(e0, vZero, _CMP_GE_OQ),
+                                    _mm256_and_ps(_mm256_cmp_ps(e1, vZero, _CMP_GE_OQ), _mm256_cmp_ps(e2, vZero, _CMP_GE_OQ)));
+                    line[x >> 6] |= static_cast<uint64_t>(_mm256_movemask_ps(inside)) << (x & 63);
+                }
+            }
+        }
+        if (boundsX0 > boundsX1) return;  // Nothing front facing on screen
+
+        // Erode the mask by one pixel and write the occluder depth under the surviving pixels
+        // (pixels on the outer rows and columns of the bounds can never survive the erosion)
+        const __m256i bitSelect = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+        __m256 vDepth = _mm256_set1_ps(occluderDepth);
+        for (int y = boundsY0 + 1; y < boundsY1; y++) {
+            const uint64_t* above = &coverage[(y - 1) * MASK_WORDS];
+            const uint64_t* line = &coverage[y * MASK_WORDS];
+            const uint64_t* below = &coverage[(y + 1) * MASK_WORDS];
+            uint64_t vertical[MASK_WORDS];
+            for (int w = 0; w < MASK_WORDS; w++)
+                vertical[w] = above[w] & line[w] & below[w];
+
+            float* depthLine = &depth[y * WIDTH];
+            for (int w = 0; w < MASK_WORDS; w++) {
+                // Horizontal erosion with the neighbouring pixels, carrying bits across word boundaries
+                uint64_t left = (vertical[w] << 1) | ((w > 0) ? (vertical[w - 1] >> 63) : 0);
+                uint64_t right = (vertical[w] >> 1) | ((w + 1 < MASK_WORDS) ? (vertical[w + 1] << 63) : 0);
+                uint64_t solid = vertical[w] & left & right;
+                if (solid == 0) continue;
+
+                for (int b = 0; b < 64; b += 8) {
+                    unsigned int bits = static_cast<unsigned int>((solid >> b) & 0xFF);
+                    if (bits == 0) continue;
+                    __m256 mask = _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(bits), bitSelect), bitSelect));
+                    float* d = depthLine + w * 64 + b;
+                    __m256 current = _mm256_loadu_ps(d);
+                    _mm256_storeu_ps(d, _mm256_blendv_ps(current, _mm256_min_ps(current, vDepth), mask));
+                }
+            }
+        }
+    }
+
+    // Minimum projected radius (buffer pixels) for a mesh to be used as an occluder
+    static constexpr float OCCLUDER_MIN_RADIUS = 8.f;
+    // Maximum number of occluders rasterized per frame, the largest ones on screen are kept
+    static constexpr size_t MAX_OCCLUDERS = 16;
+
+    // Clear the buffer, pick the largest on-screen meshes and rasterize them as occluders
+    // Input Variables:
+    // - candidates: Meshes that passed frustum culling
+    // - vp: Combined perspective * camera matrix
+    void rasterizeOccluders(const std::vector<Mesh*>& candidates, const matrix& vp) {
+        clear();
+
+        occluders.clear();
+        for (Mesh* m : candidates) {
+            float r = m->bounds.transform(m->world).projectedRadius(vp, static_cast<float>(HEIGHT), nearPlane);
+            if (r >= OCCLUDER_MIN_RADIUS) occluders.emplace_back(r, m);
+        }
+
+        size_t count = std::min(occluders.size(), MAX_OCCLUDERS);
+        std::partial_sort(occluders.begin(), occluders.begin() + count, occluders.end(),
+            [](const std::pair<float, Mesh*>& a, const std::pair<float, Mesh*>& b) { return a.first > b.first; });
+
+        for (size_t i = 0; i < count; i++)
+            rasterizeOccluder(*occluders[i].second, vp * occluders[i].second->world);
+    }
+
+    // Test a world space box against the buffer
+    // Input Variables:
+    // - box: World space bounds to test
+    // - vp: Combined perspective * camera matrix
+    // Returns false only if the box is certainly hidden behind the rasterized occluders
+    bool isVisible(const AABB& box, const matrix& vp) const {
+        // Clip space bounds of the box from its centre and half extents (two transforms instead of eight corners)
+        vec4 centre(box.centre(0), box.centre(1), box.centre(2), 1.f);
+        vec4 extent(0.5f * (box.max[0] - box.min[0]), 0.5f * (box.max[1] - box.min[1]), 0.5f * (box.max[2] - box.min[2]), 0.f);
+        vec4 c = vp * centre;
+        float e[4];
+        for (unsigned int row = 0; row < 4; row++)
+            e[row] = std::fabs(vp(row, 0)) * extent.x + std::fabs(vp(row, 1)) * extent.y + std::fabs(vp(row, 2)) * extent.z;
+
+        float minW = c.w - e[3], maxW = c.w + e[3];
+        if (minW < nearPlane) return true;  // Crosses the near plane - cannot be tested reliably
+
+        // With w > 0, x / w over the box is bounded by the extreme x over the extreme w
+        float minNX = (c.x - e[0]) / ((c.x - e[0] >= 0.f) ? maxW : minW);
+        float maxNX = (c.x + e[0]) / ((c.x + e[0] >= 0.f) ? minW : maxW);
+        float minNY = (c.y - e[1]) / ((c.y - e[1] >= 0.f) ? maxW : minW);
+        float maxNY = (c.y + e[1]) / ((c.y + e[1] >= 0.f) ? minW : maxW);
+
+        // Depth is not independent of w (z / w only depends on view distance), so take it at the box corner nearest the camera
+        float nearZ = c.z;
+        for (unsigned int col = 0; col < 3; col++)
+            nearZ -= ((vp(3, col) >= 0.f) ? vp(2, col) : -vp(2, col)) * extent[col];
+        float minZ = std::min(1.f, nearZ / minW);
+
+        float minX = (minNX + 1.f) * (0.5f * WIDTH), maxX = (maxNX + 1.f) * (0.5f * WIDTH);
+        float minY = HEIGHT - (maxNY + 1.f) * (0.5f * HEIGHT), maxY = HEIGHT - (minNY + 1.f) * (0.5f * HEIGHT);
+
+        int x0 = std::max(0, static_cast<int>(std::floor(minX)));
+        int x1 = std::min(WIDTH - 1, static_cast<int>(std::ceil(maxX)));
+        int y0 = std::max(0, static_cast<int>(std::floor(minY)));
+        int y1 = std::min(HEIGHT - 1, static_cast<int>(std::ceil(maxY)));
+        if (x0 > x1 || y0 > y1) return false;  // Entirely off-screen
+
+        const __m256 laneIndex = _mm256_setr_ps(0.f, 1.f, 2.f, 3.f, 4.f, 5.f, 6.f, 7.f);
+        __m256 vMinZ = _mm256_set1_ps(minZ);
+        __m256 vX0 = _mm256_set1_ps(static_cast<float>(x0) - 0.5f);
+        __m256 vX1 = _mm256_set1_ps(static_cast<float>(x1) + 0.5f);
+        int xStart = x0 & ~7;
+
+        for (int y = y0; y <= y1; y++) {
+            const float* line = &depth[y * WIDTH];
+            for (int x = xStart; x <= x1; x += 8) {
+                // Visible if the box's nearest depth is in front of any stored occluder depth in its rectangle
+                __m256 xs = _mm256_add_ps(_mm256_set1_ps(static_cast<float>(x)), laneIndex);
+                __m256 inRect = _mm256_and_ps(_mm256_cmp_ps(xs, vX0, _CMP_GT_OQ), _mm256_cmp_ps(xs, vX1, _CMP_LT_OQ));
+                __m256 inFront = _mm256_cmp_ps(vMinZ, _mm256_loadu_ps(line + x), _CMP_LE_OQ);
+                __m256 hit = _mm256_and_ps(inRect, inFront);
+                if (!_mm256_testz_ps(hit, hit)) return true;
+            }
+        }
+        return false;
+    }
+};
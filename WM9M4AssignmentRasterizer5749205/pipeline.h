@@ -0,0 +1,82 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#include "matrix.h"
+#include "mesh.h"
+#include "Multithread.h"
+#include "taskgraph.h"
+
+// Pipelined animation - the world matrices of the next frame are simulated on the pool while the current
+// frame is rendered
+//
+//   main thread:  | next() | render frame N   | next() | render frame N+1 | ...
+//   pool:                  | animate frame N+1 |        | animate frame N+2 |
+//
+// The scene state is double buffered: the simulation advances its own copy of the world matrices, and the
+// meshes' world matrices are the snapshot the renderer reads. next() waits for the simulation in flight,
+// publishes it to the meshes and starts simulating the frame after, so the renderer never sees a matrix
+// being written. The animation no longer delays the rasterization, at the cost of one frame of latency
+// between the simulation and the screen.
+class AnimationPipeline {
+public:
+    static constexpr size_t ANIMATION_GRAIN = 64;  // Meshes animated per task
+
+private:
+    ThreadPool& pool;
+    std::vector<Mesh*>& meshes;
+    std::vector<matrix> worlds;  // Simulation side of the double buffer
+    TaskGraph graph;
+    bool inFlight = false;       // A simulation was launched and not joined yet
+
+    // Start animating 'worlds' by one frame on the pool
+    template <typename AnimateFn>
+    void launch(AnimateFn& animate) {
+        AnimationPipeline* self = this;
+        AnimateFn* animateFn = &animate;
+        graph.clear();
+        for (size_t first = 0; first < worlds.size(); first += ANIMATION_GRAIN) {
+            size_t last = std::min(first + ANIMATION_GRAIN, worlds.size());
+            graph.add([self, animateFn, first, last]() {
+                for (size_t i = first; i < last; i++)
+                    (*animateFn)(i, self->worlds[i]);
+            });
+        }
+        graph.launch(pool);
+        inFlight = true;
+    }
+
+public:
+    // Input Variables:
+    // - threads: Pool the simulation runs on
+    // - scene: Meshes of the scene, the first 'animatedCount' of which are animated
+    // - animatedCount: Number of animated meshes
+    AnimationPipeline(ThreadPool& threads, std::vector<Mesh*>& scene, size_t animatedCount)
+        : pool(threads), meshes(scene), worlds(animatedCount) {
+        for (size_t i = 0; i < animatedCount; i++)
+            worlds[i] = scene[i]->world;
+    }
+
+    AnimationPipeline(const AnimationPipeline&) = delete;
+    AnimationPipeline& operator=(const AnimationPipeline&) = delete;
+
+    ~AnimationPipeline() {
+        if (inFlight) graph.join();
+    }
+
+    // Move on to the next frame: publish the simulated world matrices to the meshes, then start simulating
+    // the frame after on the pool. Call once per frame before rendering; the first call simulates its frame
+    // straight away so the first frame matches an unpipelined one.
+    // Input Variables:
+    // - animate: Callable (size_t i, matrix& world) advancing mesh i's world matrix by one frame
+    //   (must stay alive until the next call or the pipeline is destroyed)
+    template <typename AnimateFn>
+    void next(AnimateFn& animate) {
+        if (!inFlight) launch(animate);
+        graph.join();
+        for (size_t i = 0; i < worlds.size(); i++)
+            meshes[i]->world = worlds[i];
+        launch(animate);
+    }
+};
@@ -1,43 +1,217 @@
 #include <algorithm>
+#include <atomic>
+#include <barrier>
+#include <cstdlib>
 #include <future>
 #include <iostream>
+#include <new>
 #include <numbers>
 #include <chrono>
-
-#include "GamesEngineeringBase.h"  // Include the GamesEngineeringBase header
+#include <thread>
+
+#ifdef _WIN32
+    #include "GamesEngineeringBase.h"  // Include the GamesEngineeringBase header (window and input, Windows only)
+#endif
+#include "arena.h"
+#include "bvh.h"
+#include "compositor.h"
+#include "coroutine.h"
+#include "distributed.h"
+#include "flythrough.h"
+#include "framegraph.h"
 #include "Multithread.h"
 #include "matrix.h"
 #include "colour.h"
 #include "mesh.h"
+#include "multiview.h"
+#include "occlusion.h"
+#include "pipeline.h"
+#include "taskgraph.h"
 #include "zbuffer.h"
 #include "renderer.h"
 #include "RNG.h"
+#include "service.h"
 #include "light.h"
+#include "lighttiles.h"
 #include "triangle.h"
 
+#if DEBUG_COUNT_ALLOCATIONS
+// Debug - Count every call to operator new, to check that the frame loop does not allocate once warmed up
+static std::atomic<std::uint64_t> allocationCount = 0;
+
+void* operator new(std::size_t size) {
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment) {
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    size_t align = static_cast<size_t>(alignment);
+    #ifdef _WIN32
+        void* p = _aligned_malloc(size ? size : 1, align);
+    #else
+        void* p = std::aligned_alloc(align, ((size ? size : 1) + align - 1) & ~(align - 1));
+    #endif
+    if (p) return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+#ifdef _WIN32
+void operator delete(void* p, std::align_val_t) noexcept { _aligned_free(p); }
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept { _aligned_free(p); }
+#else
+void operator delete(void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+#endif
+
+// Print the number of allocations since the last call
+static void printAllocations() {
+    static std::uint64_t last = 0;
+    std::uint64_t now = allocationCount.load(std::memory_order_relaxed);
+    std::cout << "  operator new calls: " << now - last << "\n";
+    last = allocationCount.load(std::memory_order_relaxed);  // Leave out the print's own allocations
+}
+#endif
+
+// Optimisation - Batched triangle setup; cull and set up the triangles 8 at a time, then rasterize the survivors
+// Input Variables:
+// - renderer: The Renderer object used for drawing.
+// - L: Light object representing the lighting parameters.
+// - mesh: Mesh the triangles belong to (for its reflection coefficients).
+// - vertices: Transformed vertices.
+// - triangleCount: Number of triangles to draw.
+// - index: Callable (triangle, corner) returning the index of a triangle's vertex in 'vertices'.
+// - atomicTarget: Optional packed depth + colour buffer to draw into with lock-free writes instead of the canvas.
+// - layerTarget: Optional private layer of the calling thread to draw into instead of the canvas (sort-last).
+template <typename IndexFn>
+static void renderBatched(Renderer& renderer, Light& L, const Mesh* mesh, const Vertex* vertices, unsigned int triangleCount, IndexFn&& index,
+                          AtomicZbuffer* atomicTarget = nullptr, DepthLayer* layerTarget = nullptr) {
+    constexpr unsigned int BATCH_SIZE = 128;  // Triangles set up before rasterizing (keeps the setup data in L1)
+    SetupTriangle setup[BATCH_SIZE];
+    float width = static_cast<float>(renderer.getWidth());
+    float height = static_cast<float>(renderer.getHeight());
+
+    for (unsigned int first = 0; first < triangleCount; first += BATCH_SIZE) {
+        unsigned int count = std::min(BATCH_SIZE, triangleCount - first);
+        unsigned int survivors = setupTriangles(vertices, count, [&index, first](unsigned int t, unsigned int k) { return index(first + t, k); }, width, height, setup);
+        for (unsigned int i = 0; i < survivors; i++) {
+            if (layerTarget != nullptr) triangle::drawSetupLayer(*layerTarget, L, mesh->ka, mesh->kd, mesh->shading, mesh->texture, vertices, setup[i]);
+            else if (atomicTarget != nullptr) triangle::drawSetupAtomic(*atomicTarget, L, mesh->ka, mesh->kd, mesh->shading, mesh->texture, vertices, setup[i]);
+            else triangle::drawSetup(renderer, L, mesh->ka, mesh->kd, mesh->shading, mesh->texture, vertices, setup[i]);
+        }
+    }
+}
+
+// Draw a range of meshlets of a mesh, transforming each meshlet's vertices independently (used by the worker threads)
+// Input Variables:
+// - renderer: The Renderer object used for drawing.
+// - mesh: Mesh owning the meshlets.
+// - lod: Level of detail the meshlets belong to.
+// - p: perspective * camera * world matrix.
+// - L: Light object representing the lighting parameters.
+// - meshletIndices, count: Indices of the meshlets to draw.
+// - atomicTarget: Optional packed depth + colour buffer to draw into with lock-free writes (batched setup only).
+// - layerTarget: Optional private layer of the calling thread to draw into (batched setup only).
+static void renderMeshlets(Renderer& renderer, const Mesh* mesh, unsigned int lod, const matrix& p, Light& L, const unsigned int* meshletIndices, size_t count,
+                           AtomicZbuffer* atomicTarget = nullptr, DepthLayer* layerTarget = nullptr) {
+    const MeshletSet& set = mesh->lodMeshlets(lod);
+    Vertex vertexCache[Meshlet::MAX_VERTICES];  // Transformed vertices of the current meshlet
+
+    for (size_t m = 0; m < count; m++) {
+        const Meshlet& meshlet = set.meshlets[meshletIndices[m]];
+        mesh->meshletPreProcessing(lod, meshlet, vertexCache, p, renderer.getWidth(), renderer.getHeight(), L);
+
+        const unsigned char* index = &set.indices[meshlet.indexOffset];
+        #if OPT_TRIANGLE_BATCH_SETUP
+            renderBatched(renderer, L, mesh, vertexCache, meshlet.triangleCount,
+                [index](unsigned int t, unsigned int k) { return static_cast<unsigned int>(index[3 * t + k]); }, atomicTarget, layerTarget);
+        #else
+            for (unsigned int i = 0; i < meshlet.triangleCount; i++, index += 3) {
+                const Vertex& v0 = vertexCache[index[0]];
+                const Vertex& v1 = vertexCache[index[1]];
+                const Vertex& v2 = vertexCache[index[2]];
+
+                // Clip triangles with Z-values outside [-1, 1]
+                if (fabs(v0.p[2]) > 1.f || fabs(v1.p[2]) > 1.f || fabs(v2.p[2]) > 1.f) continue;
+
+                // Create a triangle object and render it
+                triangle tri(v0, v1, v2);
+                tri.draw(renderer, L, mesh->ka, mesh->kd, mesh->shading, mesh->texture);
+            }
+        #endif
+    }
+}
+
 // Main rendering function that processes a mesh, transforms its vertices, applies lighting, and draws triangles on the canvas.
 // Input Variables:
 // - renderer: The Renderer object used for drawing.
 // - mesh: Pointer to the Mesh object containing vertices and triangles to render.
+// - view: Level of detail and meshlet cull of the mesh in this renderer.
 // - camera: Matrix representing the camera's transformation.
 // - L: Light object representing the lighting parameters.
-static void render(Renderer& renderer, Mesh* mesh, matrix& camera, Light& L) {
+static void render(Renderer& renderer, const Mesh* mesh, MeshView& view, matrix& camera, Light& L) {
     // Combine perspective, camera, and world transformations for the mesh
     matrix p = renderer.perspective * camera * mesh->world;
+    const std::vector<Vertex>& source = mesh->lodVertices(view.lod);
 
     #if OPT_TRIANGLE_EARLY_LIGHT_NORM
         // Optimisation - Normalize the light only once, as the direction is fixed!
         L.omega_i.normalise();
     #endif
 
+    #if OPT_MESH_MESHLET_CULLING
+        // Optimisation - Reject off-screen and back-facing meshlets, then only transform the vertices the survivors use
+        mesh->cullMeshlets(view, camera * mesh->world, p);
+        Vertex* meshletCache = FrameArena::local().allocate<Vertex>(source.size());
+        mesh->meshletVertexPreProcessing(view, meshletCache, p, renderer.getWidth(), renderer.getHeight(), L);
+
+        const MeshletSet& set = mesh->lodMeshlets(view.lod);
+        for (unsigned int index : view.visibleMeshlets) {
+            const Meshlet& meshlet = set.meshlets[index];
+            const unsigned int* meshletVertices = &set.vertices[meshlet.vertexOffset];
+            const unsigned char* local = &set.indices[meshlet.indexOffset];
+            #if OPT_TRIANGLE_BATCH_SETUP
+                renderBatched(renderer, L, mesh, meshletCache, meshlet.triangleCount,
+                    [meshletVertices, local](unsigned int t, unsigned int k) { return meshletVertices[local[3 * t + k]]; });
+            #else
+                for (unsigned int i = 0; i < meshlet.triangleCount; i++, local += 3) {
+                    const Vertex& v0 = meshletCache[meshletVertices[local[0]]];
+                    const Vertex& v1 = meshletCache[meshletVertices[local[1]]];
+                    const Vertex& v2 = meshletCache[meshletVertices[local[2]]];
+
+                    // Clip triangles with Z-values outside [-1, 1]
+                    if (fabs(v0.p[2]) > 1.f || fabs(v1.p[2]) > 1.f || fabs(v2.p[2]) > 1.f) continue;
+
+                    // Create a triangle object and render it
+                    triangle tri(v0, v1, v2);
+                    tri.draw(renderer, L, mesh->ka, mesh->kd, mesh->shading, mesh->texture);
+                }
+            #endif
+        }
+        return;
+    #endif
+
     #if OPT_RASTER_ENABLE_VERTEX_CACHING
         // Optimisation - Vertex Caching to avoid redundant calculations (e.g. re-calculating same vertices)
-        std::vector<Vertex> vertexCache;
-        mesh->vertexPreProcessing(vertexCache, p, renderer.canvas.getWidth(), renderer.canvas.getHeight());
+        // The cache comes from the frame arena, so no heap allocation per mesh per frame
+        Vertex* vertexCache = FrameArena::local().allocate<Vertex>(source.size());
+        mesh->vertexPreProcessing(view.lod, vertexCache, p, renderer.getWidth(), renderer.getHeight(), L);
+
+        #if OPT_TRIANGLE_BATCH_SETUP
+            // Optimisation - Batched triangle setup on the cached vertices
+            const std::vector<triIndices>& triangles = mesh->lodTriangles(view.lod);
+            renderBatched(renderer, L, mesh, vertexCache, static_cast<unsigned int>(triangles.size()),
+                [&triangles](unsigned int t, unsigned int k) { return triangles[t].v[k]; });
+            return;
+        #endif
     #endif
 
     // Iterate through all triangles in the mesh
-    for (triIndices& ind : mesh->triangles) {
+    for (const triIndices& ind : mesh->lodTriangles(view.lod)) {
         Vertex t[3];  // Temporary array to store transformed triangle vertices
 
         #if OPT_RASTER_ENABLE_VERTEX_CACHING
@@ -47,17 +221,17 @@ static void render(Renderer& renderer, Mesh* mesh, matrix& camera, Light& L) {
             t[2] = vertexCache[ind.v[2]];
         #else
             #if OPT_RASTER_DISABLE_REDUNDANT_HALF_WIDTH_HEIGH_MUL
-                float half_width = 0.5f * static_cast<float>(renderer.canvas.getWidth());
-                float half_height = 0.5f * static_cast<float>(renderer.canvas.getHeight());
+                float half_width = 0.5f * static_cast<float>(renderer.getWidth());
+                float half_height = 0.5f * static_cast<float>(renderer.getHeight());
             #endif
             // Transform each vertex of the triangle
             for (unsigned int i = 0; i < 3; i++) {
-                t[i].p = p * mesh->vertices[ind.v[i]].p; // Apply transformations
+                t[i].p = p * source[ind.v[i]].p; // Apply transformations
                 t[i].p.divideW(); // Perspective division to normalize coordinates
 
                 // Transform normals into world space for accurate lighting
                 // no need for perspective correction as no shearing or non-uniform scaling
-                t[i].normal = mesh->world * mesh->vertices[ind.v[i]].normal;
+                t[i].normal = mesh->world * source[ind.v[i]].normal;
                 t[i].normal.normalise();
 
                 // Map normalized device coordinates to screen space
@@ -65,13 +239,16 @@ static void render(Renderer& renderer, Mesh* mesh, matrix& camera, Light& L) {
                     t[i].p[0] = (t[i].p[0] + 1.f) * half_width;
                     t[i].p[1] = (t[i].p[1] + 1.f) * half_height;
                 #else
-                    t[i].p[0] = (t[i].p[0] + 1.f) * 0.5f * static_cast<float>(renderer.canvas.getWidth());
-                    t[i].p[1] = (t[i].p[1] + 1.f) * 0.5f * static_cast<float>(renderer.canvas.getHeight());
+                    t[i].p[0] = (t[i].p[0] + 1.f) * 0.5f * static_cast<float>(renderer.getWidth());
+                    t[i].p[1] = (t[i].p[1] + 1.f) * 0.5f * static_cast<float>(renderer.getHeight());
                 #endif
-                t[i].p[1] = renderer.canvas.getHeight() - t[i].p[1]; // Invert y-axis
+                t[i].p[1] = renderer.getHeight() - t[i].p[1]; // Invert y-axis
 
                 // Copy vertex colours
-                t[i].rgb = mesh->vertices[ind.v[i]].rgb;
+                t[i].rgb = source[ind.v[i]].rgb;
+                t[i].u = source[ind.v[i]].u;
+                t[i].v = source[ind.v[i]].v;
+                if (mesh->shading == ShadingMode::Gouraud) mesh->lightVertex(t[i], source[ind.v[i]].p, L);
             }
         #endif
         // Clip triangles with Z-values outside [-1, 1]
@@ -79,59 +256,301 @@ static void render(Renderer& renderer, Mesh* mesh, matrix& camera, Light& L) {
 
         // Create a triangle object and render it
         triangle tri(t[0], t[1], t[2]);
-        tri.draw(renderer, L, mesh->ka, mesh->kd);
+        tri.draw(renderer, L, mesh->ka, mesh->kd, mesh->shading, mesh->texture);
+    }
+}
+
+#ifdef _WIN32  // The interactive scenes (and their helpers) need the window backend
+// Print how the workers spent their time since the last call (running jobs, spinning for work, parked)
+// Input Variables:
+// - pool: Thread pool to report on
+static void printPoolStats(ThreadPool& pool) {
+    PoolStats stats = pool.stats();
+    double total = static_cast<double>(stats.busyNs + stats.spinNs + stats.parkNs);
+    if (total <= 0.0) return;
+    std::cout << "  workers - busy " << 100.0 * stats.busyNs / total << "%, spin " << 100.0 * stats.spinNs / total
+              << "%, parked " << 100.0 * stats.parkNs / total << "% (" << stats.parks << " parks)\n";
+    if (stats.slowTotalNs > 0 && total > static_cast<double>(stats.slowTotalNs)) {
+        // Hybrid CPUs - how busy each core class kept its workers
+        double fastBusy = static_cast<double>(stats.busyNs - stats.slowBusyNs) / (total - static_cast<double>(stats.slowTotalNs));
+        double slowBusy = static_cast<double>(stats.slowBusyNs) / static_cast<double>(stats.slowTotalNs);
+        std::cout << "  core classes - fast cores busy " << 100.0 * fastBusy << "%, slow cores busy " << 100.0 * slowBusy << "%\n";
     }
+    pool.resetStats();
+}
+
+#if OPT_MULTITHREAD_TASK_GRAPH && OPT_MULTITHREAD_TILE_COST_MODEL
+// Print how evenly the tiles were spread over the raster lanes since the last call (per frame averages)
+static void printTileStats(FrameGraph& frameGraph) {
+    const FrameGraph::TileStats& stats = frameGraph.tileStats();
+    if (stats.frames == 0 || stats.meanNs == 0) return;
+    double frames = static_cast<double>(stats.frames);
+    std::cout << "  tiles - slowest lane " << stats.slowestNs / frames / 1e6 << "ms, mean lane " << stats.meanNs / frames / 1e6
+              << "ms (tail " << static_cast<double>(stats.slowestNs) / stats.meanNs << "x, worst frame " << stats.worstTail
+              << "x), " << stats.splitTiles / frames << " hot tiles split per frame\n";
+    frameGraph.resetTileStats();
 }
+#endif
+#endif
+
+// Working buffers of renderMT (and renderFrame), kept between frames so they are only allocated once
+// Every renderer drawing concurrently needs its own.
+struct RenderScratch {
+    std::vector<matrix> transforms;             // perspective * camera * world of each mesh
+    std::vector<size_t> offsets;                // Flattened start of each mesh, plus the total
+    std::vector<Vertex*> caches;                // Transformed vertices of each mesh (in the frame arena)
+    #if OPT_MULTITHREAD_SORT_LAST && OPT_TRIANGLE_BATCH_SETUP
+        SortLastCompositor compositor;          // Private layer of every thread
+    #elif OPT_MULTITHREAD_ATOMIC_DEPTH && OPT_TRIANGLE_BATCH_SETUP
+        AtomicZbuffer atomicZbuffer;            // Packed depth + colour buffer
+    #endif
+    #if OPT_MULTITHREAD_USE_MT && OPT_MULTITHREAD_COROUTINES
+        std::vector<Task<>> children;           // Child tasks of the frame coroutine
+    #endif
+    #if !OPT_MULTITHREAD_PARALLEL_FOR
+        TaskGraph jobs;                         // Jobs of the frame, joined on their own (see renderMT)
+    #endif
+    MeshViews views;                            // Level of detail and meshlet cull of each mesh
+};
+
+// Level of detail selection - pick the geometry of every mesh of the draw list from the projected size of its
+// bounding sphere (every mesh is drawn at full detail without OPT_MESH_LOD)
+// Input Variables:
+// - renderer: The Renderer object (for the perspective matrix and canvas height).
+// - scratch: Working buffers of the renderer, receiving the levels.
+// - camera: Matrix representing the camera's transformation.
+// - scene: Meshes about to be rendered.
+static void selectLODs(Renderer& renderer, RenderScratch& scratch, matrix& camera, const std::vector<Mesh*>& scene) {
+    #if OPT_MESH_LOD
+        // Optimisation - Pick each mesh's level of detail from its size on screen
+        scratch.views.selectLODs(scene, renderer.perspective * camera, static_cast<float>(renderer.getHeight()), renderer.getNear());
+    #else
+        scratch.views.resize(scene.size());
+    #endif
+}
+
+// Single threaded render function of a draw list
+// Input Variables:
+// - renderer: The Renderer object used for drawing.
+// - scratch: Working buffers of the renderer.
+// - scene: Meshes to draw.
+// - camera: Matrix representing the camera's transformation.
+// - L: Light object representing the lighting parameters.
+static void render(Renderer& renderer, RenderScratch& scratch, const std::vector<Mesh*>& scene, matrix& camera, Light& L) {
+    selectLODs(renderer, scratch, camera, scene);
+    for (size_t i = 0; i < scene.size(); i++)
+        render(renderer, scene[i], scratch.views[i], camera, L);
+}
+
+#if OPT_MULTITHREAD_PARALLEL_FOR
+// Split a range of flattened (all meshes back to back) indices at mesh boundaries
+// Input Variables:
+// - offsets: First flattened index of each mesh, followed by the total
+// - begin, end: Flattened range to split
+// - fn: Callable (mesh index, first local index, end local index) called for each piece
+template <typename F>
+static void forEachMeshRange(const std::vector<size_t>& offsets, size_t begin, size_t end, F&& fn) {
+    size_t mesh = std::upper_bound(offsets.begin(), offsets.end(), begin) - offsets.begin() - 1;
+    while (begin < end) {
+        size_t stop = std::min(end, offsets[mesh + 1]);
+        if (stop > begin) fn(mesh, begin - offsets[mesh], stop - offsets[mesh]);
+        begin = stop;
+        mesh++;
+    }
+}
+
+// Multithreaded Render Function - the work of every mesh is flattened into one range and split between
+// the workers with ThreadPool::parallel_for, so a large mesh no longer occupies a single worker while the
+// others sit idle after finishing the small ones.
+// Input Variables:
+// - renderer: The Renderer object used for drawing (and its thread pool).
+// - scratch: Working buffers of the renderer.
+// - scene: Meshes to draw.
+// - camera: Matrix representing the camera's transformation.
+// - L: Light object representing the lighting parameters.
+static void renderMT(Renderer& renderer, RenderScratch& scratch, std::vector<Mesh*>& scene, matrix& camera, Light& L) {
+
+    ThreadPool& threadpool = renderer.pool();
+    std::vector<matrix>& transforms = scratch.transforms;
+    std::vector<size_t>& offsets = scratch.offsets;
+    MeshViews& views = scratch.views;
+    selectLODs(renderer, scratch, camera, scene);
+
+    #if OPT_MULTITHREAD_SORT_LAST && OPT_TRIANGLE_BATCH_SETUP
+        // Optimisation - Sort-last compositing; every thread draws its share of the scene into a private layer
+        // without any synchronisation, and the layers are merged into the canvas at the end
+        SortLastCompositor& compositor = scratch.compositor;
+        compositor.create(threadpool.size() + 1, renderer.getWidth(), renderer.getHeight());
+        AtomicZbuffer* atomicTarget = nullptr;
+        auto layerTarget = [&]() { return &compositor.layer(threadpool.threadSlot()); };
+    #elif OPT_MULTITHREAD_ATOMIC_DEPTH && OPT_TRIANGLE_BATCH_SETUP
+        // Optimisation - Triangles of the same pixels are drawn by different workers, so depth test and colour
+        // write go through a packed buffer with lock-free atomic writes, resolved to the canvas at the end
+        AtomicZbuffer& atomicZbuffer = scratch.atomicZbuffer;
+        if (atomicZbuffer.getWidth() != renderer.getWidth())
+            atomicZbuffer.create(renderer.getWidth(), renderer.getHeight());
+        AtomicZbuffer* atomicTarget = &atomicZbuffer;
+        auto layerTarget = []() { return static_cast<DepthLayer*>(nullptr); };
+    #else
+        AtomicZbuffer* atomicTarget = nullptr;  // Workers write the shared Z-buffer and canvas directly (racy)
+        auto layerTarget = []() { return static_cast<DepthLayer*>(nullptr); };
+    #endif
+
+    // Normalize the light only once, as the direction is fixed!
+    L.omega_i.normalise();
+
+    transforms.resize(scene.size());
+    offsets.resize(scene.size() + 1);
+    for (size_t i = 0; i < scene.size(); i++)
+        transforms[i] = renderer.perspective * camera * scene[i]->world;
+
+    #if OPT_MESH_MESHLET_CULLING
+        constexpr size_t MESHLET_GRAIN = 1;    // Meshlets claimed per chunk (up to 124 triangles each)
+
+        // Cull the meshlets of every mesh, then share the survivors of the whole scene between the workers
+        offsets[0] = 0;
+        for (size_t i = 0; i < scene.size(); i++) {
+            scene[i]->cullMeshlets(views[i], camera * scene[i]->world, transforms[i]);
+            offsets[i + 1] = offsets[i] + views[i].visibleMeshlets.size();
+        }
+        threadpool.parallel_for(offsets.back(), MESHLET_GRAIN, [&](size_t begin, size_t end) {
+            forEachMeshRange(offsets, begin, end, [&](size_t m, size_t first, size_t last) {
+                renderMeshlets(renderer, scene[m], views[m].lod, transforms[m], L, views[m].visibleMeshlets.data() + first, last - first, atomicTarget, layerTarget());
+            });
+        });
+    #else
+        constexpr size_t VERTEX_GRAIN = 256;   // Vertices claimed per chunk
+        constexpr size_t TRIANGLE_GRAIN = 128; // Triangles claimed per chunk (one batched setup round)
+        std::vector<Vertex*>& caches = scratch.caches;
+
+        // Vertex stage - transform every vertex of the scene once
+        caches.resize(scene.size());
+        offsets[0] = 0;
+        for (size_t i = 0; i < scene.size(); i++) {
+            caches[i] = FrameArena::local().allocate<Vertex>(scene[i]->lodVertices(views[i].lod).size());
+            offsets[i + 1] = offsets[i] + scene[i]->lodVertices(views[i].lod).size();
+        }
+        float width = static_cast<float>(renderer.getWidth());
+        float height = static_cast<float>(renderer.getHeight());
+        threadpool.parallel_for(offsets.back(), VERTEX_GRAIN, [&](size_t begin, size_t end) {
+            forEachMeshRange(offsets, begin, end, [&](size_t m, size_t first, size_t last) {
+                const std::vector<Vertex>& source = scene[m]->lodVertices(views[m].lod);
+                for (size_t v = first; v < last; v++)
+                    caches[m][v] = scene[m]->transformVertex(source[v], transforms[m], 0.5f * width, 0.5f * height, height, L);
+            });
+        });
+
+        // Triangle stage - set up and rasterize the triangles of the scene from the cached vertices
+        for (size_t i = 0; i < scene.size(); i++)
+            offsets[i + 1] = offsets[i] + scene[i]->lodTriangles(views[i].lod).size();
+        threadpool.parallel_for(offsets.back(), TRIANGLE_GRAIN, [&](size_t begin, size_t end) {
+            forEachMeshRange(offsets, begin, end, [&](size_t m, size_t first, size_t last) {
+                const std::vector<triIndices>& triangles = scene[m]->lodTriangles(views[m].lod);
+                #if OPT_TRIANGLE_BATCH_SETUP
+                    renderBatched(renderer, L, scene[m], caches[m], static_cast<unsigned int>(last - first),
+                        [&triangles, first](unsigned int t, unsigned int k) { return triangles[first + t].v[k]; }, atomicTarget, layerTarget());
+                #else
+                    for (size_t t = first; t < last; t++) {
+                        const Vertex& v0 = caches[m][triangles[t].v[0]];
+                        const Vertex& v1 = caches[m][triangles[t].v[1]];
+                        const Vertex& v2 = caches[m][triangles[t].v[2]];
+
+                        // Clip triangles with Z-values outside [-1, 1]
+                        if (fabs(v0.p[2]) > 1.f || fabs(v1.p[2]) > 1.f || fabs(v2.p[2]) > 1.f) continue;
+
+                        // Create a triangle object and render it
+                        triangle tri(v0, v1, v2);
+                        tri.draw(renderer, L, scene[m]->ka, scene[m]->kd, scene[m]->shading, scene[m]->texture);
+                    }
+                #endif
+            });
+        });
+    #endif
 
-// Multithreaded Render Function
-// CPU - Intel Core Ultra 7 155H
-// Total Cores 16
-// # of Performance-cores 6
-// # of Efficient-cores 8
-// # of Low Power Efficient-cores 2
-// Total Threads 22
-// https://www.intel.com/content/www/us/en/products/sku/236847/intel-core-ultra-7-processor-155h-24m-cache-up-to-4-80-ghz/specifications.html
-size_t cpu = 6;  // Maximum Thread Count - std::thread::hardware_concurrency()
-ThreadPool threadpool(cpu);
-static void renderMT(Renderer& renderer, std::vector<Mesh*>& scene, matrix& camera, Light& L) {
-    for (auto& m : scene) {
+    #if OPT_MULTITHREAD_SORT_LAST && OPT_TRIANGLE_BATCH_SETUP
+        // Merge - keep the nearest fragment of every pixel over the layers, tile by tile in parallel
+        compositor.merge(threadpool, renderer);
+    #elif OPT_MULTITHREAD_ATOMIC_DEPTH && OPT_TRIANGLE_BATCH_SETUP
+        // Resolve - copy the colours to the canvas and clear the packed buffer for the next frame
+        constexpr size_t RESOLVE_GRAIN = 32;  // Rows per chunk
+        unsigned char* image = renderer.getBackBuffer();
+        threadpool.parallel_for(renderer.getHeight(), RESOLVE_GRAIN, [&](size_t begin, size_t end) {
+            atomicZbuffer.resolve(static_cast<unsigned int>(begin), static_cast<unsigned int>(end), image);
+        });
+    #endif
+}
+#else
+static void renderMT(Renderer& renderer, RenderScratch& scratch, std::vector<Mesh*>& scene, matrix& camera, Light& L) {
+    ThreadPool& threadpool = renderer.pool();
+    size_t cpu = threadpool.size();
+    // The jobs go into a task graph joined on its own: waiting on the pool would also wait for the jobs other
+    // code has in flight on the renderer's frame context (e.g. the pipelined animation of the next frame)
+    TaskGraph& jobs = scratch.jobs;
+    jobs.clear();
+    selectLODs(renderer, scratch, camera, scene);
+    for (size_t slot = 0; slot < scene.size(); slot++) {
+        const Mesh* m = scene[slot];
+        MeshView& view = scratch.views[slot];
+        unsigned int lod = view.lod;
         // Combine perspective, camera, and world transformations for the mesh
-        matrix p = renderer.perspective * camera * m->world;
+        // Optimisation - The matrix lives in the frame arena and the jobs capture a pointer to it, so every job
+        // fits inline in its deque slot and submitting it never allocates
+        matrix* p = FrameArena::local().allocate<matrix>(1);
+        *p = renderer.perspective * camera * m->world;
 
         // Normalize the light only once, as the direction is fixed!
         L.omega_i.normalise();
 
-        int triangle_size = m->triangles.size();
+        #if OPT_MESH_MESHLET_CULLING
+            // Optimisation - Cull meshlets up front, then split the survivors between the workers
+            m->cullMeshlets(view, camera * m->world, *p);
+            unsigned int meshlet_size = static_cast<unsigned int>(view.visibleMeshlets.size());
+            unsigned int meshlet_chunk = static_cast<unsigned int>((meshlet_size + cpu - 1) / cpu);
+            for (unsigned int start = 0; start < meshlet_size; start += meshlet_chunk) {
+                unsigned int count = (start + meshlet_chunk < meshlet_size) ? meshlet_chunk : meshlet_size - start;
+                const unsigned int* indices = view.visibleMeshlets.data() + start;  // Stays valid until the join below
+                jobs.add([&renderer, m, p, &L, indices, lod, count] {
+                    renderMeshlets(renderer, m, lod, *p, L, indices, count);
+                });
+            }
+            continue;
+        #endif
+
+        int triangle_size = m->lodTriangles(lod).size();
         int triangle_chunk = 8 * (triangle_size + cpu - 1) / cpu;
         // std::cout << triangle_size << '\t' << cpu << '\t' << triangle_chunk << '\n';
 
-        float half_width = 0.5f * static_cast<float>(renderer.canvas.getWidth());
-        float half_height = 0.5f * static_cast<float>(renderer.canvas.getHeight());
-
-        for (size_t start = 0; start < triangle_size; start += triangle_chunk) {
-            size_t end = (start + triangle_chunk < triangle_size) ? start + triangle_chunk : triangle_size;
-            threadpool.enqueue([&renderer, m, p, &L, start, end, half_width, half_height] {
-                for (size_t i = start; i < end; i++) {
-                    triIndices& ind = m->triangles[i];
+        // 32-bit bounds keep the captures within a Job's inline storage
+        for (unsigned int start = 0; start < static_cast<unsigned int>(triangle_size); start += triangle_chunk) {
+            unsigned int end = (start + triangle_chunk < triangle_size) ? start + triangle_chunk : triangle_size;
+            jobs.add([&renderer, m, lod, p, &L, start, end] {
+                const std::vector<Vertex>& source = m->lodVertices(lod);
+                float half_width = 0.5f * static_cast<float>(renderer.getWidth());
+                float half_height = 0.5f * static_cast<float>(renderer.getHeight());
+                for (unsigned int i = start; i < end; i++) {
+                    const triIndices& ind = m->lodTriangles(lod)[i];
                     Vertex t[3]; // Temporary array to store transformed triangle vertices
 
                     // Transform each vertex of the triangle
                     for (unsigned int j = 0; j < 3; j++) {
-                        t[j].p = p * m->vertices[ind.v[j]].p; // Apply transformations
+                        t[j].p = *p * source[ind.v[j]].p; // Apply transformations
                         t[j].p.divideW(); // Perspective division to normalize coordinates
 
                         // Transform normals into world space for accurate lighting
                         // no need for perspective correction as no shearing or non-uniform scaling
-                        t[j].normal = m->world * m->vertices[ind.v[j]].normal;
+                        t[j].normal = m->world * source[ind.v[j]].normal;
                         t[j].normal.normalise();
 
                         // Map normalized device coordinates to screen space
                         t[j].p[0] = (t[j].p[0] + 1.f) * half_width;
                         t[j].p[1] = (t[j].p[1] + 1.f) * half_height;
-                        t[j].p[1] = renderer.canvas.getHeight() - t[j].p[1]; // Invert y-axis
+                        t[j].p[1] = renderer.getHeight() - t[j].p[1]; // Invert y-axis
 
                         // Copy vertex colours
-                        t[j].rgb = m->vertices[ind.v[j]].rgb;
+                        t[j].rgb = source[ind.v[j]].rgb;
+                        t[j].u = source[ind.v[j]].u;
+                        t[j].v = source[ind.v[j]].v;
+                        if (m->shading == ShadingMode::Gouraud) m->lightVertex(t[j], source[ind.v[j]].p, L);
                     }
 
                     // Clip triangles with Z-values outside [-1, 1]
@@ -139,18 +558,91 @@ static void renderMT(Renderer& renderer, std::vector<Mesh*>& scene, matrix& came
 
                     // Create a triangle object and render it
                     triangle tri(t[0], t[1], t[2]);
-                    tri.draw(renderer, L, m->ka, m->kd);
+                    tri.draw(renderer, L, m->ka, m->kd, m->shading, m->texture);
                 }
             });
         }
     }
-    threadpool.wait();
+    jobs.run(threadpool);
 }
+#endif
 
+#ifdef _WIN32  // The interactive scenes (and their helpers) need the window backend
+// Scene culling - refit the BVH to the meshes moved this frame and collect the visible meshes
+// Input Variables:
+// - renderer: The Renderer object (for the perspective matrix).
+// - bvh: Hierarchy built over the scene.
+// - occlusion: Low resolution occlusion buffer, rebuilt every frame.
+// - camera: Matrix representing the camera's transformation.
+// Output Variables:
+// - visible: Meshes that survived frustum (and occlusion) culling.
+static void cullScene(Renderer& renderer, SceneBVH& bvh, OcclusionBuffer& occlusion, matrix& camera, std::vector<Mesh*>& visible) {
+    bvh.refit();
+    matrix vp = renderer.perspective * camera;
+    Frustum frustum(vp);  // World space frustum
+    bvh.query(frustum, visible);
+
+    #if OPT_SCENE_OCCLUSION_CULLING
+        // Optimisation - Rasterize the largest on-screen meshes into a small depth buffer,
+        // then traverse the hierarchy again, rejecting whole subtrees hidden behind them
+        occlusion.rasterizeOccluders(visible, vp);
+        bvh.query(frustum, [&occlusion, &vp](const AABB& box) { return occlusion.isVisible(box, vp); }, visible);
+    #endif
+}
+#endif
+
+#if OPT_MULTITHREAD_USE_MT && OPT_MULTITHREAD_COROUTINES
+// Clear a band of rows of the canvas and the Z-buffer on the pool
+static Task<> clearRows(Renderer& renderer, unsigned int y0, unsigned int y1) {
+    co_await renderer.pool().schedule();
+    renderer.clearTile(0, y0, renderer.getWidth(), y1);
+}
+
+// Animate the meshes [first, last) on the pool
+template <typename AnimateFn>
+static Task<> animateRange(ThreadPool& pool, AnimateFn& animate, size_t first, size_t last) {
+    co_await pool.schedule();
+    for (size_t i = first; i < last; i++)
+        animate(i);
+}
+
+// One frame of the renderMT path as a coroutine: the clear and the animation run together on the pool, then
+// the scene is culled and rendered. While the frame waits on its children it is suspended, not blocking a
+// thread, and it carries on in whichever thread finished the last child.
+// Input Variables:
+// - renderer: The Renderer object
+// - scratch: Working buffers of the renderer
+// - camera: Matrix representing the camera's transformation
+// - L: Light source
+// - animatedCount: Number of meshes to animate this frame
+// - animate: Callable (size_t i) animating mesh i
+// - visibility: Callable culling the scene, returning the meshes to draw
+template <typename AnimateFn, typename VisibilityFn>
+static Task<> renderFrame(Renderer& renderer, RenderScratch& scratch, matrix& camera, Light& L, size_t animatedCount, AnimateFn& animate, VisibilityFn& visibility) {
+    constexpr unsigned int CLEAR_ROWS = 64;   // Rows cleared per task
+    constexpr size_t ANIMATION_GRAIN = 64;    // Meshes animated per task
+    std::vector<Task<>>& children = scratch.children;  // Reused every frame, only one frame is in flight at a time
+
+    unsigned int height = renderer.getHeight();
+    for (unsigned int y = 0; y < height; y += CLEAR_ROWS)
+        children.push_back(clearRows(renderer, y, std::min(y + CLEAR_ROWS, height)));
+    for (size_t first = 0; first < animatedCount; first += ANIMATION_GRAIN)
+        children.push_back(animateRange(renderer.pool(), animate, first, std::min(first + ANIMATION_GRAIN, animatedCount)));
+    co_await whenAll(renderer.pool(), children.data(), children.size());
+    children.clear();
+
+    std::vector<Mesh*>& drawList = visibility();
+    renderMT(renderer, scratch, drawList, camera, L);
+}
+#endif
+
+#ifdef _WIN32  // The interactive scenes (and their helpers) need the window backend
 // Test scene function to demonstrate rendering with user-controlled transformations
-// No input variables
-static void sceneTest() {
-    Renderer renderer;
+// Input Variables:
+// - pool: Thread pool of the renderer
+static void sceneTest(ThreadPool& pool) {
+    Renderer renderer(pool);
+    RenderScratch scratch;
     // create light source {direction, diffuse intensity, ambient intensity}
     Light L{ vec4(0.f, 1.f, 1.f, 0.f), colour(1.f, 1.f, 1.f), colour(0.2f, 0.2f, 0.2f) };
     // camera is just a matrix
@@ -162,6 +654,10 @@ static void sceneTest() {
 
     // Create a sphere and a rectangle mesh
     Mesh mesh = Mesh::makeSphere(1.f, 10, 20);
+    #if OPT_TRIANGLE_GOURAUD_LIGHTING
+        // Optimisation - Light the sphere per vertex
+        mesh.shading = ShadingMode::Gouraud;
+    #endif
     //Mesh mesh2 = Mesh::makeRectangle(-2, -1, 2, 1);
 
     // add meshes to scene
@@ -176,6 +672,7 @@ static void sceneTest() {
     while (running) {
         renderer.canvas.checkInput(); // Handle user input
         renderer.clear(); // Clear the canvas for the next frame
+        renderer.beginFrame();
 
         // Apply transformations to the meshes
         // mesh2.world = matrix::makeTranslation(x, y, z) * matrix::makeRotateX(0.01f);
@@ -191,17 +688,16 @@ static void sceneTest() {
         if (renderer.canvas.keyPressed('E')) z += -0.1f;
 
         // Render each object in the scene
-        for (auto& m : scene)
-            render(renderer, m, camera, L);
+        render(renderer, scratch, scene, camera, L);
 
         renderer.present(); // Display the rendered frame
     }
 }
 
 // Utility function to generate a random rotation matrix
-// No input variables
-static matrix makeRandomRotation() {
-    RandomNumberGenerator& rng = RandomNumberGenerator::getInstance();
+// Input Variables:
+// - rng: Random number generator of the scene
+static matrix makeRandomRotation(RandomNumberGenerator& rng) {
     unsigned int r = rng.getRandomInt(0, 3);
     float pi = std::numbers::pi_v<float>;
 
@@ -215,14 +711,15 @@ static matrix makeRandomRotation() {
 
 // Just a prototype for scene 3, consisting of a corridor of 400 random rotating cubes
 // Deprecated Scene - but will leave on the source code to show where the inspiration came from, for the finalized scene
-static void scene3_prototype() {
-    Renderer renderer;
+static void scene3_prototype(ThreadPool& pool) {
+    Renderer renderer(pool);
+    RenderScratch scratch;
     matrix camera = matrix::makeIdentity();
     Light L{ vec4(0.f, 1.f, 1.f, 0.f), colour(1.0f, 1.0f, 1.0f), colour(0.2f, 0.2f, 0.2f) };
 
     std::vector<Mesh*> scene;
 
-    RandomNumberGenerator& rng = RandomNumberGenerator::getInstance();
+    RandomNumberGenerator rng;
     struct rRot { float x; float y; float z; }; // Structure to store random rotation parameters
     std::vector<rRot> rotations;
 
@@ -290,6 +787,7 @@ static void scene3_prototype() {
     // Main rendering loop
     while (running) {
         renderer.canvas.checkInput();
+        renderer.beginFrame();
         renderer.clear();
 
         camera = matrix::makeTranslation(0.f, 0.f, -zoffset); // Update camera position
@@ -310,8 +808,7 @@ static void scene3_prototype() {
             }
         }
 
-        for (auto& m : scene)
-            render(renderer, m, camera, L);
+        render(renderer, scratch, scene, camera, L);
         renderer.present();
     }
 
@@ -320,31 +817,87 @@ static void scene3_prototype() {
 }
 
 // Function to render a scene with multiple objects and dynamic transformations
-// No input variables
-static void scene1() {
-    Renderer renderer;
+// Input Variables:
+// - pool: Thread pool of the renderer
+static void scene1(ThreadPool& pool) {
+    Renderer renderer(pool);
+    RenderScratch scratch;
     matrix camera;
     Light L{ vec4(0.f, 1.f, 1.f, 0.f), colour(1.f, 1.f, 1.f), colour(0.2f, 0.2f, 0.2f) };
 
     bool running = true;
 
     std::vector<Mesh*> scene;
+    RandomNumberGenerator rng;
 
     // Create a scene of 40 cubes with random rotations
     for (unsigned int i = 0; i < 20; i++) {
         Mesh* m = new Mesh();
         *m = Mesh::makeCube(1.f);
-        m->world = matrix::makeTranslation(-2.f, 0.f, (-3 * static_cast<float>(i))) * makeRandomRotation();
+        m->world = matrix::makeTranslation(-2.f, 0.f, (-3 * static_cast<float>(i))) * makeRandomRotation(rng);
         scene.push_back(m);
         m = new Mesh();
         *m = Mesh::makeCube(1.f);
-        m->world = matrix::makeTranslation(2.f, 0.f, (-3 * static_cast<float>(i))) * makeRandomRotation();
+        m->world = matrix::makeTranslation(2.f, 0.f, (-3 * static_cast<float>(i))) * makeRandomRotation(rng);
         scene.push_back(m);
     }
 
+    #if SCENE_ONE_POINT_LIGHTS
+        // 40 coloured point lights down the corridor, one in front of each cube
+        LightList lights;
+        LightTiles lightTiles;
+        for (unsigned int i = 0; i < 20; i++) {
+            colour warm(1.f, 0.35f, 0.05f), cool(0.05f, 0.35f, 1.f);
+            float z = -3.f * static_cast<float>(i) + 1.5f;
+            lights.push_back(LightSource::point(vec4(-1.5f, -0.8f, z), (i % 2 == 0) ? warm : cool, 3.f));
+            lights.push_back(LightSource::point(vec4(1.5f, -0.8f, z), (i % 2 == 0) ? cool : warm, 3.f));
+        }
+        L.tiles = &lightTiles;
+    #endif
+
+    #if OPT_SCENE_BVH_CULLING
+        // Optimisation - Build a BVH over the scene for hierarchical frustum culling
+        SceneBVH bvh;
+        bvh.build(scene);
+        OcclusionBuffer occlusion;
+        std::vector<Mesh*> visible;
+        visible.reserve(scene.size());
+    #endif
+
     float zoffset = 8.f;  // Initial camera Z-offset
     float step = -0.1f;   // Step size for camera movement
 
+    // Rotate the first two cubes in the scene
+    auto animate = [](size_t i, matrix& world) {
+        if (i == 0) world = world * matrix::makeRotateXYZ(0.1f, 0.1f, 0.f);
+        else world = world * matrix::makeRotateXYZ(0.f, 0.1f, 0.2f);
+    };
+    auto animateMesh = [&scene, &animate](size_t i) { animate(i, scene[i]->world); };
+
+    // Collect the meshes to draw this frame (after the animation)
+    auto visibility = [&]() -> std::vector<Mesh*>& {
+        #if OPT_SCENE_BVH_CULLING
+            // Optimisation - Only submit the meshes that are inside the view frustum and not occluded
+            cullScene(renderer, bvh, occlusion, camera, visible);
+            return visible;
+        #else
+            return scene;
+        #endif
+    };
+
+    #if OPT_MULTITHREAD_USE_MT && OPT_MULTITHREAD_TASK_GRAPH
+        // Optimisation - Run animation, culling, vertex processing, binning and tile rasterization as one task graph
+        FrameGraph frameGraph(pool);
+    #endif
+
+    #if OPT_MULTITHREAD_USE_MT && OPT_MULTITHREAD_PIPELINED_FRAMES
+        // Optimisation - Animate the next frame on the pool while the current frame is rendered
+        AnimationPipeline pipeline(pool, scene, 2);
+        const size_t animatedCount = 0;  // The pipeline animates the meshes
+    #else
+        const size_t animatedCount = 2;
+    #endif
+
     auto start = std::chrono::high_resolution_clock::now();
     std::chrono::time_point<std::chrono::high_resolution_clock> end;
     int cycle = 0;
@@ -352,13 +905,11 @@ static void scene1() {
     // Main rendering loop
     while (running) {
         renderer.canvas.checkInput();
-        renderer.clear();
 
         camera = matrix::makeTranslation(0.f, 0.f, -zoffset); // Update camera position
-
-        // Rotate the first two cubes in the scene
-        scene[0]->world = scene[0]->world * matrix::makeRotateXYZ(0.1f, 0.1f, 0.f);
-        scene[1]->world = scene[1]->world * matrix::makeRotateXYZ(0.f, 0.1f, 0.2f);
+        #if SCENE_ONE_POINT_LIGHTS
+            lightTiles.build(lights, camera, renderer.perspective, renderer.getWidth(), renderer.getHeight(), renderer.getNear());
+        #endif
 
         if (renderer.canvas.keyPressed(VK_ESCAPE)) break;
 
@@ -368,6 +919,15 @@ static void scene1() {
             if (++cycle % 2 == 0) {
                 end = std::chrono::high_resolution_clock::now();
                 std::cout << cycle / 2 << " :" << std::chrono::duration<double, std::milli>(end - start).count() << "ms\n";
+                #if OPT_MULTITHREAD_USE_MT
+                    printPoolStats(pool);
+                #endif
+                #if OPT_MULTITHREAD_USE_MT && OPT_MULTITHREAD_TASK_GRAPH && OPT_MULTITHREAD_TILE_COST_MODEL
+                    printTileStats(frameGraph);
+                #endif
+                #if DEBUG_COUNT_ALLOCATIONS
+                    printAllocations();
+                #endif
                 start = std::chrono::high_resolution_clock::now();
             }
         }
@@ -380,14 +940,30 @@ static void scene1() {
         //    #endif
         //}
 
-        
-        #if OPT_MULTITHREAD_USE_MT
-            renderMT(renderer, scene, camera, L);
+        renderer.beginFrame();  // The previous frame's transient data is no longer needed
+
+        #if OPT_MULTITHREAD_USE_MT && OPT_MULTITHREAD_PIPELINED_FRAMES
+            pipeline.next(animate);
+        #endif
+
+        #if OPT_MULTITHREAD_USE_MT && OPT_MULTITHREAD_TASK_GRAPH
+            frameGraph.execute(renderer, camera, L, animatedCount, animateMesh, visibility);
+        #elif OPT_MULTITHREAD_USE_MT && OPT_MULTITHREAD_COROUTINES
+            syncWait(pool, renderFrame(renderer, scratch, camera, L, animatedCount, animateMesh, visibility));
+            renderer.present();
         #else
-            for (auto& m : scene)
-                render(renderer, m, camera, L);
+            renderer.clear();
+            for (size_t i = 0; i < animatedCount; i++)
+                animateMesh(i);
+            std::vector<Mesh*>& drawList = visibility();
+
+            #if OPT_MULTITHREAD_USE_MT
+                renderMT(renderer, scratch, drawList, camera, L);
+            #else
+                render(renderer, scratch, drawList, camera, L);
+            #endif
+            renderer.present();
         #endif
-        renderer.present();
     }
 
     for (auto& m : scene)
@@ -395,9 +971,11 @@ static void scene1() {
 }
 
 // Scene with a grid of cubes and a moving sphere
-// No input variables
-static void scene2() {
-    Renderer renderer;
+// Input Variables:
+// - pool: Thread pool of the renderer
+static void scene2(ThreadPool& pool) {
+    Renderer renderer(pool);
+    RenderScratch scratch;
     matrix camera = matrix::makeIdentity();
     Light L{ vec4(0.f, 1.f, 1.f, 0.f), colour(1.0f, 1.0f, 1.0f), colour(0.2f, 0.2f, 0.2f) };
 
@@ -406,7 +984,7 @@ static void scene2() {
     struct rRot { float x; float y; float z; }; // Structure to store random rotation parameters
     std::vector<rRot> rotations;
 
-    RandomNumberGenerator& rng = RandomNumberGenerator::getInstance();
+    RandomNumberGenerator rng;
 
     // Create a grid of cubes with random rotations
     for (unsigned int y = 0; y < 6; y++) {
@@ -422,12 +1000,60 @@ static void scene2() {
 
     // Create a sphere and add it to the scene
     Mesh* sphere = new Mesh();
-    *sphere = Mesh::makeSphere(1.f, 10, 20);
+    #if OPT_MESH_LOD
+        *sphere = Mesh::makeSphereLOD(1.f, 10, 20);
+    #else
+        *sphere = Mesh::makeSphere(1.f, 10, 20);
+    #endif
+    #if OPT_TRIANGLE_GOURAUD_LIGHTING
+        // Optimisation - Light the sphere per vertex
+        sphere->shading = ShadingMode::Gouraud;
+    #endif
     scene.push_back(sphere);
     float sphereOffset = -6.f;
     float sphereStep = 0.1f;
     sphere->world = matrix::makeTranslation(sphereOffset, 0.f, -6.f);
 
+    #if OPT_SCENE_BVH_CULLING
+        // Optimisation - Build a BVH over the scene for hierarchical frustum culling
+        SceneBVH bvh;
+        bvh.build(scene);
+        OcclusionBuffer occlusion;
+        std::vector<Mesh*> visible;
+        visible.reserve(scene.size());
+    #endif
+
+    // Rotate each cube in the grid
+    auto animate = [&rotations](size_t i, matrix& world) {
+        world = world * matrix::makeRotateXYZ(rotations[i].x, rotations[i].y, rotations[i].z);
+    };
+    auto animateMesh = [&scene, &animate](size_t i) { animate(i, scene[i]->world); };
+
+    // Collect the meshes to draw this frame (after the animation)
+    auto visibility = [&]() -> std::vector<Mesh*>& {
+        #if OPT_SCENE_BVH_CULLING
+            // Optimisation - Only submit the meshes that are inside the view frustum and not occluded
+            cullScene(renderer, bvh, occlusion, camera, visible);
+            std::vector<Mesh*>& drawList = visible;
+        #else
+            std::vector<Mesh*>& drawList = scene;
+        #endif
+        return drawList;
+    };
+
+    #if OPT_MULTITHREAD_USE_MT && OPT_MULTITHREAD_TASK_GRAPH
+        // Optimisation - Run animation, culling, vertex processing, binning and tile rasterization as one task graph
+        FrameGraph frameGraph(pool);
+    #endif
+
+    #if OPT_MULTITHREAD_USE_MT && OPT_MULTITHREAD_PIPELINED_FRAMES
+        // Optimisation - Animate the next frame on the pool while the current frame is rendered
+        AnimationPipeline pipeline(pool, scene, rotations.size());
+        const size_t animatedCount = 0;  // The pipeline animates the meshes
+    #else
+        const size_t animatedCount = rotations.size();
+    #endif
+
     auto start = std::chrono::high_resolution_clock::now();
     std::chrono::time_point<std::chrono::high_resolution_clock> end;
     int cycle = 0;
@@ -435,20 +1061,27 @@ static void scene2() {
     bool running = true;
     while (running) {
         renderer.canvas.checkInput();
-        renderer.clear();
-
-        // Rotate each cube in the grid
-        for (unsigned int i = 0; i < rotations.size(); i++)
-            scene[i]->world = scene[i]->world * matrix::makeRotateXYZ(rotations[i].x, rotations[i].y, rotations[i].z);
 
         // Move the sphere back and forth
         sphereOffset += sphereStep;
         sphere->world = matrix::makeTranslation(sphereOffset, 0.f, -6.f);
+        #if OPT_SCENE_BVH_CULLING
+            bvh.markMoved(static_cast<unsigned int>(scene.size() - 1));  // The only mesh that changes position
+        #endif
         if (sphereOffset > 6.f || sphereOffset < -6.f) {
             sphereStep *= -1.f;
             if (++cycle % 2 == 0) {
                 end = std::chrono::high_resolution_clock::now();
                 std::cout << cycle / 2 << " :" << std::chrono::duration<double, std::milli>(end - start).count() << "ms\n";
+                #if OPT_MULTITHREAD_USE_MT
+                    printPoolStats(pool);
+                #endif
+                #if OPT_MULTITHREAD_USE_MT && OPT_MULTITHREAD_TASK_GRAPH && OPT_MULTITHREAD_TILE_COST_MODEL
+                    printTileStats(frameGraph);
+                #endif
+                #if DEBUG_COUNT_ALLOCATIONS
+                    printAllocations();
+                #endif
                 start = std::chrono::high_resolution_clock::now();
             }
         }
@@ -463,13 +1096,30 @@ static void scene2() {
         //    #endif
         //}
 
-        #if OPT_MULTITHREAD_USE_MT
-            renderMT(renderer, scene, camera, L);
+        renderer.beginFrame();  // The previous frame's transient data is no longer needed
+
+        #if OPT_MULTITHREAD_USE_MT && OPT_MULTITHREAD_PIPELINED_FRAMES
+            pipeline.next(animate);
+        #endif
+
+        #if OPT_MULTITHREAD_USE_MT && OPT_MULTITHREAD_TASK_GRAPH
+            frameGraph.execute(renderer, camera, L, animatedCount, animateMesh, visibility);
+        #elif OPT_MULTITHREAD_USE_MT && OPT_MULTITHREAD_COROUTINES
+            syncWait(pool, renderFrame(renderer, scratch, camera, L, animatedCount, animateMesh, visibility));
+            renderer.present();
         #else
-            for (auto& m : scene)
-                render(renderer, m, camera, L);
+            renderer.clear();
+            for (size_t i = 0; i < animatedCount; i++)
+                animateMesh(i);
+            std::vector<Mesh*>& drawList = visibility();
+
+            #if OPT_MULTITHREAD_USE_MT
+                renderMT(renderer, scratch, drawList, camera, L);
+            #else
+                render(renderer, scratch, drawList, camera, L);
+            #endif
+            renderer.present();
         #endif
-        renderer.present();
     }
 
     for (auto& m : scene)
@@ -478,60 +1128,64 @@ static void scene2() {
 
 // These scene will be written to showcase different parallel issues and optimisations
 // Helix Benchmark - High density geometry stress test
-// No input variables
-static void scene3() {
-    Renderer renderer;
+// Input Variables:
+// - pool: Thread pool of the renderer
+static void scene3(ThreadPool& pool) {
+    Renderer renderer(pool);
+    RenderScratch scratch;
     matrix camera = matrix::makeIdentity();
     Light L { vec4(0.f, 1.f, 1.f, 0.f), colour(1.0f, 1.0f, 1.0f), colour(0.2f, 0.2f, 0.2f) };
-    RandomNumberGenerator& rng = RandomNumberGenerator::getInstance();
 
-    // Structure to store random rotation parameters
-    struct rRot { float x; float y; float z; };
-    
-    // Vectors to store meshes and rotations
+    // Meshes of the vortex warp and their rotation speeds (1600 meshes)
     std::vector<Mesh*> scene;
-    std::vector<rRot> rotations;
-
-    // Initialize parameters for a scene with 1600 meshes
-    int rings = 100;
-    int meshesPerRing = 16;
-    float ringRadius = 6.f;   // Radius of the ring
-    float ringDepth = 3.5f;   // Distance between two rings
-    float pi = std::numbers::pi_v<float>;
-
-    // Pre-allocate memory for the scene & rotations
-    scene.reserve(rings * meshesPerRing);
-    rotations.reserve(rings * meshesPerRing);
-
-    // Mesh generation for the vortex warp, consisting of cubes and spheres, total of 1600 meshes
-    for (int i = 0; i < rings; i++) {
-        float offset = static_cast<float>(i) * 0.2f;
-        for (int j = 0; j < meshesPerRing; j++) {
-            Mesh* m = new Mesh();
-
-            // Make every 5th object a sphere, else make it a cube
-            if ((i * meshesPerRing + j) % 5 == 0) *m = Mesh::makeSphere(1.f, 15, 15);
-            else *m = Mesh::makeCube(1.f);
-            scene.push_back(m);
+    std::vector<FlyThrough::Rotation> rotations;
+    RandomNumberGenerator rng;
+    Texture texture = FlyThrough::makeTexture();
+    FlyThrough::build(rng, scene, rotations, &texture);
+
+    #if OPT_SCENE_BVH_CULLING
+        // Optimisation - Build a BVH over the scene for hierarchical frustum culling
+        SceneBVH bvh;
+        bvh.build(scene);
+        OcclusionBuffer occlusion;
+        std::vector<Mesh*> visible;
+        visible.reserve(scene.size());
+    #endif
 
-            // Find the current angle for polar coordinates
-            float theta = (static_cast<float>(j) / meshesPerRing) * 2 * pi;
-            theta += offset;
+    float zoffset = FlyThrough::START_Z;  // Initial camera Z-offset
+    float step = FlyThrough::STEP;        // Step size for camera movement
+    float maxDepth = FlyThrough::MAX_DEPTH;
+
+    // Rotate each cube in the grid
+    auto animate = [&rotations](size_t i, matrix& world) {
+        world = world * matrix::makeRotateXYZ(rotations[i].x, rotations[i].y, rotations[i].z);
+    };
+    auto animateMesh = [&scene, &animate](size_t i) { animate(i, scene[i]->world); };
+
+    // Collect the meshes to draw this frame (after the animation)
+    auto visibility = [&]() -> std::vector<Mesh*>& {
+        #if OPT_SCENE_BVH_CULLING
+            // Optimisation - Only submit the meshes that are inside the view frustum and not occluded
+            cullScene(renderer, bvh, occlusion, camera, visible);
+            std::vector<Mesh*>& drawList = visible;
+        #else
+            std::vector<Mesh*>& drawList = scene;
+        #endif
+        return drawList;
+    };
 
-            // Calculate polar coordinates for the rings, and set the word position of the mesh
-            float x = std::cos(theta) * ringRadius;
-            float y = std::sin(theta) * ringRadius;
-            float z = -ringDepth * static_cast<float>(i);
-            m->world = matrix::makeTranslation(x, y, z);
+    #if OPT_MULTITHREAD_USE_MT && OPT_MULTITHREAD_TASK_GRAPH
+        // Optimisation - Run animation, culling, vertex processing, binning and tile rasterization as one task graph
+        FrameGraph frameGraph(pool);
+    #endif
 
-            // Add rotation speed
-            rRot r{ rng.getRandomFloat(-.1f, .1f), rng.getRandomFloat(-.1f, .1f) , rng.getRandomFloat(-.1f, .1f) };
-            rotations.push_back(r);
-        }
-    }
-    float zoffset = 8.f;   // Initial camera Z-offset
-    float step = -0.15f;   // Step size for camera movement
-    float maxDepth = -(static_cast<float>(rings) * ringDepth) + 10.f;
+    #if OPT_MULTITHREAD_USE_MT && OPT_MULTITHREAD_PIPELINED_FRAMES
+        // Optimisation - Animate the next frame on the pool while the current frame is rendered
+        AnimationPipeline pipeline(pool, scene, rotations.size());
+        const size_t animatedCount = 0;  // The pipeline animates the meshes
+    #else
+        const size_t animatedCount = rotations.size();
+    #endif
 
     auto start = std::chrono::high_resolution_clock::now();
     std::chrono::time_point<std::chrono::high_resolution_clock> end;
@@ -542,13 +1196,8 @@ static void scene3() {
     // Main rendering loop
     while (running) {
         renderer.canvas.checkInput();
-        renderer.clear();
         camera = matrix::makeTranslation(0.f, 0.f, -zoffset); // Update camera position
 
-        // Rotate each cube in the grid
-        for (unsigned int i = 0; i < rotations.size(); i++)
-            scene[i]->world = scene[i]->world * matrix::makeRotateXYZ(rotations[i].x, rotations[i].y, rotations[i].z);
-        
         if (renderer.canvas.keyPressed(VK_ESCAPE)) break;
         zoffset += step;
 
@@ -557,6 +1206,15 @@ static void scene3() {
             if (++cycle % 2 == 0) {
                 end = std::chrono::high_resolution_clock::now();
                 std::cout << cycle / 2 << " :" << std::chrono::duration<double, std::milli>(end - start).count() << "ms\n";
+                #if OPT_MULTITHREAD_USE_MT
+                    printPoolStats(pool);
+                #endif
+                #if OPT_MULTITHREAD_USE_MT && OPT_MULTITHREAD_TASK_GRAPH && OPT_MULTITHREAD_TILE_COST_MODEL
+                    printTileStats(frameGraph);
+                #endif
+                #if DEBUG_COUNT_ALLOCATIONS
+                    printAllocations();
+                #endif
                 start = std::chrono::high_resolution_clock::now();
             }
         }
@@ -569,26 +1227,311 @@ static void scene3() {
         //    #endif
         //}
 
-        #if OPT_MULTITHREAD_USE_MT
-            renderMT(renderer, scene, camera, L);
+        renderer.beginFrame();  // The previous frame's transient data is no longer needed
+
+        #if OPT_MULTITHREAD_USE_MT && OPT_MULTITHREAD_PIPELINED_FRAMES
+            pipeline.next(animate);
+        #endif
+
+        #if OPT_MULTITHREAD_USE_MT && OPT_MULTITHREAD_TASK_GRAPH
+            frameGraph.execute(renderer, camera, L, animatedCount, animateMesh, visibility);
+        #elif OPT_MULTITHREAD_USE_MT && OPT_MULTITHREAD_COROUTINES
+            syncWait(pool, renderFrame(renderer, scratch, camera, L, animatedCount, animateMesh, visibility));
+            renderer.present();
         #else
-            for (auto& m : scene)
-                render(renderer, m, camera, L);
+            renderer.clear();
+            for (size_t i = 0; i < animatedCount; i++)
+                animateMesh(i);
+            std::vector<Mesh*>& drawList = visibility();
+
+            #if OPT_MULTITHREAD_USE_MT
+                renderMT(renderer, scratch, drawList, camera, L);
+            #else
+                render(renderer, scratch, drawList, camera, L);
+            #endif
+            renderer.present();
         #endif
+    }
+    for (auto& m : scene)
+        delete m;
+}
+
+// Scene drawn from several viewpoints in one pass - a stereo pair side by side and a thumbnail of the
+// whole grid of cubes, sharing the animation, culling and world space transform between the views
+// Input Variables:
+// - pool: Thread pool of the renderer
+static void sceneMultiView(ThreadPool& pool) {
+    Renderer renderer(pool);
+    Light L{ vec4(0.f, 1.f, 1.f, 0.f), colour(1.0f, 1.0f, 1.0f), colour(0.2f, 0.2f, 0.2f) };
+    bool running = true; // Main loop control variable
+
+    std::vector<Mesh*> scene;
+    struct rRot { float x; float y; float z; }; // Structure to store random rotation parameters
+    std::vector<rRot> rotations;
+    RandomNumberGenerator rng;
+
+    // Create a grid of cubes with random rotations
+    for (unsigned int y = 0; y < 6; y++) {
+        for (unsigned int x = 0; x < 8; x++) {
+            Mesh* m = new Mesh();
+            *m = Mesh::makeCube(1.f);
+            scene.push_back(m);
+            m->world = matrix::makeTranslation(-7.f + (static_cast<float>(x) * 2.f), 5.f - (static_cast<float>(y) * 2.f), -8.f);
+            rotations.push_back({ rng.getRandomFloat(-.1f, .1f), rng.getRandomFloat(-.1f, .1f), rng.getRandomFloat(-.1f, .1f) });
+        }
+    }
+
+    // Left and right eye at half the window width each, and a thumbnail in the top right corner
+    unsigned int width = renderer.getWidth(), height = renderer.getHeight();
+    RenderTarget leftEye, rightEye, thumbnail;
+    leftEye.create(width / 2, height);
+    rightEye.create(width / 2, height);
+    thumbnail.create(width / 4, height / 4);
+    MultiViewRenderer multiView(pool);
+
+    const float eyeSeparation = 0.3f;
+    float zoffset = 0.f;  // Camera Z-offset
+    float step = -0.05f;  // Step size for camera movement
+
+    auto start = std::chrono::high_resolution_clock::now();
+    int frame = 0;
+
+    // Main rendering loop
+    while (running) {
+        renderer.canvas.checkInput();
+        if (renderer.canvas.keyPressed(VK_ESCAPE)) break;
+
+        multiView.beginFrame();  // The previous frame's transient data is no longer needed
+
+        // Animated once, whatever the number of views
+        for (size_t i = 0; i < rotations.size(); i++)
+            scene[i]->world = scene[i]->world * matrix::makeRotateXYZ(rotations[i].x, rotations[i].y, rotations[i].z);
+
+        zoffset += step;
+        if (zoffset < -4.f || zoffset > 0.f) step *= -1.f;
+
+        View views[3] = {
+            { matrix::makeTranslation(eyeSeparation * 0.5f, 0.f, -zoffset), &leftEye },
+            { matrix::makeTranslation(-eyeSeparation * 0.5f, 0.f, -zoffset), &rightEye },
+            { matrix::makeTranslation(0.f, 0.f, -6.f), &thumbnail },
+        };
+        multiView.render(scene, views, 3, L);
+
+        leftEye.blit(renderer, 0, 0);
+        rightEye.blit(renderer, width / 2, 0);
+        thumbnail.blit(renderer, width - thumbnail.getWidth(), 0);
         renderer.present();
+
+        if (++frame % 200 == 0) {
+            auto end = std::chrono::high_resolution_clock::now();
+            std::cout << frame / 200 << " :" << std::chrono::duration<double, std::milli>(end - start).count() << "ms (200 frames, 3 views)\n";
+            start = end;
+        }
     }
+
     for (auto& m : scene)
         delete m;
 }
+#endif
+
+// Build the grid of cubes and spheres drawn by the concurrency check, in front of a camera at the origin
+// Output Variables:
+// - meshes: Meshes of the grid (replaced)
+// - scene: Pointers to the meshes (replaced)
+static void makeHeadlessScene(std::vector<Mesh>& meshes, std::vector<Mesh*>& scene) {
+    meshes.clear();
+    scene.clear();
+    meshes.reserve(48);
+    for (unsigned int i = 0; i < 48; i++) {
+        float x = -7.f + static_cast<float>(i % 8) * 2.f, y = 5.f - static_cast<float>(i / 8) * 2.f;
+        #if OPT_MESH_LOD
+            meshes.push_back(i % 3 == 0 ? Mesh::makeSphereLOD(0.9f, 16, 16) : Mesh::makeCube(1.f));
+        #else
+            meshes.push_back(i % 3 == 0 ? Mesh::makeSphere(0.9f, 16, 16) : Mesh::makeCube(1.f));
+        #endif
+        #if OPT_TRIANGLE_GOURAUD_LIGHTING
+            if (i % 3 == 0) meshes.back().shading = ShadingMode::Gouraud;
+        #endif
+        meshes.back().world = matrix::makeTranslation(x, y, -10.f);
+    }
+    for (Mesh& m : meshes)
+        scene.push_back(&m);
+}
+
+// Spin every mesh of the concurrency check's grid by one frame
+// Input Variables:
+// - scene: Meshes of the grid
+static void animateHeadlessScene(std::vector<Mesh*>& scene) {
+    for (size_t i = 0; i < scene.size(); i++) {
+        float speed = 0.01f * static_cast<float>(i % 7 + 1);
+        scene[i]->world = scene[i]->world * matrix::makeRotateXYZ(speed, 2.f * speed, 0.f);
+    }
+}
+
+// Draw a few frames of a scene with a headless renderer, the same way the scenes do
+// The renderer only reads the meshes, so several renderers can draw the same scene at once; the scene is moved
+// on by 'nextFrame' once a frame is drawn.
+// Input Variables:
+// - pool: Thread pool of the renderer
+// - scene: Meshes to draw
+// - width, height: Size of the image
+// - frames: Number of frames to draw
+// - distance: Distance the camera is moved back by
+// - nextFrame: Callable () called after every frame
+// Returns a checksum of every frame's image
+template <typename NextFrameFn>
+static std::vector<std::uint64_t> renderHeadless(ThreadPool& pool, std::vector<Mesh*>& scene, unsigned int width, unsigned int height, unsigned int frames,
+                                                 float distance, NextFrameFn&& nextFrame) {
+    RendererConfig config;
+    config.width = width;
+    config.height = height;
+    config.backend = RenderBackend::Headless;
+    Renderer renderer(pool, config);
+    RenderScratch scratch;
+    Light L{ vec4(0.f, 1.f, 1.f, 0.f), colour(1.0f, 1.0f, 1.0f), colour(0.2f, 0.2f, 0.2f) };
+
+    matrix camera = matrix::makeTranslation(0.f, 0.f, -distance);
+    auto animateMesh = [](size_t) {};  // Nothing is animated while the frame is drawn
+    auto visibility = [&scene]() -> std::vector<Mesh*>& { return scene; };
+    #if OPT_MULTITHREAD_USE_MT && OPT_MULTITHREAD_TASK_GRAPH
+        FrameGraph frameGraph(pool);
+    #endif
+
+    std::vector<std::uint64_t> checksums;
+    for (unsigned int frame = 0; frame < frames; frame++) {
+        renderer.beginFrame();
+        #if OPT_MULTITHREAD_USE_MT && OPT_MULTITHREAD_TASK_GRAPH
+            frameGraph.execute(renderer, camera, L, 0, animateMesh, visibility);
+        #elif OPT_MULTITHREAD_USE_MT && OPT_MULTITHREAD_COROUTINES
+            syncWait(pool, renderFrame(renderer, scratch, camera, L, 0, animateMesh, visibility));
+        #else
+            renderer.clear();
+            #if OPT_MULTITHREAD_USE_MT
+                renderMT(renderer, scratch, visibility(), camera, L);
+            #else
+                render(renderer, scratch, visibility(), camera, L);
+            #endif
+        #endif
+
+        // FNV-1a of the image
+        std::uint64_t hash = 14695981039346656037ull;
+        const unsigned char* image = renderer.getBackBuffer();
+        for (size_t i = 0; i < static_cast<size_t>(width) * height * 3; i++)
+            hash = (hash ^ image[i]) * 1099511628211ull;
+        checksums.push_back(hash);
+        nextFrame();
+    }
+    return checksums;
+}
+
+// Concurrent rendering check - two headless renderers of different sizes and camera distances draw the same
+// meshes on a shared pool, each driven by its own thread, and every frame must match the frame the same renderer
+// draws on its own: neither recycles the other's frame data, waits on the other's jobs, draws into the other's
+// per-thread buffers or reads the level of detail and meshlet cull the other picked for a shared mesh.
+// Both renderers finish a frame before the scene is animated for the next one.
+//   --check-concurrent [FRAMES]
+// Input Variables:
+// - pool: Thread pool shared by the renderers
+// - argc, argv: Command line
+// Returns the exit code (0 if every frame matched), or -1 if the command line does not ask for the check
+static int checkConcurrentRenderers(ThreadPool& pool, int argc, char** argv) {
+    if (argc < 2 || std::string(argv[1]) != "--check-concurrent") return -1;
+    unsigned int frames = (argc > 2) ? static_cast<unsigned int>(std::max(1, std::atoi(argv[2]))) : 100;
+
+    std::vector<Mesh> meshes;
+    std::vector<Mesh*> scene;
+    auto animate = [&scene]() noexcept { animateHeadlessScene(scene); };
+
+    // Each renderer on its own
+    makeHeadlessScene(meshes, scene);
+    std::vector<std::uint64_t> expectedA = renderHeadless(pool, scene, 320, 240, frames, 0.f, animate);
+    makeHeadlessScene(meshes, scene);
+    std::vector<std::uint64_t> expectedB = renderHeadless(pool, scene, 256, 256, frames, 4.f, animate);
+
+    // Both at once, on one scene
+    makeHeadlessScene(meshes, scene);
+    std::vector<std::uint64_t> actualA, actualB;
+    std::barrier frameDone(2, animate);  // The last renderer to finish a frame animates the scene
+    std::thread driverA([&]() { actualA = renderHeadless(pool, scene, 320, 240, frames, 0.f, [&frameDone]() { frameDone.arrive_and_wait(); }); });
+    std::thread driverB([&]() { actualB = renderHeadless(pool, scene, 256, 256, frames, 4.f, [&frameDone]() { frameDone.arrive_and_wait(); }); });
+    driverA.join();
+    driverB.join();
+
+    unsigned int mismatches = 0;
+    for (unsigned int i = 0; i < frames; i++)
+        mismatches += (actualA[i] != expectedA[i]) + (actualB[i] != expectedB[i]);
+    std::cout << "Concurrent renderers: " << frames << " frames each, " << mismatches << " mismatched frames\n";
+    return mismatches == 0 ? 0 : 1;
+}
 
 // Entry point of the application
-// No input variables
-int main() {
-    // Uncomment the desired scene function to run
-    //scene1();
-    //scene2();
-    //scene3_prototype();
-    scene3();
-    //sceneTest();
-    return 0;
+// Input Variables:
+// - argc, argv: Command line, empty for the interactive scenes (see DistributedRender::run for the distributed
+//   modes, RenderService::run for the render service and checkConcurrentRenderers for the concurrency check)
+int main(int argc, char** argv) {
+    #if OPT_MULTITHREAD_TOPOLOGY
+        // Optimisation - Size the pool from the detected CPU topology instead of a hard-coded thread count:
+        // one worker per physical core (fastest cores first, the fastest one is left to the main thread).
+        // On Linux and Windows each worker is pinned to its core; slower (E-)cores hold back from stealing
+        // while a fast worker is idle, and with the tile cost model their raster lanes claim tiles weighted
+        // by capacity (printPoolStats shows the busy time of each core class). Elsewhere the workers are
+        // unpinned and two hardware threads per core are assumed.
+        // The RASTER_THREADS environment variable overrides the worker count.
+        CpuTopology topology = CpuTopology::detect();
+        size_t cpu = topology.configuredWorkers();
+        ThreadPool threadpool(cpu, topology.workerPlacement(cpu));
+    #else
+        // Multithreaded Render Function
+        // CPU - Intel Core Ultra 7 155H
+        // Total Cores 16
+        // # of Performance-cores 6
+        // # of Efficient-cores 8
+        // # of Low Power Efficient-cores 2
+        // Total Threads 22
+        // https://www.intel.com/content/www/us/en/products/sku/236847/intel-core-ultra-7-processor-155h-24m-cache-up-to-4-80-ghz/specifications.html
+        size_t cpu = 6;  // Maximum Thread Count - std::thread::hardware_concurrency()
+        ThreadPool threadpool(cpu);
+    #endif
+
+    #if OPT_MULTITHREAD_TOPOLOGY
+        // Keep the main thread on the core the workers were placed around
+        if (cpu < topology.cpus.size()) CpuTopology::pinCurrentThread(topology.placementOrder().front().id);
+        // On stderr: in the render service stdout carries the replies
+        std::cerr << "Workers: " << cpu << " (" << topology.physicalCores() << " cores, " << topology.cpus.size() << " threads)\n";
+    #endif
+
+    #if OPT_MULTITHREAD_PERSISTENT_WORKERS
+        // Optimisation - Workers spin through the gap between two frames instead of parking, so the next frame
+        // does not pay an OS wake-up per worker
+        threadpool.setSpinTime(std::chrono::milliseconds(2));
+    #endif
+
+    // Headless distributed rendering of the scene3 fly-through (coordinator or worker process)
+    int distributed = DistributedRender::run(threadpool, argc, argv);
+    if (distributed >= 0) return distributed;
+
+    // Long running render service, answering scene description jobs from stdin or a socket
+    int service = RenderService::run(threadpool, argc, argv);
+    if (service >= 0) return service;
+
+    // Check that headless renderers sharing the pool can draw concurrently
+    int check = checkConcurrentRenderers(threadpool, argc, argv);
+    if (check >= 0) return check;
+
+    #ifdef _WIN32
+        // Uncomment the desired scene function to run
+        //scene1(threadpool);
+        //scene2(threadpool);
+        //scene3_prototype(threadpool);
+        scene3(threadpool);
+        //sceneTest(threadpool);
+        //sceneMultiView(threadpool);
+        return 0;
+    #else
+        // No window without _WIN32, only the headless modes run
+        std::cerr << "Usage: raster --coordinator ADDRESS [options] | --worker ADDRESS | --scaling ADDRESS MAX_WORKERS [options]\n"
+                     "              | --service -|ADDRESS [--slots N] | --check-concurrent [FRAMES]\n"
+                     "The interactive scenes need the Windows window backend (see README.md)\n";
+        return 1;
+    #endif
 }
\ No newline at end of file
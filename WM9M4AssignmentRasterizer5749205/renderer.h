@@ -1,45 +1,202 @@
 #pragma once
 
+#include <algorithm>
+#include <cstring>
+#include <memory>
 #include <numbers>
+#include <string>
 
-#include "GamesEngineeringBase.h"
+#ifdef _WIN32
+    #include "GamesEngineeringBase.h"  // Window backend (the library is Windows only)
+#endif
 #include "matrix.h"
+#include "Multithread.h"
+#include "OptimisationProfiles.h"
 #include "zbuffer.h"
 
-// The 'Renderer' class handles rendering operations, including managing the
-// Z-buffer, canvas, and perspective transformations for a 3D scene.
-class Renderer {
+// Where a Renderer draws to (without _WIN32 there is no window, every renderer draws offscreen)
+enum class RenderBackend {
+    Window,     // A GamesEngineeringBase window, presented to the screen
+    Headless    // An offscreen image only, no window is created (batch rendering, services, tests)
+};
+
+// Everything a Renderer is created from
+struct RendererConfig {
+    unsigned int width = 1024;   // Size of the image in pixels
+    unsigned int height = 768;
     #if OPT_RENDERER_DISABLE_REDUNDANT_DIVS
         // Optimisation - Drop the unneccessary divisions
         float fov = std::numbers::pi_v<float> * 0.5f;  // Field of view in radians (90.f/180.f = 0.5f)
-        float aspect = 1.3333334f;					   // Aspect ratio of the canvas (1024.f/768.f = 4.f/3.f)
     #else
-        // Base Rasterizer - 2 Unnecessary Divisions
+        // Base Rasterizer - Unnecessary Division
         float fov = 90.0f * std::numbers::pi_v<float> / 180.0f;  // Field of view in radians (converted from degrees)
-        float aspect = 4.0f / 3.0f;                              // Aspect ratio of the canvas (width/height)
     #endif
-    float n = 0.1f;   // Near clipping plane distance
-    float f = 100.f;  // Far clipping plane distance
+    float nearPlane = 0.1f;      // Near clipping plane distance
+    float farPlane = 100.f;      // Far clipping plane distance
+    RenderBackend backend = RenderBackend::Window;
+    std::string title = "Raster";  // Window title
+};
+
+// The 'Renderer' class handles rendering operations, including managing the
+// Z-buffer, canvas, and perspective transformations for a 3D scene.
+// A Renderer holds no global state: its size, projection and backend come from its config, the
+// multithreaded paths run on the pool it was given, and its frame data lives in its own frame context.
+// Renderers can therefore draw concurrently, on one pool or on several, each driven by its own thread.
+class Renderer {
+    RendererConfig config;
+    ThreadPool& threads;                        // Pool the multithreaded paths run on
+    FrameContext frames;                        // Arenas and jobs of the renderer's frames
+    std::unique_ptr<unsigned char[]> offscreen; // Image of a headless renderer
+    unsigned char* image = nullptr;             // RGB, 3 bytes per pixel (the window's back buffer or 'offscreen')
+    unsigned int width = 0, height = 0;
 public:
     Zbuffer<float> zbuffer;               // Z-buffer for depth management
-    GamesEngineeringBase::Window canvas;  // Canvas for rendering the scene
+    #ifdef _WIN32
+        GamesEngineeringBase::Window canvas;  // Canvas for rendering the scene (input and presenting, Window backend only)
+    #endif
     matrix perspective;                   // Perspective projection matrix
 
     // Constructor initializes the canvas, Z-buffer, and perspective projection matrix.
-    Renderer() {
-        canvas.create(1024, 768, "Raster");                        // Create a canvas with specified dimensions and title
-        zbuffer.create(1024, 768);                                 // Initialize the Z-buffer with the same dimensions
-        perspective = matrix::makePerspective(fov, aspect, n, f);  // Set up the perspective matrix
+    // Input Variables:
+    // - pool: Thread pool of the multithreaded paths
+    // - settings: Resolution, projection and backend (a 1024x768 window by default)
+    explicit Renderer(ThreadPool& pool, const RendererConfig& settings = {}) : config(settings), threads(pool), frames(pool) {
+        width = config.width;
+        height = config.height;
+        #ifdef _WIN32
+        if (config.backend == RenderBackend::Window) {
+            canvas.create(width, height, config.title);  // Create a canvas with specified dimensions and title
+            image = canvas.getBackBuffer();
+        }
+        else
+        #endif
+        {
+            offscreen.reset(new unsigned char[static_cast<size_t>(width) * height * 3]);
+            image = offscreen.get();
+        }
+        zbuffer.create(width, height);  // Initialize the Z-buffer with the same dimensions
+        clear();
+
+        // Set up the perspective matrix, the aspect ratio follows the size
+        float aspect = static_cast<float>(width) / static_cast<float>(height);
+        perspective = matrix::makePerspective(config.fov, aspect, config.nearPlane, config.farPlane);
+    }
+
+    Renderer(const Renderer&) = delete;
+    Renderer& operator=(const Renderer&) = delete;
+
+    // Returns the settings the renderer was created with
+    const RendererConfig& getConfig() const { return config; }
+
+    // Returns the thread pool of the multithreaded paths
+    ThreadPool& pool() const { return threads; }
+
+    // Returns the near clipping plane distance
+    float getNear() const { return config.nearPlane; }
+
+    unsigned int getWidth() const { return width; }
+    unsigned int getHeight() const { return height; }
+    unsigned char* getBackBuffer() const { return image; }
+
+    // Writes the colour of a pixel
+    void draw(int x, int y, unsigned char r, unsigned char g, unsigned char b) {
+        unsigned char* pixel = &image[((static_cast<size_t>(y) * width) + x) * 3];
+        pixel[0] = r;
+        pixel[1] = g;
+        pixel[2] = b;
+    }
+
+    // Start a new frame (recycles the renderer's frame arenas) and bind the calling thread to it, so this thread
+    // drives the frame. Call once the previous frame's data is no longer needed.
+    void beginFrame() {
+        frames.beginFrame();
+        threads.bind(&frames);
     }
 
     // Clears the canvas and resets the Z-buffer.
     void clear() {
-        canvas.clear();   // Clear the canvas (sets all pixels to the background color)
+        std::memset(image, 0, static_cast<size_t>(width) * height * 3);  // Clear the canvas (sets all pixels to the background color)
         zbuffer.clear();  // Reset the Z-buffer to the farthest depth
     }
 
-    // Presents the current canvas frame to the display.
+    // Clears a rectangle of the canvas and the Z-buffer (tiles of the screen can be cleared in parallel)
+    // Input Variables:
+    // - x0, y0: Top left corner of the rectangle.
+    // - x1, y1: Bottom right corner of the rectangle (exclusive).
+    void clearTile(unsigned int x0, unsigned int y0, unsigned int x1, unsigned int y1) {
+        for (unsigned int y = y0; y < y1; y++)
+            std::memset(&image[((static_cast<size_t>(y) * width) + x0) * 3], 0, (x1 - x0) * 3);
+        zbuffer.clearRect(x0, y0, x1, y1);
+    }
+
+    // Presents the current canvas frame to the display (nothing to do for a headless renderer).
     void present() {
-        canvas.present();  // Display the rendered frame
+        #ifdef _WIN32
+            if (config.backend == RenderBackend::Window) canvas.present();  // Display the rendered frame
+        #endif
+    }
+};
+
+// Offscreen render target - a colour image and a Z-buffer with its own size and projection, so one frame
+// can be drawn from several viewpoints (thumbnails, a minimap, stereo pairs) and copied into a renderer
+class RenderTarget {
+    std::unique_ptr<unsigned char[]> image;  // RGB, 3 bytes per pixel like the canvas
+    unsigned int width = 0, height = 0;
+    float n = 0.1f;   // Near clipping plane distance
+public:
+    Zbuffer<float> zbuffer;  // Z-buffer for depth management
+    matrix perspective;      // Perspective projection matrix
+
+    // Allocates the target and sets up its projection (the aspect ratio follows the size)
+    // Input Variables:
+    // - w, h: Size of the target in pixels.
+    // - fov: Vertical field of view in radians.
+    // - nearPlane, farPlane: Clipping plane distances.
+    void create(unsigned int w, unsigned int h, float fov = std::numbers::pi_v<float> * 0.5f, float nearPlane = 0.1f, float farPlane = 100.f) {
+        width = w;
+        height = h;
+        n = nearPlane;
+        image.reset(new unsigned char[static_cast<size_t>(w) * h * 3]);
+        zbuffer.create(w, h);
+        perspective = matrix::makePerspective(fov, static_cast<float>(w) / static_cast<float>(h), nearPlane, farPlane);
+        clearRect(0, 0, w, h);
+    }
+
+    unsigned int getWidth() const { return width; }
+    unsigned int getHeight() const { return height; }
+    unsigned char* getBackBuffer() const { return image.get(); }
+
+    // Returns the near clipping plane distance
+    float getNear() const { return n; }
+
+    // Writes the colour of a pixel
+    void draw(int x, int y, unsigned char r, unsigned char g, unsigned char b) {
+        unsigned char* pixel = &image[((static_cast<size_t>(y) * width) + x) * 3];
+        pixel[0] = r;
+        pixel[1] = g;
+        pixel[2] = b;
+    }
+
+    // Clears a rectangle of the image and the Z-buffer
+    // Input Variables:
+    // - x0, y0: Top left corner of the rectangle.
+    // - x1, y1: Bottom right corner of the rectangle (exclusive).
+    void clearRect(unsigned int x0, unsigned int y0, unsigned int x1, unsigned int y1) {
+        for (unsigned int y = y0; y < y1; y++)
+            std::memset(&image[((static_cast<size_t>(y) * width) + x0) * 3], 0, (x1 - x0) * 3);
+        zbuffer.clearRect(x0, y0, x1, y1);
+    }
+
+    // Copies the image into a renderer's canvas, clipped to the canvas
+    // Input Variables:
+    // - canvas: Renderer to copy into.
+    // - x, y: Position of the top left corner in the canvas.
+    void blit(Renderer& canvas, unsigned int x, unsigned int y) const {
+        if (x >= canvas.getWidth() || y >= canvas.getHeight()) return;
+        unsigned int w = std::min(width, canvas.getWidth() - x);
+        unsigned int h = std::min(height, canvas.getHeight() - y);
+        unsigned char* out = canvas.getBackBuffer();
+        for (unsigned int row = 0; row < h; row++)
+            std::memcpy(&out[((static_cast<size_t>(y + row) * canvas.getWidth()) + x) * 3], &image[static_cast<size_t>(row) * width * 3], static_cast<size_t>(w) * 3);
     }
-};
\ No newline at end of file
+};
@@ -0,0 +1,520 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <immintrin.h>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "arena.h"
+#include "coroutine.h"
+#include "flythrough.h"
+#include "light.h"
+#include "mesh.h"
+#include "multiview.h"
+#include "Multithread.h"
+#include "renderer.h"
+#include "sockets.h"
+
+#ifdef _WIN32
+    #include <fcntl.h>
+    #include <io.h>
+#else
+    #include <csignal>
+    #include <poll.h>
+    #include <unistd.h>
+#endif
+
+// Render service - a long running process that renders scene descriptions sent to it, instead of one scene
+// in a window. Jobs are read one per line from stdin or from the clients of a local socket (Unix or TCP):
+//
+//   <id> <W>x<H> <item> <item> ...
+//     cube X Y Z [SIZE]          cube centred on (X, Y, Z), seen by a camera at the origin looking down -z
+//     sphere X Y Z [RADIUS]
+//     vortex FRAME [SEED]        frame of the scene3 fly-through (with its own camera), FRAME <= FlyThrough::MAX_FRAME
+//   quit                         stop the service once the jobs already queued are answered
+//
+// Every job is rendered headless into a RenderTarget at the requested resolution and answered on the stream
+// it came from, as soon as it is done (so not necessarily in order):
+//
+//   image <id> <bytes>\n followed by the image, a binary PPM of 'bytes' bytes
+//   error <id> <reason>\n
+//
+// Up to 'slots' jobs run concurrently as coroutine tasks on the one thread pool: every slot owns its render
+// target, renderer and meshes, and the jobs' parallel_for stages interleave on the workers. A slot takes the
+// next queued job as soon as its own job is answered, so a slow job only holds up its own slot. Each job lives
+// in the frame context of its slot's renderer (its coroutine frame included), begun when the job starts, so
+// recycling it never touches the data of the jobs still running in the other slots. The serving thread helps
+// run the jobs of the busy slots between handing out jobs, and vortex fly-throughs are lent to whichever slot
+// takes the next vortex job.
+// Throughput (jobs/s) and the latency of the jobs (from the arrival of the line to the reply) are reported on
+// stderr every few seconds and when the service stops.
+// Sockets are POSIX only; on Windows the service reads its jobs from stdin.
+class RenderService {
+public:
+    static constexpr unsigned int MAX_SIZE = 4096;  // Largest width or height accepted
+    static constexpr std::chrono::seconds REPORT_INTERVAL{ 2 };
+    static constexpr size_t LATENCY_SAMPLES = 4096;  // Latencies kept for the all-time percentiles
+
+    // Start the service from the command line
+    //   --service -|ADDRESS [--slots N] - read jobs from stdin (-) or from the clients of a socket
+    // Input Variables:
+    // - pool: Thread pool the jobs are rendered on
+    // - argc, argv: Command line
+    // Returns the exit code, or -1 if the command line does not ask for the service
+    static int run(ThreadPool& pool, int argc, char** argv) {
+        if (argc < 3 || std::string(argv[1]) != "--service") return -1;
+        unsigned int slots = 4;
+        for (int i = 3; i < argc; i++) {
+            std::string option = argv[i];
+            if (option == "--slots" && i + 1 < argc) slots = static_cast<unsigned int>(std::max(1, std::atoi(argv[++i])));
+            else return usage();
+        }
+
+        RenderService service(pool, slots);
+        std::string address = argv[2];
+        if (address == "-") return service.serveStdin();
+
+        #ifdef _WIN32
+            std::cerr << "The render service needs POSIX sockets on Windows, use --service - (stdin)\n";
+            return 1;
+        #else
+            return service.serveSocket(address);
+        #endif
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    // Stream jobs arrive on and replies go to, closed once its last job has been answered
+    struct Client {
+        int fd = -1;        // Socket, or -1 for stdout
+        std::mutex write;   // Replies of concurrent jobs must not interleave
+
+        void reply(const void* data, size_t size) {
+            std::lock_guard<std::mutex> lock(write);
+            if (fd < 0) {
+                std::fwrite(data, 1, size, stdout);
+                std::fflush(stdout);
+            }
+            #ifndef _WIN32
+                else Socket::sendAll(fd, data, size);  // A client that went away only loses its replies
+            #endif
+        }
+
+        void reply(const std::string& text) { reply(text.data(), text.size()); }
+
+        ~Client() {
+            #ifndef _WIN32
+                if (fd >= 0) close(fd);
+            #endif
+        }
+    };
+
+    // Job line waiting in the queue
+    struct Pending {
+        std::string line;
+        std::shared_ptr<Client> client;
+        Clock::time_point arrival;
+    };
+
+    // Object of a job's scene
+    struct Item {
+        enum Type { CUBE, SPHERE } type;
+        float x, y, z;
+        float size;
+    };
+
+    // Job of a slot, parsed from its line
+    struct Job {
+        Pending source;
+        std::string id;
+        unsigned int width = 0, height = 0;
+        std::vector<Item> items;
+        bool vortex = false;
+        std::uint64_t frame = 0;
+        unsigned int seed = 1;
+    };
+
+    // Vortex fly-through with the seed it was built from
+    struct Flight {
+        std::unique_ptr<FlyThrough> sequence;
+        unsigned int seed = 0;
+    };
+
+    // Everything one concurrent job renders with
+    struct Slot {
+        Job job;
+        RenderTarget target;
+        MultiViewRenderer renderer;
+        std::vector<Mesh> meshes;               // Meshes of the job's items
+        std::vector<Mesh*> scene;
+        Flight flight;                          // Fly-through lent to the slot's vortex job, if any
+        std::vector<unsigned char> encoded;     // Reply header and image
+        double latency = 0.0;                   // Milliseconds from arrival to reply
+        Task<> task;                            // Job in flight, if any
+        TaskLatch latch;                        // Released once 'task' has finished
+
+        explicit Slot(ThreadPool& pool) : renderer(pool) {}
+    };
+
+    ThreadPool& pool;
+    std::vector<std::unique_ptr<Slot>> slots;
+
+    std::mutex queueMutex;
+    std::condition_variable queueReady;         // A job was queued or answered, or the readers are done
+    std::deque<Pending> queue;
+    std::vector<Slot*> answered;                // Slots whose job was answered, to be taken back by serve()
+    std::vector<Flight> flights;                // Fly-throughs of answered vortex jobs, oldest first (serve() only)
+    bool closed = false;                        // No more jobs will be queued
+    std::atomic<bool> stopping = false;         // 'quit' was received
+
+    // Statistics
+    Clock::time_point start, windowStart;
+    std::vector<double> windowLatencies;        // Of the jobs answered in the current report window
+    std::vector<double> sampledLatencies;       // Uniform sample (reservoir) of every job answered since the start
+    std::uint64_t answeredCount = 0;            // Jobs answered since the service started
+    std::uint32_t sampleRng = 0x2F6B7A1Du;      // xorshift state for the reservoir
+
+    RenderService(ThreadPool& threads, unsigned int count) : pool(threads) {
+        for (unsigned int i = 0; i < count; i++)
+            slots.push_back(std::make_unique<Slot>(pool));
+    }
+
+    static int usage() {
+        std::cerr << "usage: raster --service -|ADDRESS [--slots N]\n";
+        return 2;
+    }
+
+    // Queue a line read by one of the readers, returns false once the service is stopping
+    bool push(std::string line, const std::shared_ptr<Client>& client) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.find_first_not_of(" \t") == std::string::npos) return true;
+        if (line == "quit") {
+            stopping.store(true);
+            finish();
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(queueMutex);
+        queue.push_back({ std::move(line), client, Clock::now() });
+        queueReady.notify_one();
+        return true;
+    }
+
+    // No more jobs will be queued
+    void finish() {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        closed = true;
+        queueReady.notify_one();
+    }
+
+    int serveStdin() {
+        #ifdef _WIN32
+            _setmode(_fileno(stdout), _O_BINARY);  // The images are binary
+        #endif
+        std::shared_ptr<Client> client = std::make_shared<Client>();
+        std::thread reader([this, client]() {
+            std::string line;
+            while (std::getline(std::cin, line))
+                if (!push(line, client)) return;
+            finish();
+        });
+        int result = serve();
+        reader.join();
+        return result;
+    }
+
+#ifndef _WIN32
+    // Accept clients and read their lines until 'quit'
+    int serveSocket(const std::string& address) {
+        std::signal(SIGPIPE, SIG_IGN);
+        int listener = Socket::open(address, true);
+        if (listener < 0) {
+            std::cerr << "service: cannot listen on " << address << "\n";
+            return 1;
+        }
+        std::cerr << "service: listening on " << address << "\n";
+
+        std::thread reader([this, listener]() {
+            struct Connection {
+                std::shared_ptr<Client> client;
+                std::string buffer;   // Partial line
+            };
+            std::vector<Connection> connections;
+            std::vector<pollfd> fds;
+            char chunk[4096];
+
+            while (!stopping.load()) {
+                fds.assign(1, pollfd{ listener, POLLIN, 0 });
+                for (const Connection& c : connections)
+                    fds.push_back(pollfd{ c.client->fd, POLLIN, 0 });
+                if (poll(fds.data(), fds.size(), 100) <= 0) continue;  // Wake up now and then to notice 'quit'
+
+                if (fds[0].revents & POLLIN) {
+                    int fd = accept(listener, nullptr, nullptr);
+                    if (fd >= 0) {
+                        std::shared_ptr<Client> client = std::make_shared<Client>();
+                        client->fd = fd;
+                        connections.push_back({ client, {} });
+                    }
+                }
+                for (size_t i = fds.size() - 1; i >= 1; i--) {
+                    if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+                    Connection& c = connections[i - 1];
+                    ssize_t received = recv(c.client->fd, chunk, sizeof(chunk), 0);
+                    if (received <= 0) {
+                        // The client stops sending, its socket closes once its queued jobs have been answered
+                        shutdown(c.client->fd, SHUT_RD);
+                        connections.erase(connections.begin() + static_cast<std::ptrdiff_t>(i - 1));
+                        continue;
+                    }
+                    c.buffer.append(chunk, static_cast<size_t>(received));
+                    size_t begin = 0, end;
+                    while ((end = c.buffer.find('\n', begin)) != std::string::npos) {
+                        if (!push(c.buffer.substr(begin, end - begin), c.client)) break;
+                        begin = end + 1;
+                    }
+                    c.buffer.erase(0, begin);
+                }
+            }
+        });
+        int result = serve();
+        reader.join();
+        ::close(listener);
+        if (address.rfind("unix:", 0) == 0) unlink(address.c_str() + 5);
+        return result;
+    }
+#endif
+
+    // Parse a job line into a slot's job, returns the reason it is not valid (empty if it is)
+    static std::string parse(Job& job) {
+        std::istringstream in(job.source.line);
+        std::string size;
+        if (!(in >> job.id)) return "empty job";
+        if (!(in >> size) || std::sscanf(size.c_str(), "%ux%u", &job.width, &job.height) != 2) return "expected a size WxH";
+        if (job.width == 0 || job.height == 0 || job.width > MAX_SIZE || job.height > MAX_SIZE) return "size out of range";
+
+        job.items.clear();
+        job.vortex = false;
+        std::string word;
+        while (in >> word) {
+            if (word == "cube" || word == "sphere") {
+                Item item{ word == "cube" ? Item::CUBE : Item::SPHERE, 0.f, 0.f, 0.f, 1.f };
+                if (!(in >> item.x >> item.y >> item.z)) return "expected " + word + " X Y Z";
+                std::streampos mark = in.tellg();
+                if (!(in >> item.size)) {
+                    in.clear();
+                    in.seekg(mark);
+                    item.size = 1.f;
+                }
+                if (!(item.size > 0.f)) return word + " size must be positive";
+                job.items.push_back(item);
+            }
+            else if (word == "vortex") {
+                unsigned long long frame = 0;
+                if (!(in >> frame)) return "expected vortex FRAME [SEED]";
+                if (frame > FlyThrough::MAX_FRAME) return "vortex frame out of range (at most " + std::to_string(FlyThrough::MAX_FRAME) + ")";
+                job.frame = frame;
+                job.seed = 1;
+                std::streampos mark = in.tellg();
+                unsigned int seed = 0;
+                if (in >> seed) job.seed = seed;
+                else {
+                    in.clear();
+                    in.seekg(mark);
+                }
+                job.vortex = true;
+            }
+            else return "unknown item '" + word + "'";
+        }
+        if (job.vortex && !job.items.empty()) return "a vortex job has no other items";
+        return {};
+    }
+
+    // Render the job of a slot on the pool, answer it and hand the slot back to serve()
+    Task<> renderJob(Slot& slot) {
+        co_await pool.schedule();
+
+        Job& job = slot.job;
+        if (slot.target.getWidth() != job.width || slot.target.getHeight() != job.height) slot.target.create(job.width, job.height);
+
+        Light L{ vec4(0.f, 1.f, 1.f, 0.f), colour(1.0f, 1.0f, 1.0f), colour(0.2f, 0.2f, 0.2f) };
+        View view{ matrix(), &slot.target };  // Camera at the origin looking down -z
+        slot.renderer.forgetLevels();  // The image only depends on the job, not on what the slot drew before
+        if (job.vortex) {
+            if (!slot.flight.sequence) {
+                slot.flight.sequence = std::make_unique<FlyThrough>(job.seed);
+                slot.flight.seed = job.seed;
+            }
+            slot.flight.sequence->seek(job.frame);
+            view.camera = slot.flight.sequence->camera();
+            slot.renderer.render(slot.flight.sequence->scene, &view, 1, L);
+        }
+        else {
+            slot.meshes.clear();
+            slot.scene.clear();
+            for (const Item& item : job.items) {
+                slot.meshes.push_back(item.type == Item::CUBE ? Mesh::makeCube(item.size) : Mesh::makeSphere(item.size, 20, 20));
+                slot.meshes.back().world = matrix::makeTranslation(item.x, item.y, item.z);
+                #if OPT_TRIANGLE_GOURAUD_LIGHTING
+                    if (item.type == Item::SPHERE) slot.meshes.back().shading = ShadingMode::Gouraud;
+                #endif
+            }
+            for (Mesh& m : slot.meshes)
+                slot.scene.push_back(&m);
+            slot.renderer.render(slot.scene, &view, 1, L);
+        }
+
+        // Encode: reply header, then the image as a binary PPM
+        char header[64];
+        int headerSize = std::snprintf(header, sizeof(header), "P6\n%u %u\n255\n", job.width, job.height);
+        size_t pixels = static_cast<size_t>(job.width) * job.height * 3;
+        std::string reply = "image " + job.id + " " + std::to_string(static_cast<size_t>(headerSize) + pixels) + "\n";
+        slot.encoded.assign(reply.begin(), reply.end());
+        slot.encoded.insert(slot.encoded.end(), header, header + headerSize);
+        slot.encoded.insert(slot.encoded.end(), slot.target.getBackBuffer(), slot.target.getBackBuffer() + pixels);
+
+        job.source.client->reply(slot.encoded.data(), slot.encoded.size());
+        slot.latency = std::chrono::duration<double, std::milli>(Clock::now() - job.source.arrival).count();
+
+        std::lock_guard<std::mutex> lock(queueMutex);
+        answered.push_back(&slot);
+        queueReady.notify_one();
+    }
+
+    // Record the latency of an answered job, in the report window and in the all-time sample
+    // Optimisation - The all-time percentiles come from a fixed size reservoir rather than every latency
+    // since the start, so a long running service neither grows nor sorts an ever larger history
+    void record(double latency) {
+        windowLatencies.push_back(latency);
+        answeredCount++;
+        if (sampledLatencies.size() < LATENCY_SAMPLES) {
+            sampledLatencies.push_back(latency);
+            return;
+        }
+        // Keep the new latency with probability LATENCY_SAMPLES / answeredCount
+        sampleRng ^= sampleRng << 13; sampleRng ^= sampleRng >> 17; sampleRng ^= sampleRng << 5;
+        std::uint64_t k = sampleRng % answeredCount;
+        if (k < LATENCY_SAMPLES) sampledLatencies[static_cast<size_t>(k)] = latency;
+    }
+
+    // Print the throughput and latency percentiles of a number of jobs
+    // Input Variables:
+    // - label: Name of the report
+    // - count: Jobs answered over the period
+    // - samples: Latencies of those jobs, or a uniform sample of them (reordered)
+    // - seconds: Length of the period
+    void report(const char* label, std::uint64_t count, std::vector<double>& samples, double seconds) {
+        if (count == 0 || samples.empty()) return;
+        auto percentile = [&samples](double p) {
+            size_t k = std::min(samples.size() - 1, static_cast<size_t>(p * static_cast<double>(samples.size())));
+            std::nth_element(samples.begin(), samples.begin() + static_cast<std::ptrdiff_t>(k), samples.end());
+            return samples[k];
+        };
+        double p50 = percentile(0.50), p99 = percentile(0.99);
+        std::fprintf(stderr, "service %s: %llu jobs, %.1f jobs/s, latency p50 %.2f ms, p99 %.2f ms\n",
+            label, static_cast<unsigned long long>(count), static_cast<double>(count) / std::max(seconds, 1e-9), p50, p99);
+    }
+
+    // Hand the queued jobs to the free slots as they come and go, until the readers are done and every job is answered
+    int serve() {
+        start = windowStart = Clock::now();
+        std::vector<Slot*> idle;                // Slots without a job
+        for (auto it = slots.rbegin(); it != slots.rend(); ++it)
+            idle.push_back(it->get());
+        std::vector<Slot*> done;
+        bool helped = false;                    // The last round ran a job of a busy slot
+
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(queueMutex);
+                auto ready = [&]() {
+                    return !answered.empty() || (!idle.empty() && !queue.empty()) || (closed && queue.empty() && idle.size() == slots.size());
+                };
+                if (!helped) queueReady.wait_for(lock, REPORT_INTERVAL, ready);
+                if (answered.empty() && queue.empty() && closed && idle.size() == slots.size()) break;
+                done.swap(answered);
+            }
+
+            // Take back the slots whose job was answered
+            for (Slot* slot : done) {
+                while (!slot->latch.released.load(std::memory_order_acquire))
+                    _mm_pause();  // The coroutine is reaching its final suspend point
+                slot->task = {};
+                record(slot->latency);
+                slot->job.source = {};  // Let the client close once it has no jobs left
+                if (slot->flight.sequence) {
+                    // Keep the fly-through for the next vortex jobs, dropping the oldest beyond one per slot
+                    flights.push_back(std::move(slot->flight));
+                    if (flights.size() > slots.size()) flights.erase(flights.begin());
+                }
+                idle.push_back(slot);
+            }
+            done.clear();
+
+            // Start the next queued job in every free slot, answering the invalid ones straight away
+            while (!idle.empty()) {
+                Slot& slot = *idle.back();
+                {
+                    std::lock_guard<std::mutex> lock(queueMutex);
+                    if (queue.empty()) break;
+                    slot.job.source = std::move(queue.front());
+                    queue.pop_front();
+                }
+                std::string error = parse(slot.job);
+                if (!error.empty()) {
+                    slot.job.source.client->reply("error " + (slot.job.id.empty() ? std::string("-") : slot.job.id) + " " + error + "\n");
+                    slot.job.source = {};
+                    continue;
+                }
+                if (slot.job.vortex) {
+                    // Optimisation - Lend the job the fly-through that replays the fewest frames to reach it,
+                    // whichever slot built it, rather than replaying the sequence in every slot it lands in
+                    auto cost = [&slot](const Flight& flight) {
+                        return flight.seed == slot.job.seed ? flight.sequence->seekCost(slot.job.frame) : FlyThrough::MAX_FRAME + 1;
+                    };
+                    auto best = std::min_element(flights.begin(), flights.end(), [&cost](const Flight& a, const Flight& b) { return cost(a) < cost(b); });
+                    if (best != flights.end() && best->seed == slot.job.seed) {
+                        slot.flight = std::move(*best);
+                        flights.erase(best);
+                    }
+                }
+                idle.pop_back();
+                slot.renderer.beginFrame();  // The slot's previous job is done with its frame data
+                slot.task = renderJob(slot);  // The coroutine frame lives in the slot's frame context
+                launch(slot.task, slot.latch);
+            }
+
+            // Optimisation - Help run the jobs of the busy slots rather than sleeping while they render, only
+            // waiting for the next answer once none of them has a queued job left
+            helped = false;
+            for (auto& slot : slots) {
+                if (!slot->task.coroutine()) continue;
+                pool.bind(&slot->renderer.context());
+                helped = pool.runOne() || helped;
+            }
+            pool.bind(nullptr);
+
+            Clock::time_point now = Clock::now();
+            if (now - windowStart >= REPORT_INTERVAL) {
+                report("window", windowLatencies.size(), windowLatencies, std::chrono::duration<double>(now - windowStart).count());
+                windowStart = now;
+                windowLatencies.clear();
+            }
+        }
+
+        report("total", answeredCount, sampledLatencies, std::chrono::duration<double>(Clock::now() - start).count());
+        return 0;
+    }
+};
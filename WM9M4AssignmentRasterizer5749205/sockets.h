@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstring>
+#include <string>
+
+#ifndef _WIN32
+    #include <netdb.h>
+    #include <netinet/in.h>
+    #include <netinet/tcp.h>
+    #include <sys/socket.h>
+    #include <sys/types.h>
+    #include <sys/un.h>
+    #include <unistd.h>
+#endif
+
+// Blocking stream sockets addressed by strings: "unix:/path" for a Unix domain socket, "tcp:host:port" or
+// "host:port" for TCP (an empty host listens on every interface). POSIX only.
+class Socket {
+public:
+#ifndef _WIN32
+    // Open a listening (server) or connected (client) stream socket
+    // Returns the socket, or -1 on failure
+    static int open(const std::string& address, bool server) {
+        if (address.rfind("unix:", 0) == 0) {
+            std::string path = address.substr(5);
+            sockaddr_un sa{};
+            sa.sun_family = AF_UNIX;
+            if (path.empty() || path.size() >= sizeof(sa.sun_path)) return -1;
+            std::memcpy(sa.sun_path, path.c_str(), path.size() + 1);
+            int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (fd < 0) return -1;
+            if (server) {
+                unlink(path.c_str());  // Left over from an earlier run
+                if (bind(fd, reinterpret_cast<sockaddr*>(&sa), sizeof(sa)) == 0 && listen(fd, 64) == 0) return fd;
+            }
+            else if (connect(fd, reinterpret_cast<sockaddr*>(&sa), sizeof(sa)) == 0) return fd;
+            close(fd);
+            return -1;
+        }
+
+        std::string hostPort = (address.rfind("tcp:", 0) == 0) ? address.substr(4) : address;
+        size_t colon = hostPort.rfind(':');
+        if (colon == std::string::npos) return -1;
+        std::string host = hostPort.substr(0, colon), port = hostPort.substr(colon + 1);
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if (server) hints.ai_flags = AI_PASSIVE;
+        addrinfo* list = nullptr;
+        if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &list) != 0) return -1;
+
+        int fd = -1;
+        for (addrinfo* ai = list; ai != nullptr; ai = ai->ai_next) {
+            fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd < 0) continue;
+            int one = 1;
+            if (server) {
+                setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+                if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 64) == 0) break;
+            }
+            else {
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+            }
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(list);
+        return fd;
+    }
+
+    // Send exactly 'size' bytes, returns false if the connection failed
+    static bool sendAll(int fd, const void* data, size_t size) {
+        const char* bytes = static_cast<const char*>(data);
+        while (size > 0) {
+            ssize_t sent = send(fd, bytes, size, 0);
+            if (sent <= 0) return false;
+            bytes += sent;
+            size -= static_cast<size_t>(sent);
+        }
+        return true;
+    }
+
+    // Receive exactly 'size' bytes, returns false if the connection failed or was closed first
+    static bool recvAll(int fd, void* data, size_t size) {
+        char* bytes = static_cast<char*>(data);
+        while (size > 0) {
+            ssize_t received = recv(fd, bytes, size, 0);
+            if (received <= 0) return false;
+            bytes += received;
+            size -= static_cast<size_t>(received);
+        }
+        return true;
+    }
+#endif
+};
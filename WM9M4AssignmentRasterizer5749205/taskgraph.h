@@ -0,0 +1,189 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <immintrin.h>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "Multithread.h"
+
+// Dependency graph of tasks executed on the thread pool
+// A task is released to the pool the moment its last dependency finishes, so independent chains of work
+// overlap instead of every stage waiting on a global barrier. The graph is described once per frame with
+// add() and precede(), then run(); the node and edge storage is kept between frames, so rebuilding it every
+// frame does not allocate once the largest frame has been seen.
+class TaskGraph {
+public:
+    using TaskId = unsigned int;
+
+private:
+    struct Node {
+        Job job;                           // Task body (always stored inline, see add)
+        bool mainThread = false;           // Only the thread calling run() may execute the task
+        unsigned int dependencies = 0;     // Number of tasks that must finish first
+        unsigned int firstSuccessor = 0;   // First entry in 'successors'
+        unsigned int successorCount = 0;   // Tasks waiting on this one
+    };
+
+    std::vector<Node> nodes;
+    std::vector<std::pair<TaskId, TaskId>> edges;  // (before, after) pairs as declared
+    std::vector<TaskId> successors;                // Edges grouped by their 'before' task
+    std::vector<TaskId> mainNodes;                 // Tasks pinned to the thread calling run()
+    std::unique_ptr<std::atomic<int>[]> remaining; // Unfinished dependencies of each task (-1 once started)
+    size_t remainingCapacity = 0;
+    alignas(64) std::atomic<size_t> unfinished = 0;  // Tasks of the current run that have not finished yet
+    Generation events;                               // Frame barrier - advanced when the run completes or a main thread task is released
+    std::atomic<bool> released = true;               // Set after the last task advanced 'events', nothing touches the graph from then on
+    ThreadPool* pool = nullptr;                      // Pool of the current run
+
+    // Hand a task whose dependencies are all done to the pool (main thread tasks are picked up by run)
+    void release(TaskId id) {
+        if (nodes[id].mainThread) {
+            events.advance();
+            return;
+        }
+        TaskGraph* graph = this;
+        pool->submit([graph, id]() { graph->execute(id); });
+    }
+
+    // Run a task, release the successors it was the last dependency of, then retire it
+    void execute(TaskId id) {
+        Node& node = nodes[id];
+        node.job();
+        for (unsigned int i = node.firstSuccessor; i < node.firstSuccessor + node.successorCount; i++) {
+            TaskId next = successors[i];
+            if (remaining[next].fetch_sub(1, std::memory_order_acq_rel) == 1) release(next);
+        }
+        if (unfinished.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            events.advance();
+            released.store(true, std::memory_order_release);
+        }
+    }
+
+public:
+    TaskGraph() = default;
+    TaskGraph(const TaskGraph&) = delete;
+    TaskGraph& operator=(const TaskGraph&) = delete;
+
+    // A run must be joined before the graph goes away
+    ~TaskGraph() {
+        if (pool != nullptr) join();
+    }
+
+    // Remove every task and dependency (keeps the storage for the next frame)
+    void clear() {
+        nodes.clear();
+        edges.clear();
+        mainNodes.clear();
+    }
+
+    // Add a task
+    // The callable is copied into the node and must fit inline in a Job, so adding tasks never allocates;
+    // capture pointers and indices rather than objects.
+    // Input Variables:
+    // - fn: Callable taking no arguments
+    // - mainThread: Run the task on the thread calling run() (e.g. presenting to the window)
+    // Returns the id used to declare dependencies
+    template <typename F>
+    TaskId add(F&& fn, bool mainThread = false) {
+        static_assert(Job::storedInline<F>, "Task graph callables must be stored inline in a Job");
+        TaskId id = static_cast<TaskId>(nodes.size());
+        nodes.emplace_back();
+        nodes.back().job = Job(std::forward<F>(fn));
+        nodes.back().mainThread = mainThread;
+        if (mainThread) mainNodes.push_back(id);
+        return id;
+    }
+
+    // Declare that 'after' may only start once 'before' has finished (the graph must stay acyclic)
+    void precede(TaskId before, TaskId after) {
+        edges.emplace_back(before, after);
+    }
+
+    // Returns the number of tasks in the graph
+    size_t size() const { return nodes.size(); }
+
+    // Execute every task and return once all of them have finished.
+    // The calling thread runs the main thread tasks and otherwise helps the pool with queued jobs.
+    // Input Variables:
+    // - threads: Pool to run the tasks on
+    void run(ThreadPool& threads) {
+        launch(threads);
+        join();
+    }
+
+    // Start executing the tasks on the pool and return straight away, so the calling thread can get on with
+    // other work while the graph runs; join() must be called before the graph is changed or run again.
+    // Main thread tasks only run once join() is called.
+    // Input Variables:
+    // - threads: Pool to run the tasks on
+    void launch(ThreadPool& threads) {
+        pool = &threads;
+        if (nodes.empty()) {
+            unfinished.store(0, std::memory_order_release);
+            return;
+        }
+        released.store(false, std::memory_order_relaxed);
+
+        // Group the edges by their first task (counting sort keeps the declaration order)
+        for (Node& node : nodes) {
+            node.dependencies = 0;
+            node.successorCount = 0;
+        }
+        for (const auto& [before, after] : edges) {
+            nodes[before].successorCount++;
+            nodes[after].dependencies++;
+        }
+        unsigned int offset = 0;
+        for (Node& node : nodes) {
+            node.firstSuccessor = offset;
+            offset += node.successorCount;
+            node.successorCount = 0;
+        }
+        successors.resize(edges.size());
+        for (const auto& [before, after] : edges) {
+            Node& node = nodes[before];
+            successors[node.firstSuccessor + node.successorCount++] = after;
+        }
+
+        if (remainingCapacity < nodes.size()) {
+            remainingCapacity = nodes.size();
+            remaining.reset(new std::atomic<int>[remainingCapacity]);
+        }
+        for (TaskId id = 0; id < nodes.size(); id++)
+            remaining[id].store(static_cast<int>(nodes[id].dependencies), std::memory_order_relaxed);
+        unfinished.store(nodes.size(), std::memory_order_release);
+
+        // Start the roots
+        for (TaskId id = 0; id < nodes.size(); id++)
+            if (nodes[id].dependencies == 0) release(id);
+    }
+
+    // Wait for the tasks started by launch() to finish
+    // The calling thread runs the main thread tasks and otherwise helps the pool with queued jobs.
+    void join() {
+        // Frame barrier - read the generation, check for completion and main thread tasks, then help the pool
+        // or spin and park until the generation moves on
+        while (true) {
+            std::uint32_t seen = events.current();
+            if (unfinished.load(std::memory_order_acquire) == 0) {
+                // The last task is advancing 'events', wait for it to leave (only waits for this graph's tasks)
+                while (!released.load(std::memory_order_acquire))
+                    _mm_pause();
+                break;
+            }
+
+            bool ran = false;
+            for (TaskId id : mainNodes) {
+                if (remaining[id].load(std::memory_order_acquire) != 0) continue;
+                remaining[id].store(-1, std::memory_order_relaxed);
+                execute(id);
+                ran = true;
+            }
+            if (!ran && !pool->runOne()) events.wait(seen, pool->spinTime());
+        }
+    }
+};
@@ -0,0 +1,195 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "colour.h"
+#ifdef _WIN32
+    #include "GamesEngineeringBase.h"  // Images loaded from files (the library is Windows only)
+#endif
+#include "OptimisationProfiles.h"
+
+// Texture with a precomputed mip chain, sampled with bilinear filtering (texture coordinates wrap around).
+// Texels are packed 0x00RRGGBB words. Every level is padded to a multiple of 4 texels in both directions and
+// stored in 4x4 blocks of one cache line each, so the 2x2 footprint of a bilinear sample and the texels of
+// neighbouring pixels share cache lines whichever direction the texture is walked in.
+class Texture {
+    struct alignas(64) Block { std::uint32_t texels[16]; };  // 4x4 texels, one cache line
+
+    // One level of the mip chain
+    struct Level {
+        unsigned int width, height;  // Size in texels
+        unsigned int blocksX;        // Blocks per row of blocks (the padded width is blocksX * 4)
+        size_t offset;               // First texel of the level in the storage
+    };
+
+    std::vector<Block> storage;  // Every level, level 0 first
+    std::vector<Level> levels;
+
+    const std::uint32_t* texels() const { return reinterpret_cast<const std::uint32_t*>(storage.data()); }
+    std::uint32_t* texels() { return reinterpret_cast<std::uint32_t*>(storage.data()); }
+
+    // Returns the position of texel (x, y) of a level in the storage
+    static size_t index(const Level& level, unsigned int x, unsigned int y) {
+        #if OPT_TEXTURE_BLOCKED_LAYOUT
+            // Optimisation - 4x4 blocked layout, a bilinear footprint touches one to four cache lines
+            return level.offset + ((static_cast<size_t>(y >> 2) * level.blocksX + (x >> 2)) << 4) + ((y & 3) << 2) + (x & 3);
+        #else
+            // Base Rasterizer - row by row, vertical neighbours are a whole row apart
+            return level.offset + static_cast<size_t>(y) * (level.blocksX << 2) + x;
+        #endif
+    }
+
+    // Returns a texel coordinate wrapped into [0, size)
+    static unsigned int wrap(int x, unsigned int size) {
+        int s = static_cast<int>(size);
+        x %= s;
+        return static_cast<unsigned int>((x < 0) ? x + s : x);
+    }
+
+    static std::uint32_t pack(unsigned int r, unsigned int g, unsigned int b) { return (r << 16) | (g << 8) | b; }
+
+public:
+    // Build a texture and its mip chain from pixels (RGB or RGBA, no pixels give a white texel)
+    // Input Variables:
+    // - data: Pixels, row by row (may be null)
+    // - imageWidth, imageHeight: Size of the image
+    // - channels: Bytes per pixel
+    Texture(const unsigned char* data, unsigned int imageWidth, unsigned int imageHeight, unsigned int channels) {
+        bool valid = data && channels >= 3;
+        unsigned int width = valid ? std::max(imageWidth, 1u) : 1u;
+        unsigned int height = valid ? std::max(imageHeight, 1u) : 1u;
+
+        // Level sizes, halving down to 1x1
+        size_t blocks = 0;
+        for (unsigned int w = width, h = height;; w = std::max(w / 2, 1u), h = std::max(h / 2, 1u)) {
+            Level level{ w, h, (w + 3) / 4, blocks * 16 };
+            levels.push_back(level);
+            blocks += static_cast<size_t>(level.blocksX) * ((h + 3) / 4);
+            #if !OPT_TEXTURE_MIPMAPS
+                break;  // Base Rasterizer - level 0 only
+            #endif
+            if (w == 1 && h == 1) break;
+        }
+        storage.assign(blocks, Block{});
+        std::uint32_t* out = texels();
+
+        // Level 0 from the image
+        const Level& top = levels[0];
+        for (unsigned int y = 0; y < top.height; y++) {
+            for (unsigned int x = 0; x < top.width; x++) {
+                if (!valid) {
+                    out[index(top, x, y)] = pack(255, 255, 255);
+                    continue;
+                }
+                const unsigned char* pixel = &data[((static_cast<size_t>(y) * imageWidth) + x) * channels];
+                out[index(top, x, y)] = pack(pixel[0], pixel[1], pixel[2]);
+            }
+        }
+
+        // Every other level is the 2x2 box filter of the one above (clamped at odd edges)
+        for (size_t l = 1; l < levels.size(); l++) {
+            const Level& above = levels[l - 1];
+            const Level& level = levels[l];
+            for (unsigned int y = 0; y < level.height; y++) {
+                unsigned int y0 = std::min(2 * y, above.height - 1), y1 = std::min(2 * y + 1, above.height - 1);
+                for (unsigned int x = 0; x < level.width; x++) {
+                    unsigned int x0 = std::min(2 * x, above.width - 1), x1 = std::min(2 * x + 1, above.width - 1);
+                    std::uint32_t c[4] = { out[index(above, x0, y0)], out[index(above, x1, y0)],
+                                           out[index(above, x0, y1)], out[index(above, x1, y1)] };
+                    unsigned int r = 2, g = 2, b = 2;  // Round to nearest
+                    for (std::uint32_t t : c) {
+                        r += (t >> 16) & 0xff;
+                        g += (t >> 8) & 0xff;
+                        b += t & 0xff;
+                    }
+                    out[index(level, x, y)] = pack(r >> 2, g >> 2, b >> 2);
+                }
+            }
+        }
+    }
+
+#ifdef _WIN32
+    // Build a texture and its mip chain from an image (RGB or RGBA, an empty image gives a white texel)
+    // Input Variables:
+    // - image: Source image
+    explicit Texture(const GamesEngineeringBase::Image& image) : Texture(image.data, image.width, image.height, image.channels) {}
+#endif
+
+    // Generate a checkerboard texture
+    // Input Variables:
+    // - size: Width and height in texels
+    // - squares: Squares along each side
+    // - a, b: Colours of the squares
+    // Returns the texture
+    static Texture checkerboard(unsigned int size, unsigned int squares, const colour& a, const colour& b) {
+        unsigned char ca[3], cb[3];
+        a.toRGB(ca[0], ca[1], ca[2]);
+        b.toRGB(cb[0], cb[1], cb[2]);
+
+        std::vector<unsigned char> image(static_cast<size_t>(size) * size * 3);
+        unsigned int square = std::max(size / std::max(squares, 1u), 1u);
+        for (unsigned int y = 0; y < size; y++) {
+            for (unsigned int x = 0; x < size; x++) {
+                const unsigned char* c = (((x / square) + (y / square)) % 2 == 0) ? ca : cb;
+                std::copy(c, c + 3, &image[(static_cast<size_t>(y) * size + x) * 3]);
+            }
+        }
+        return Texture(image.data(), size, size, 3);
+    }
+
+    // Returns the number of levels in the mip chain
+    unsigned int levelCount() const { return static_cast<unsigned int>(levels.size()); }
+
+    // Pick the mip level whose texels are about one pixel apart on screen
+    // Input Variables:
+    // - dudx, dvdx: Change of the texture coordinates from one pixel to the next along x
+    // - dudy, dvdy: Change of the texture coordinates from one pixel to the next along y
+    // Returns the level to sample
+    unsigned int selectLevel(float dudx, float dvdx, float dudy, float dvdy) const {
+        #if OPT_TEXTURE_MIPMAPS
+            // Optimisation - Minified textures are sampled from a smaller level, keeping the texels of
+            // neighbouring pixels close together in memory (and the result free of aliasing)
+            float w = static_cast<float>(levels[0].width), h = static_cast<float>(levels[0].height);
+            float x = (dudx * w) * (dudx * w) + (dvdx * h) * (dvdx * h);
+            float y = (dudy * w) * (dudy * w) + (dvdy * h) * (dvdy * h);
+            float rhoSq = std::max(x, y);  // Squared texels per pixel along the longer axis
+            if (!(rhoSq > 1.f)) return 0;
+            float lod = 0.5f * std::log2(rhoSq);
+            return std::min(static_cast<unsigned int>(lod + 0.5f), levelCount() - 1);
+        #else
+            return 0;
+        #endif
+    }
+
+    // Bilinear sample of a level
+    // Input Variables:
+    // - level: Mip level (see selectLevel)
+    // - u, v: Texture coordinates (wrapped)
+    // Returns the filtered colour
+    colour sample(unsigned int level, float u, float v) const {
+        const Level& l = levels[level];
+        float x = u * static_cast<float>(l.width) - 0.5f;
+        float y = v * static_cast<float>(l.height) - 0.5f;
+        float fx = std::floor(x), fy = std::floor(y);
+        float tx = x - fx, ty = y - fy;
+
+        unsigned int x0 = wrap(static_cast<int>(fx), l.width), y0 = wrap(static_cast<int>(fy), l.height);
+        unsigned int x1 = (x0 + 1 == l.width) ? 0 : x0 + 1, y1 = (y0 + 1 == l.height) ? 0 : y0 + 1;
+        const std::uint32_t* t = texels();
+        std::uint32_t c00 = t[index(l, x0, y0)], c10 = t[index(l, x1, y0)];
+        std::uint32_t c01 = t[index(l, x0, y1)], c11 = t[index(l, x1, y1)];
+
+        // Weights of the four texels, scaled to [0, 1] colours
+        constexpr float inv255 = 1.f / 255.f;
+        float w00 = (1.f - tx) * (1.f - ty) * inv255, w10 = tx * (1.f - ty) * inv255;
+        float w01 = (1.f - tx) * ty * inv255, w11 = tx * ty * inv255;
+        auto channel = [&](unsigned int shift) {
+            return static_cast<float>((c00 >> shift) & 0xff) * w00 + static_cast<float>((c10 >> shift) & 0xff) * w10 +
+                   static_cast<float>((c01 >> shift) & 0xff) * w01 + static_cast<float>((c11 >> shift) & 0xff) * w11;
+        };
+        return colour(channel(16), channel(8), channel(0));
+    }
+};
@@ -0,0 +1,236 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+    #include <sched.h>
+#elif defined(_WIN32)
+    #ifndef NOMINMAX
+        #define NOMINMAX
+    #endif
+    #include <Windows.h>
+#endif
+
+// Where a worker thread runs and how fast that core is compared to the fastest one
+struct WorkerPlacement {
+    int cpu = -1;           // Logical CPU to pin the worker to (-1 leaves it to the OS)
+    float capacity = 1.f;   // Relative performance of the core, 1 for the fastest cores
+};
+
+// Logical CPUs of the machine, as seen by this process
+// On Linux the topology is read from sysfs: the CPUs the process may run on, which logical CPUs share a core
+// (SMT siblings), and each core's performance from cpu_capacity (hybrid P-core/E-core and big.LITTLE parts)
+// or, if the kernel does not expose that, its maximum cpufreq frequency. On Windows it comes from
+// GetLogicalProcessorInformationEx: the hardware threads of every core, and the core's efficiency class
+// (P-cores, E-cores and low power E-cores of hybrid parts), mapped to an estimated capacity.
+// Elsewhere the cores are assumed to be identical with two hardware threads each, so the default worker
+// count does not oversubscribe SMT siblings, and nothing is pinned.
+class CpuTopology {
+public:
+    struct Cpu {
+        int id = -1;            // Logical CPU number (-1 when unknown)
+        int core = 0;           // Physical core (package * 65536 + core_id)
+        bool primary = true;    // First hardware thread of its core
+        float capacity = 1.f;   // Performance relative to the fastest core
+    };
+
+    std::vector<Cpu> cpus;
+
+private:
+#ifdef __linux__
+    // Read the first integer of a sysfs file, 'fallback' if it does not exist
+    static long readNumber(const std::string& path, long fallback) {
+        FILE* file = std::fopen(path.c_str(), "r");
+        if (file == nullptr) return fallback;
+        long value = fallback;
+        if (std::fscanf(file, "%ld", &value) != 1) value = fallback;
+        std::fclose(file);
+        return value;
+    }
+
+    // Parse a CPU list such as "0-3,8,10-11"
+    static std::vector<int> readList(const std::string& path) {
+        std::vector<int> ids;
+        FILE* file = std::fopen(path.c_str(), "r");
+        if (file == nullptr) return ids;
+        int first, last;
+        while (std::fscanf(file, "%d", &first) == 1) {
+            last = first;
+            int c = std::fgetc(file);
+            if (c == '-') {
+                if (std::fscanf(file, "%d", &last) != 1) break;
+                c = std::fgetc(file);
+            }
+            for (int id = first; id <= last; id++) ids.push_back(id);
+            if (c != ',') break;
+        }
+        std::fclose(file);
+        return ids;
+    }
+#endif
+
+public:
+    // Discover the topology of the machine
+    static CpuTopology detect() {
+        CpuTopology topology;
+
+        #ifdef __linux__
+            const std::string root = "/sys/devices/system/cpu/";
+            cpu_set_t allowed;
+            bool haveMask = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+
+            float fastest = 0.f;
+            for (int id : readList(root + "online")) {
+                if (haveMask && !CPU_ISSET(id, &allowed)) continue;
+                std::string dir = root + "cpu" + std::to_string(id) + "/";
+
+                Cpu cpu;
+                cpu.id = id;
+                cpu.core = static_cast<int>(readNumber(dir + "topology/physical_package_id", 0) * 65536 + readNumber(dir + "topology/core_id", id));
+                std::vector<int> siblings = readList(dir + "topology/thread_siblings_list");
+                cpu.primary = siblings.empty() || siblings.front() == id;
+
+                long capacity = readNumber(dir + "cpu_capacity", -1);
+                if (capacity <= 0) capacity = readNumber(dir + "cpufreq/cpuinfo_max_freq", 1);
+                cpu.capacity = static_cast<float>(capacity);
+                fastest = std::max(fastest, cpu.capacity);
+                topology.cpus.push_back(cpu);
+            }
+            for (Cpu& cpu : topology.cpus)
+                cpu.capacity /= fastest;
+        #elif defined(_WIN32)
+            DWORD length = 0;
+            GetLogicalProcessorInformationEx(RelationProcessorCore, nullptr, &length);
+            std::vector<unsigned char> buffer(length);
+            if (length > 0 && GetLogicalProcessorInformationEx(RelationProcessorCore,
+                    reinterpret_cast<SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*>(buffer.data()), &length)) {
+                // The process affinity mask only covers the process's group (group 0 below 64 logical CPUs)
+                DWORD_PTR allowed = 0, system = 0;
+                bool haveMask = GetProcessAffinityMask(GetCurrentProcess(), &allowed, &system) != 0;
+
+                int coreIndex = 0;
+                BYTE fastest = 0;
+                for (DWORD offset = 0; offset < length; coreIndex++) {
+                    const auto* entry = reinterpret_cast<const SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*>(buffer.data() + offset);
+                    offset += entry->Size;
+                    if (entry->Relationship != RelationProcessorCore) continue;
+                    const PROCESSOR_RELATIONSHIP& core = entry->Processor;
+                    fastest = std::max(fastest, core.EfficiencyClass);
+
+                    bool primary = true;  // The first allowed hardware thread of the core
+                    for (WORD g = 0; g < core.GroupCount; g++) {
+                        const GROUP_AFFINITY& group = core.GroupMask[g];
+                        for (int bit = 0; bit < 64; bit++) {
+                            if (!(group.Mask & (static_cast<KAFFINITY>(1) << bit))) continue;
+                            if (haveMask && group.Group == 0 && !(allowed & (static_cast<DWORD_PTR>(1) << bit))) continue;
+                            Cpu cpu;
+                            cpu.id = group.Group * 64 + bit;
+                            cpu.core = coreIndex;
+                            cpu.primary = primary;
+                            cpu.capacity = static_cast<float>(core.EfficiencyClass);  // Higher classes are faster
+                            primary = false;
+                            topology.cpus.push_back(cpu);
+                        }
+                    }
+                }
+
+                // Windows only ranks the cores, so estimate the capacity from the class
+                // (e.g. low power E-core 1/3, E-core 2/3 and P-core 1 for three classes)
+                for (Cpu& cpu : topology.cpus)
+                    cpu.capacity = (cpu.capacity + 1.f) / (static_cast<float>(fastest) + 1.f);
+            }
+        #endif
+
+        if (topology.cpus.empty()) {
+            // No topology information - identical cores, unpinned. Assume two hardware threads per core, so
+            // the default worker count stays on physical cores on SMT machines (and is halved without SMT)
+            unsigned int count = std::max(1u, std::thread::hardware_concurrency());
+            for (unsigned int i = 0; i < count; i++) {
+                Cpu cpu;
+                cpu.core = static_cast<int>(i / 2);
+                cpu.primary = (i % 2 == 0);
+                topology.cpus.push_back(cpu);
+            }
+        }
+        return topology;
+    }
+
+    // Returns the number of physical cores
+    size_t physicalCores() const {
+        return std::count_if(cpus.begin(), cpus.end(), [](const Cpu& cpu) { return cpu.primary; });
+    }
+
+    // Returns the default worker count: one per physical core, minus the core the main thread renders on
+    size_t defaultWorkers() const {
+        return std::max<size_t>(1, physicalCores() - 1);
+    }
+
+    // Returns the CPUs in the order threads should be placed on them: the first hardware thread of each core
+    // from the fastest cores down, then the SMT siblings in the same order
+    std::vector<Cpu> placementOrder() const {
+        std::vector<Cpu> order = cpus;
+        std::stable_sort(order.begin(), order.end(), [](const Cpu& a, const Cpu& b) {
+            if (a.primary != b.primary) return a.primary;
+            return a.capacity > b.capacity;
+        });
+        return order;
+    }
+
+    // Returns where to run 'count' workers; the first (fastest) CPU is left to the main thread.
+    // Workers are only pinned if each one gets a CPU of its own.
+    // Input Variables:
+    // - count: Number of worker threads
+    std::vector<WorkerPlacement> workerPlacement(size_t count) const {
+        std::vector<Cpu> order = placementOrder();
+        bool pin = count < order.size();  // Oversubscribed - pinning would stack threads on the same CPU
+        std::vector<WorkerPlacement> placement(count);
+        for (size_t i = 0; i < count; i++) {
+            const Cpu& cpu = order[(i + 1) % order.size()];
+            placement[i].cpu = pin ? cpu.id : -1;
+            placement[i].capacity = cpu.capacity;
+        }
+        return placement;
+    }
+
+    // Returns the worker count from the RASTER_THREADS environment variable, or the topology default
+    size_t configuredWorkers() const {
+        int requested = 0;
+        #ifdef _WIN32
+            char* value = nullptr;
+            size_t length = 0;
+            if (_dupenv_s(&value, &length, "RASTER_THREADS") == 0 && value != nullptr) {
+                requested = std::atoi(value);
+                std::free(value);
+            }
+        #else
+            if (const char* value = std::getenv("RASTER_THREADS")) requested = std::atoi(value);
+        #endif
+        return (requested > 0) ? static_cast<size_t>(requested) : defaultWorkers();
+    }
+
+    // Pin the calling thread to a logical CPU (no-op for -1 or without affinity support)
+    // Returns true if the thread was pinned
+    static bool pinCurrentThread(int cpu) {
+        #ifdef __linux__
+            if (cpu < 0) return false;
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            return sched_setaffinity(0, sizeof(set), &set) == 0;
+        #elif defined(_WIN32)
+            if (cpu < 0) return false;
+            GROUP_AFFINITY affinity = {};
+            affinity.Group = static_cast<WORD>(cpu / 64);
+            affinity.Mask = static_cast<KAFFINITY>(1) << (cpu % 64);
+            return SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr) != 0;
+        #else
+            (void)cpu;
+            return false;
+        #endif
+    }
+};
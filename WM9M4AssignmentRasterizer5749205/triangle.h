@@ -1,14 +1,22 @@
 #pragma once
 
 #include <algorithm>
+#include <bit>
+#include <climits>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <immintrin.h>
 #include <iostream>
 
 #include "colour.h"
 #include "light.h"
+#include "lighttiles.h"
 #include "mesh.h"
 #include "OptimisationProfiles.h"
 #include "renderer.h"
+#include "texture.h"
+#include "trisetup.h"
 
 // Simple support class for a 2D vector
 class vec2D {
@@ -120,7 +128,7 @@ public:
     // - a1, a2, a3: Values to interpolate
     // Returns the interpolated value
     template <typename T>
-    T interpolate(float alpha, float beta, float gamma, T a1, T a2, T a3) {
+    static T interpolate(float alpha, float beta, float gamma, T a1, T a2, T a3) {
         return (a1 * alpha) + (a2 * beta) + (a3 * gamma);
     }
 
@@ -129,11 +137,13 @@ public:
     // - renderer: Renderer object for drawing
     // - L: Light object for shading calculations
     // - ka, kd: Ambient and diffuse lighting coefficients
-    void draw(Renderer& renderer, Light& L, float ka, float kd) {
+    // - shading: Per pixel lighting, or per vertex (the vertices already hold their lit colour)
+    // - texture: Texture modulating the colour (none if null)
+    void draw(Renderer& renderer, Light& L, float ka, float kd, ShadingMode shading = ShadingMode::Phong, const Texture* texture = nullptr) {
         vec2D minV, maxV;
 
         // Get the screen-space bounds of the triangle
-        getBoundsWindow(renderer.canvas, minV, maxV);
+        getBoundsWindow(renderer, minV, maxV);
 
         // Skip very small triangles
         if (area < 1.f) return;
@@ -146,6 +156,17 @@ public:
             area = 1.f / area;
         #endif
 
+        #if OPT_TRIANGLE_FLAT_FAST_PATH
+            // Optimisation - Shade a flat triangle once, its pixels only store the colour
+            bool flat = !texture && isFlat(v[0], v[1], v[2], L, shading, static_cast<int>(minV.x), static_cast<int>(minV.y),
+                                           static_cast<int>(ceil(maxV.x)), static_cast<int>(ceil(maxV.y)));
+            unsigned char flatR = 0, flatG = 0, flatB = 0;
+            if (flat) flatColour(v[0], L, ka, kd, shading).toRGB(flatR, flatG, flatB);
+        #endif
+
+        // Mip level of the whole triangle
+        unsigned int level = texture ? textureLevel(*texture, v[0], v[1], v[2]) : 0;
+
         // Iterate over the bounding box and check each pixel
         for (int y = (int)(minV.y); y < (int)ceil(maxV.y); y++) {
             for (int x = (int)(minV.x); x < (int)ceil(maxV.x); x++) {                
@@ -170,6 +191,24 @@ public:
                         // Update the buffer
                         renderer.zbuffer(x, y) = depth;
 
+                        #if OPT_TRIANGLE_FLAT_FAST_PATH
+                            if (flat) {
+                                renderer.draw(x, y, flatR, flatG, flatB);
+                                continue;
+                            }
+                        #endif
+
+                        if (shading == ShadingMode::Gouraud) {
+                            // Optimisation - Gouraud shading; the vertices were lit once each, only interpolate the colour
+                            colour a = interpolate(beta, gamma, alpha, v[0].rgb, v[1].rgb, v[2].rgb);
+                            if (texture) a = a * texture->sample(level, interpolate(beta, gamma, alpha, v[0].u, v[1].u, v[2].u),
+                                                                 interpolate(beta, gamma, alpha, v[0].v, v[1].v, v[2].v));
+                            unsigned char r, g, b;
+                            a.toRGB(r, g, b);
+                            renderer.draw(x, y, r, g, b);
+                            continue;
+                        }
+
                         #if OPT_TRIANGLE_EARLY_DEPTH_CHECK
                             // Interpolate color
                             colour c = interpolate(beta, gamma, alpha, v[0].rgb, v[1].rgb, v[2].rgb);
@@ -178,6 +217,8 @@ public:
                             vec4 normal = interpolate(beta, gamma, alpha, v[0].normal, v[1].normal, v[2].normal);
                             normal.normalise();
                         #endif
+                        if (texture) c = c * texture->sample(level, interpolate(beta, gamma, alpha, v[0].u, v[1].u, v[2].u),
+                                                             interpolate(beta, gamma, alpha, v[0].v, v[1].v, v[2].v));
 
                         // typical shader begin
                         #if !OPT_TRIANGLE_EARLY_LIGHT_NORM
@@ -185,17 +226,392 @@ public:
                         #endif
                         float dot = std::max(vec4::dot(L.omega_i, normal), 0.f);
                         colour a = (c * kd) * (L.L * dot) + (L.ambient * ka);  // using kd instead of ka for ambient
+                        if (L.tiles) {
+                            // Additional lights reaching the pixel's tile
+                            a = a + L.tiles->shade(x, y, depth, normal, c * kd);
+                            a.clampColour();
+                        }
 
                         // typical shader end
                         unsigned char r, g, b;
                         a.toRGB(r, g, b);
-                        renderer.canvas.draw(x, y, r, g, b);
+                        renderer.draw(x, y, r, g, b);
                     }
                 }
             }
         }
     }
 
+    // Final colour of a flat triangle, in the layouts the targets store it in
+    struct FlatColour {
+        unsigned char r, g, b;
+        std::uint32_t packed;      // 0x00RRGGBB (sort-last layers)
+        unsigned char span[24];    // 8 pixels of RGB (canvas rows)
+
+        FlatColour(unsigned char _r, unsigned char _g, unsigned char _b) : r(_r), g(_g), b(_b) {
+            packed = (static_cast<std::uint32_t>(r) << 16) | (static_cast<std::uint32_t>(g) << 8) | b;
+            for (unsigned int i = 0; i < 8; i++) {
+                span[3 * i] = r;
+                span[3 * i + 1] = g;
+                span[3 * i + 2] = b;
+            }
+        }
+
+        // Store the colour in the pixels of an 8 pixel, 3 bytes per pixel run selected by a lane mask
+        void fill(unsigned char* pixels, int mask) const {
+            if (mask == 0xff) {
+                std::memcpy(pixels, span, sizeof(span));
+                return;
+            }
+            for (; mask != 0; mask &= mask - 1) {
+                unsigned char* pixel = pixels + 3 * std::countr_zero(static_cast<unsigned int>(mask));
+                pixel[0] = r;
+                pixel[1] = g;
+                pixel[2] = b;
+            }
+        }
+    };
+
+    // Expand an 8 bit lane mask to a vector mask (all bits of the selected lanes set)
+    static __m256i laneMask(int mask) {
+        const __m256i bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+        return _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(mask), bits), bits);
+    }
+
+    // Depth test and write against the renderer's Z-buffer and canvas (one thread per pixel at a time)
+    struct CanvasTarget {
+        Renderer& renderer;
+        bool nearer(int x, int y, float depth) { return renderer.zbuffer(x, y) > depth; }
+        void write(int x, int y, float depth, unsigned char r, unsigned char g, unsigned char b) {
+            renderer.zbuffer(x, y) = depth;
+            renderer.draw(x, y, r, g, b);
+        }
+        float* depthRow(int y) { return &renderer.zbuffer(0, y); }
+        void fill(int x, int y, int mask, const FlatColour& c) {
+            c.fill(&renderer.getBackBuffer()[((static_cast<size_t>(y) * renderer.getWidth()) + x) * 3], mask);
+        }
+    };
+
+    // Lock-free depth test and write of a packed depth + colour buffer (any number of threads per pixel)
+    struct AtomicTarget {
+        AtomicZbuffer& buffer;
+        bool nearer(int x, int y, float depth) { return buffer.depth(x, y) > depth; }  // Early out, the write re-tests
+        void write(int x, int y, float depth, unsigned char r, unsigned char g, unsigned char b) {
+            buffer.testAndWrite(x, y, depth, r, g, b);
+        }
+    };
+
+    // Private depth + colour layer of the drawing thread (no other thread touches it until the merge)
+    struct LayerTarget {
+        DepthLayer& layer;
+        bool nearer(int x, int y, float depth) { return layer.depth(x, y) > depth; }
+        void write(int x, int y, float depth, unsigned char r, unsigned char g, unsigned char b) {
+            layer.depth(x, y) = depth;
+            layer.colour(x, y) = (static_cast<std::uint32_t>(r) << 16) | (static_cast<std::uint32_t>(g) << 8) | b;
+        }
+        float* depthRow(int y) { return layer.depthRow(y); }
+        void fill(int x, int y, int mask, const FlatColour& c) {
+            _mm256_maskstore_epi32(reinterpret_cast<int*>(layer.colourRow(y) + x), laneMask(mask), _mm256_set1_epi32(static_cast<int>(c.packed)));
+        }
+    };
+
+    // Depth test and write against an offscreen render target (one thread per pixel at a time)
+    struct ViewTarget {
+        RenderTarget& target;
+        bool nearer(int x, int y, float depth) { return target.zbuffer(x, y) > depth; }
+        void write(int x, int y, float depth, unsigned char r, unsigned char g, unsigned char b) {
+            target.zbuffer(x, y) = depth;
+            target.draw(x, y, r, g, b);
+        }
+        float* depthRow(int y) { return &target.zbuffer(0, y); }
+        void fill(int x, int y, int mask, const FlatColour& c) {
+            c.fill(&target.getBackBuffer()[((static_cast<size_t>(y) * target.getWidth()) + x) * 3], mask);
+        }
+    };
+
+    // Pixel loop of a triangle from the batched setup stage, writing through a depth/colour target
+    // Gouraud: the vertices hold their lit colour, so a pixel only interpolates it (no normal, sqrt or dot product)
+    // Textured: the colour is modulated by a bilinear sample of one mip level of the texture
+    template <bool Gouraud, bool Textured, typename Target>
+    static void rasterSetupShaded(Target& target, Light& L, float ka, float kd, const Texture* texture, unsigned int level,
+                                  const Vertex* vertices, const SetupTriangle& s, int clipMinX, int clipMinY, int clipMaxX, int clipMaxY) {
+        const Vertex& v0 = vertices[s.v[0]];
+        const Vertex& v1 = vertices[s.v[1]];
+        const Vertex& v2 = vertices[s.v[2]];
+
+        int minX = std::max(s.minX, clipMinX), maxX = std::min(s.maxX, clipMaxX);
+        int minY = std::max(s.minY, clipMinY), maxY = std::min(s.maxY, clipMaxY);
+        for (int y = minY; y < maxY; y++) {
+            float fy = static_cast<float>(y);
+            float alphaRow = s.edge[0][1] * fy + s.edge[0][2];
+            float betaRow = s.edge[1][1] * fy + s.edge[1][2];
+            float gammaRow = s.edge[2][1] * fy + s.edge[2][2];
+
+            for (int x = minX; x < maxX; x++) {
+                float fx = static_cast<float>(x);
+
+                // Check if the pixel lies inside the triangle
+                float alpha = s.edge[0][0] * fx + alphaRow;
+                if (alpha < 0.f) continue;
+                float beta = s.edge[1][0] * fx + betaRow;
+                if (beta < 0.f) continue;
+                float gamma = s.edge[2][0] * fx + gammaRow;
+                if (gamma < 0.f) continue;
+
+                // Interpolate depth, then perform the Z-buffer test before any shading
+                float depth = interpolate(beta, gamma, alpha, v0.p[2], v1.p[2], v2.p[2]);
+                if (target.nearer(x, y, depth) && depth > 0.001f) {
+                    if constexpr (Gouraud) {
+                        // Optimisation - Gouraud shading; only the lit colour is interpolated
+                        colour a = interpolate(beta, gamma, alpha, v0.rgb, v1.rgb, v2.rgb);
+                        if constexpr (Textured)
+                            a = a * texture->sample(level, interpolate(beta, gamma, alpha, v0.u, v1.u, v2.u), interpolate(beta, gamma, alpha, v0.v, v1.v, v2.v));
+                        unsigned char r, g, b;
+                        a.toRGB(r, g, b);
+                        target.write(x, y, depth, r, g, b);
+                        continue;
+                    }
+
+                    // Interpolate color
+                    colour c = interpolate(beta, gamma, alpha, v0.rgb, v1.rgb, v2.rgb);
+                    c.clampColour();
+                    if constexpr (Textured)
+                        c = c * texture->sample(level, interpolate(beta, gamma, alpha, v0.u, v1.u, v2.u), interpolate(beta, gamma, alpha, v0.v, v1.v, v2.v));
+                    // Interpolate normals
+                    vec4 normal = interpolate(beta, gamma, alpha, v0.normal, v1.normal, v2.normal);
+                    normal.normalise();
+
+                    // typical shader begin
+                    #if !OPT_TRIANGLE_EARLY_LIGHT_NORM
+                        L.omega_i.normalise();
+                    #endif
+                    float dot = std::max(vec4::dot(L.omega_i, normal), 0.f);
+                    colour a = (c * kd) * (L.L * dot) + (L.ambient * ka);  // using kd instead of ka for ambient
+                    if (L.tiles) {
+                        // Optimisation - Tiled light culling; only the additional lights reaching the pixel's tile
+                        a = a + L.tiles->shade(x, y, depth, normal, c * kd);
+                        a.clampColour();
+                    }
+
+                    // typical shader end
+                    unsigned char r, g, b;
+                    a.toRGB(r, g, b);
+                    target.write(x, y, depth, r, g, b);
+                }
+            }
+        }
+    }
+
+    // Optimisation - Pixel loop of a flat triangle (one colour for every pixel), so a pixel is a depth test and a
+    // constant store. Targets exposing their depth rows are tested and written 8 pixels at a time with AVX2.
+    template <typename Target>
+    static void rasterSetupFlat(Target& target, const FlatColour& colour, const Vertex* vertices, const SetupTriangle& s,
+                                int clipMinX, int clipMinY, int clipMaxX, int clipMaxY) {
+        const float z0 = vertices[s.v[0]].p[2], z1 = vertices[s.v[1]].p[2], z2 = vertices[s.v[2]].p[2];
+
+        int minX = std::max(s.minX, clipMinX), maxX = std::min(s.maxX, clipMaxX);
+        int minY = std::max(s.minY, clipMinY), maxY = std::min(s.maxY, clipMaxY);
+
+        if constexpr (requires { target.depthRow(0); }) {
+            const __m256 lanes = _mm256_setr_ps(0.f, 1.f, 2.f, 3.f, 4.f, 5.f, 6.f, 7.f);
+            const __m256 zero = _mm256_setzero_ps();
+            const __m256 minDepth = _mm256_set1_ps(0.001f);
+            const __m256 A0 = _mm256_set1_ps(s.edge[0][0]), A1 = _mm256_set1_ps(s.edge[1][0]), A2 = _mm256_set1_ps(s.edge[2][0]);
+            const __m256 Z0 = _mm256_set1_ps(z0), Z1 = _mm256_set1_ps(z1), Z2 = _mm256_set1_ps(z2);
+
+            for (int y = minY; y < maxY; y++) {
+                float fy = static_cast<float>(y);
+                __m256 alphaRow = _mm256_set1_ps(s.edge[0][1] * fy + s.edge[0][2]);
+                __m256 betaRow = _mm256_set1_ps(s.edge[1][1] * fy + s.edge[1][2]);
+                __m256 gammaRow = _mm256_set1_ps(s.edge[2][1] * fy + s.edge[2][2]);
+                float* depths = target.depthRow(y);
+
+                for (int x = minX; x < maxX; x += 8) {
+                    __m256 fx = _mm256_add_ps(_mm256_set1_ps(static_cast<float>(x)), lanes);
+
+                    // Pixels inside the triangle (same tests as the scalar loop: no coordinate below 0)
+                    __m256 alpha = _mm256_add_ps(_mm256_mul_ps(A0, fx), alphaRow);
+                    __m256 beta = _mm256_add_ps(_mm256_mul_ps(A1, fx), betaRow);
+                    __m256 gamma = _mm256_add_ps(_mm256_mul_ps(A2, fx), gammaRow);
+                    __m256 inside = _mm256_and_ps(_mm256_cmp_ps(alpha, zero, _CMP_NLT_UQ),
+                                    _mm256_and_ps(_mm256_cmp_ps(beta, zero, _CMP_NLT_UQ), _mm256_cmp_ps(gamma, zero, _CMP_NLT_UQ)));
+                    int count = std::min(8, maxX - x);
+                    int mask = _mm256_movemask_ps(inside) & ((1 << count) - 1);
+                    if (mask == 0) continue;
+
+                    // Depth test against the stored depths (the lanes past the span are neither read nor written)
+                    __m256i span = laneMask(mask);
+                    __m256 depth = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(Z0, beta), _mm256_mul_ps(Z1, gamma)), _mm256_mul_ps(Z2, alpha));
+                    __m256 stored = _mm256_maskload_ps(depths + x, span);
+                    __m256 pass = _mm256_and_ps(_mm256_cmp_ps(stored, depth, _CMP_GT_OQ), _mm256_cmp_ps(depth, minDepth, _CMP_GT_OQ));
+                    mask &= _mm256_movemask_ps(pass);
+                    if (mask == 0) continue;
+
+                    _mm256_maskstore_ps(depths + x, laneMask(mask), depth);
+                    target.fill(x, y, mask, colour);
+                }
+            }
+        }
+        else {
+            for (int y = minY; y < maxY; y++) {
+                float fy = static_cast<float>(y);
+                float alphaRow = s.edge[0][1] * fy + s.edge[0][2];
+                float betaRow = s.edge[1][1] * fy + s.edge[1][2];
+                float gammaRow = s.edge[2][1] * fy + s.edge[2][2];
+
+                for (int x = minX; x < maxX; x++) {
+                    float fx = static_cast<float>(x);
+                    float alpha = s.edge[0][0] * fx + alphaRow;
+                    if (alpha < 0.f) continue;
+                    float beta = s.edge[1][0] * fx + betaRow;
+                    if (beta < 0.f) continue;
+                    float gamma = s.edge[2][0] * fx + gammaRow;
+                    if (gamma < 0.f) continue;
+
+                    float depth = interpolate(beta, gamma, alpha, z0, z1, z2);
+                    if (target.nearer(x, y, depth) && depth > 0.001f)
+                        target.write(x, y, depth, colour.r, colour.g, colour.b);
+                }
+            }
+        }
+    }
+
+    // Returns true if every pixel of a triangle gets the same colour: the same (lit, for Gouraud) colour at the
+    // three vertices, and for per pixel lighting the same normal too (e.g. every triangle of a cube) with no
+    // point light reaching the tiles of its bounds (minX, minY, maxX, maxY, max exclusive)
+    static bool isFlat(const Vertex& v0, const Vertex& v1, const Vertex& v2, const Light& L, ShadingMode shading,
+                       int minX, int minY, int maxX, int maxY) {
+        if (!(v0.rgb == v1.rgb) || !(v0.rgb == v2.rgb)) return false;
+        if (shading == ShadingMode::Gouraud) return true;
+        for (unsigned int i = 0; i < 3; i++)
+            if (v0.normal[i] != v1.normal[i] || v0.normal[i] != v2.normal[i]) return false;
+        return !L.tiles || !L.tiles->pointLightsIn(minX, minY, maxX, maxY);
+    }
+
+    // Colour of every pixel of a flat triangle, shaded once from its first vertex
+    static colour flatColour(const Vertex& v0, Light& L, float ka, float kd, ShadingMode shading) {
+        if (shading == ShadingMode::Gouraud) return v0.rgb;
+        colour c = v0.rgb;
+        c.clampColour();
+        vec4 normal = v0.normal;
+        normal.normalise();
+        #if !OPT_TRIANGLE_EARLY_LIGHT_NORM
+            L.omega_i.normalise();
+        #endif
+        float dot = std::max(vec4::dot(L.omega_i, normal), 0.f);
+        colour a = (c * kd) * (L.L * dot) + (L.ambient * ka);
+        if (L.tiles) {
+            a = a + L.tiles->shadeDirectional(normal, c * kd);
+            a.clampColour();
+        }
+        return a;
+    }
+
+    // Mip level of a textured triangle, from the screen space derivatives of its texture coordinates
+    // (the same at every pixel, the coordinates are interpolated linearly in screen space)
+    static unsigned int textureLevel(const Texture& texture, const Vertex& v0, const Vertex& v1, const Vertex& v2) {
+        float e1x = v1.p[0] - v0.p[0], e1y = v1.p[1] - v0.p[1];
+        float e2x = v2.p[0] - v0.p[0], e2y = v2.p[1] - v0.p[1];
+        float det = e1x * e2y - e1y * e2x;
+        if (det == 0.f) return 0;
+        float invDet = 1.f / det;
+        float du1 = v1.u - v0.u, du2 = v2.u - v0.u;
+        float dv1 = v1.v - v0.v, dv2 = v2.v - v0.v;
+        return texture.selectLevel((du1 * e2y - du2 * e1y) * invDet, (dv1 * e2y - dv2 * e1y) * invDet,
+                                   (du2 * e1x - du1 * e2x) * invDet, (dv2 * e1x - dv1 * e2x) * invDet);
+    }
+
+    // Pixel loop of a set up triangle, picking the loop of the mesh's shading mode once per triangle
+    template <typename Target>
+    static void rasterSetup(Target& target, Light& L, float ka, float kd, ShadingMode shading, const Texture* texture,
+                            const Vertex* vertices, const SetupTriangle& s, int clipMinX, int clipMinY, int clipMaxX, int clipMaxY) {
+        const Vertex& v0 = vertices[s.v[0]];
+        if (texture) {
+            unsigned int level = textureLevel(*texture, v0, vertices[s.v[1]], vertices[s.v[2]]);
+            if (shading == ShadingMode::Gouraud) rasterSetupShaded<true, true>(target, L, ka, kd, texture, level, vertices, s, clipMinX, clipMinY, clipMaxX, clipMaxY);
+            else rasterSetupShaded<false, true>(target, L, ka, kd, texture, level, vertices, s, clipMinX, clipMinY, clipMaxX, clipMaxY);
+            return;
+        }
+
+        #if OPT_TRIANGLE_FLAT_FAST_PATH
+            // Optimisation - Flat triangles are shaded once here instead of once per pixel
+            if (isFlat(v0, vertices[s.v[1]], vertices[s.v[2]], L, shading, std::max(s.minX, clipMinX), std::max(s.minY, clipMinY),
+                       std::min(s.maxX, clipMaxX), std::min(s.maxY, clipMaxY))) {
+                unsigned char r, g, b;
+                flatColour(v0, L, ka, kd, shading).toRGB(r, g, b);
+                rasterSetupFlat(target, FlatColour(r, g, b), vertices, s, clipMinX, clipMinY, clipMaxX, clipMaxY);
+                return;
+            }
+        #endif
+        if (shading == ShadingMode::Gouraud) rasterSetupShaded<true, false>(target, L, ka, kd, nullptr, 0, vertices, s, clipMinX, clipMinY, clipMaxX, clipMaxY);
+        else rasterSetupShaded<false, false>(target, L, ka, kd, nullptr, 0, vertices, s, clipMinX, clipMinY, clipMaxX, clipMaxY);
+    }
+
+    // Optimisation - Draw a triangle that went through the batched setup stage (see setupTriangles)
+    // Culling, bounds and the scaled edge functions were computed 8 triangles at a time, so no triangle
+    // object is built and each barycentric coordinate is a single multiply-add pair per pixel.
+    // Input Variables:
+    // - renderer: Renderer object for drawing
+    // - L: Light object for shading calculations
+    // - ka, kd: Ambient and diffuse lighting coefficients
+    // - shading: Lighting mode of the mesh (Gouraud vertices hold their lit colour)
+    // - texture: Texture of the mesh (none if null)
+    // - vertices: Transformed vertices the setup indices refer to
+    // - s: Setup data of the triangle
+    // - clipMinX, clipMinY, clipMaxX, clipMaxY: Optional rectangle (max exclusive) the pixels are restricted to,
+    //   so a tile of the screen can be rasterized on its own
+    static void drawSetup(Renderer& renderer, Light& L, float ka, float kd, ShadingMode shading, const Texture* texture, const Vertex* vertices, const SetupTriangle& s,
+                          int clipMinX = 0, int clipMinY = 0, int clipMaxX = INT_MAX, int clipMaxY = INT_MAX) {
+        CanvasTarget target{ renderer };
+        rasterSetup(target, L, ka, kd, shading, texture, vertices, s, clipMinX, clipMinY, clipMaxX, clipMaxY);
+    }
+
+    // Optimisation - Draw a set up triangle into a packed depth + colour buffer with lock-free writes,
+    // so triangles covering the same pixels can be drawn by several threads at once without races
+    // Input Variables:
+    // - buffer: Target buffer (resolved to the canvas once the frame is drawn)
+    // - L: Light object for shading calculations
+    // - ka, kd: Ambient and diffuse lighting coefficients
+    // - shading: Lighting mode of the mesh (Gouraud vertices hold their lit colour)
+    // - texture: Texture of the mesh (none if null)
+    // - vertices: Transformed vertices the setup indices refer to
+    // - s: Setup data of the triangle
+    static void drawSetupAtomic(AtomicZbuffer& buffer, Light& L, float ka, float kd, ShadingMode shading, const Texture* texture, const Vertex* vertices, const SetupTriangle& s) {
+        AtomicTarget target{ buffer };
+        rasterSetup(target, L, ka, kd, shading, texture, vertices, s, 0, 0, INT_MAX, INT_MAX);
+    }
+
+    // Optimisation - Draw a set up triangle into the calling thread's private layer for sort-last compositing
+    // Input Variables:
+    // - layer: Layer owned by the calling thread (merged into the canvas once the frame is drawn)
+    // - L: Light object for shading calculations
+    // - ka, kd: Ambient and diffuse lighting coefficients
+    // - shading: Lighting mode of the mesh (Gouraud vertices hold their lit colour)
+    // - texture: Texture of the mesh (none if null)
+    // - vertices: Transformed vertices the setup indices refer to
+    // - s: Setup data of the triangle
+    static void drawSetupLayer(DepthLayer& layer, Light& L, float ka, float kd, ShadingMode shading, const Texture* texture, const Vertex* vertices, const SetupTriangle& s) {
+        layer.touch(s.minX, s.minY, s.maxX, s.maxY);
+        LayerTarget target{ layer };
+        rasterSetup(target, L, ka, kd, shading, texture, vertices, s, 0, 0, INT_MAX, INT_MAX);
+    }
+
+    // Optimisation - Draw a set up triangle into an offscreen render target (see MultiViewRenderer)
+    // Input Variables:
+    // - target: Render target of the view
+    // - L: Light object for shading calculations
+    // - ka, kd: Ambient and diffuse lighting coefficients
+    // - shading: Lighting mode of the mesh (Gouraud vertices hold their lit colour)
+    // - texture: Texture of the mesh (none if null)
+    // - vertices: Transformed vertices the setup indices refer to
+    // - s: Setup data of the triangle
+    // - clipMinX, clipMinY, clipMaxX, clipMaxY: Rectangle (max exclusive) the pixels are restricted to
+    static void drawSetupView(RenderTarget& target, Light& L, float ka, float kd, ShadingMode shading, const Texture* texture, const Vertex* vertices, const SetupTriangle& s,
+                              int clipMinX, int clipMinY, int clipMaxX, int clipMaxY) {
+        ViewTarget view{ target };
+        rasterSetup(view, L, ka, kd, shading, texture, vertices, s, clipMinX, clipMinY, clipMaxX, clipMaxY);
+    }
+
     // Compute the 2D bounds of the triangle
     // Output Variables:
     // - minV, maxV: Minimum and maximum bounds in 2D space
@@ -212,27 +628,27 @@ public:
 
     // Compute the 2D bounds of the triangle, clipped to the canvas
     // Input Variables:
-    // - canvas: Reference to the rendering canvas
+    // - renderer: Renderer owning the canvas
     // Output Variables:
     // - minV, maxV: Clipped minimum and maximum bounds
-    void getBoundsWindow(GamesEngineeringBase::Window& canvas, vec2D& minV, vec2D& maxV) {
+    void getBoundsWindow(const Renderer& renderer, vec2D& minV, vec2D& maxV) {
         getBounds(minV, maxV);
         minV.x = std::max(minV.x, static_cast<float>(0));
         minV.y = std::max(minV.y, static_cast<float>(0));
-        maxV.x = std::min(maxV.x, static_cast<float>(canvas.getWidth()));
-        maxV.y = std::min(maxV.y, static_cast<float>(canvas.getHeight()));
+        maxV.x = std::min(maxV.x, static_cast<float>(renderer.getWidth()));
+        maxV.y = std::min(maxV.y, static_cast<float>(renderer.getHeight()));
     }
 
     // Debugging utility to display the triangle bounds on the canvas
     // Input Variables:
-    // - canvas: Reference to the rendering canvas
-    void drawBounds(GamesEngineeringBase::Window& canvas) {
+    // - renderer: Renderer owning the canvas
+    void drawBounds(Renderer& renderer) {
         vec2D minV, maxV;
         getBounds(minV, maxV);
 
         for (int y = (int)minV.y; y < (int)maxV.y; y++) {
             for (int x = (int)minV.x; x < (int)maxV.x; x++) {
-                canvas.draw(x, y, 255, 0, 0);
+                renderer.draw(x, y, 255, 0, 0);
             }
         }
     }
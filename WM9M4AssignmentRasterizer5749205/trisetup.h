@@ -0,0 +1,135 @@
+#pragma once
+
+#include <algorithm>
+#include <immintrin.h>
+
+#include "mesh.h"
+#include "OptimisationProfiles.h"
+
+// Per-triangle data produced by the batched setup stage, everything the pixel loop needs
+struct SetupTriangle {
+    unsigned int v[3];           // Indices of the triangle's vertices in the transformed vertex array
+    float edge[3][3];            // (A, B, C) of the alpha, beta and gamma edge functions, pre-scaled by 1 / area,
+                                 // so the barycentric coordinate at pixel (x, y) is A * x + B * y + C
+    int minX, minY, maxX, maxY;  // Pixel loop bounds clipped to the canvas (max is exclusive)
+};
+
+// Batched triangle setup - 8 triangles per AVX register
+// Gathers the screen space positions of 8 triangles at once, then computes the signed area, the bounds,
+// the edge functions and every cull test (|z| > 1 clip, area < 1, backfacing, off-canvas) without branching.
+// The survivors are compacted into 'out' in submission order.
+// Input Variables:
+// - vertices: Transformed (screen space) vertices
+// - triangleCount: Number of triangles to set up
+// - index: Callable (triangle, corner) returning the index of a triangle's vertex in 'vertices'
+// - width, height: Canvas size
+// Output Variables:
+// - out: Setup data of the surviving triangles, must have room for 'triangleCount' entries
+// Returns the number of surviving triangles
+template <typename IndexFn>
+inline unsigned int setupTriangles(const Vertex* vertices, unsigned int triangleCount, IndexFn&& index,
+                                   float width, float height, SetupTriangle* out) {
+    static_assert(sizeof(Vertex) % sizeof(float) == 0, "Vertex must be gatherable as floats");
+    constexpr int stride = static_cast<int>(sizeof(Vertex) / sizeof(float));
+    const float* base = vertices[0].p.v;  // x, y, z are floats 0, 1, 2 of each vertex
+
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.f);
+    const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    const __m256 canvasW = _mm256_set1_ps(width);
+    const __m256 canvasH = _mm256_set1_ps(height);
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+    unsigned int survivors = 0;
+    for (unsigned int first = 0; first < triangleCount; first += 8) {
+        unsigned int count = std::min(8u, triangleCount - first);
+
+        // Gather the vertex indices, padding a partial batch with the first triangle (masked off below)
+        alignas(32) int idx[3][8];
+        for (unsigned int i = 0; i < 8; i++) {
+            unsigned int t = first + ((i < count) ? i : 0);
+            for (unsigned int k = 0; k < 3; k++)
+                idx[k][i] = static_cast<int>(index(t, k));
+        }
+
+        __m256 x[3], y[3], z[3];
+        for (unsigned int k = 0; k < 3; k++) {
+            __m256i offset = _mm256_mullo_epi32(_mm256_load_si256(reinterpret_cast<const __m256i*>(idx[k])), _mm256_set1_epi32(stride));
+            x[k] = _mm256_i32gather_ps(base, offset, 4);
+            y[k] = _mm256_i32gather_ps(base + 1, offset, 4);
+            z[k] = _mm256_i32gather_ps(base + 2, offset, 4);
+        }
+
+        // Lanes past the end of the list
+        __m256 cull = _mm256_castsi256_ps(_mm256_cmpgt_epi32(lanes, _mm256_set1_epi32(static_cast<int>(count) - 1)));
+
+        // Clip triangles with Z-values outside [-1, 1]
+        for (unsigned int k = 0; k < 3; k++)
+            cull = _mm256_or_ps(cull, _mm256_cmp_ps(_mm256_and_ps(z[k], absMask), one, _CMP_GT_OQ));
+
+        // Signed area, e1 x e2 with e1 = v1 - v0 and e2 = v2 - v0
+        __m256 e1x = _mm256_sub_ps(x[1], x[0]), e1y = _mm256_sub_ps(y[1], y[0]);
+        __m256 e2x = _mm256_sub_ps(x[2], x[0]), e2y = _mm256_sub_ps(y[2], y[0]);
+        __m256 signedArea = _mm256_sub_ps(_mm256_mul_ps(e1x, e2y), _mm256_mul_ps(e1y, e2x));
+        __m256 area = _mm256_and_ps(signedArea, absMask);
+
+        // Skip very small triangles
+        cull = _mm256_or_ps(cull, _mm256_cmp_ps(area, one, _CMP_LT_OQ));
+        #if OPT_TRIANGLE_BACKFACE_CULLING
+            cull = _mm256_or_ps(cull, _mm256_cmp_ps(signedArea, zero, _CMP_LT_OQ));
+        #endif
+
+        // Bounds clipped to the canvas, converted to the pixel loop range
+        __m256 minX = _mm256_max_ps(_mm256_min_ps(x[0], _mm256_min_ps(x[1], x[2])), zero);
+        __m256 minY = _mm256_max_ps(_mm256_min_ps(y[0], _mm256_min_ps(y[1], y[2])), zero);
+        __m256 maxX = _mm256_min_ps(_mm256_max_ps(x[0], _mm256_max_ps(x[1], x[2])), canvasW);
+        __m256 maxY = _mm256_min_ps(_mm256_max_ps(y[0], _mm256_max_ps(y[1], y[2])), canvasH);
+        __m256i pixelMinX = _mm256_cvttps_epi32(minX);
+        __m256i pixelMinY = _mm256_cvttps_epi32(minY);
+        __m256i pixelMaxX = _mm256_cvttps_epi32(_mm256_ceil_ps(maxX));
+        __m256i pixelMaxY = _mm256_cvttps_epi32(_mm256_ceil_ps(maxY));
+
+        // Nothing to draw if the clipped bounds are empty (triangle entirely off the canvas)
+        __m256i covers = _mm256_and_si256(_mm256_cmpgt_epi32(pixelMaxX, pixelMinX), _mm256_cmpgt_epi32(pixelMaxY, pixelMinY));
+        cull = _mm256_or_ps(cull, _mm256_castsi256_ps(_mm256_xor_si256(covers, _mm256_set1_epi32(-1))));
+
+        int alive = ~_mm256_movemask_ps(cull) & 0xff;
+        if (alive == 0) continue;
+
+        // Edge functions of alpha (v0 -> v1), beta (v1 -> v2) and gamma (v2 -> v0), scaled by the inverse area
+        // For an edge a -> b: A = a.y - b.y, B = b.x - a.x, C = -(A * a.x + B * a.y)
+        __m256 invArea = _mm256_div_ps(one, area);
+        alignas(32) float edge[3][3][8];
+        for (unsigned int e = 0; e < 3; e++) {
+            unsigned int a = e, b = (e + 1) % 3;
+            __m256 A = _mm256_sub_ps(y[a], y[b]);
+            __m256 B = _mm256_sub_ps(x[b], x[a]);
+            __m256 C = _mm256_sub_ps(zero, _mm256_add_ps(_mm256_mul_ps(A, x[a]), _mm256_mul_ps(B, y[a])));
+            _mm256_store_ps(edge[e][0], _mm256_mul_ps(A, invArea));
+            _mm256_store_ps(edge[e][1], _mm256_mul_ps(B, invArea));
+            _mm256_store_ps(edge[e][2], _mm256_mul_ps(C, invArea));
+        }
+        alignas(32) int bounds[4][8];
+        _mm256_store_si256(reinterpret_cast<__m256i*>(bounds[0]), pixelMinX);
+        _mm256_store_si256(reinterpret_cast<__m256i*>(bounds[1]), pixelMinY);
+        _mm256_store_si256(reinterpret_cast<__m256i*>(bounds[2]), pixelMaxX);
+        _mm256_store_si256(reinterpret_cast<__m256i*>(bounds[3]), pixelMaxY);
+
+        // Compact the surviving lanes
+        for (unsigned int lane = 0; lane < 8; lane++) {
+            if (!(alive & (1 << lane))) continue;
+
+            SetupTriangle& s = out[survivors++];
+            for (unsigned int k = 0; k < 3; k++)
+                s.v[k] = static_cast<unsigned int>(idx[k][lane]);
+            for (unsigned int e = 0; e < 3; e++)
+                for (unsigned int c = 0; c < 3; c++)
+                    s.edge[e][c] = edge[e][c][lane];
+            s.minX = bounds[0][lane];
+            s.minY = bounds[1][lane];
+            s.maxX = bounds[2][lane];
+            s.maxY = bounds[3][lane];
+        }
+    }
+    return survivors;
+}
@@ -1,7 +1,13 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <climits>
 #include <concepts>
+#include <cstdint>
 #include <immintrin.h>
+#include <memory>
 
 #include "OptimisationProfiles.h"
 
@@ -24,7 +30,7 @@ public:
     }
 
     // Default constructor for creating an uninitialized Z-buffer.
-    Zbuffer() {}
+    Zbuffer() : buffer(nullptr) {}
 
     // Creates or reinitialies the Z-buffer with the given width and height.
     // Allocates memory for the buffer.
@@ -88,6 +94,15 @@ public:
         #endif
     }
 
+    // Clears a rectangle of the Z-buffer to the farthest depth (used to clear the screen one tile at a time)
+    // Input Variables:
+    // - x0, y0: Top left corner of the rectangle.
+    // - x1, y1: Bottom right corner of the rectangle (exclusive).
+    void clearRect(unsigned int x0, unsigned int y0, unsigned int x1, unsigned int y1) {
+        for (unsigned int y = y0; y < y1; y++)
+            std::fill(&buffer[(y * width) + x0], &buffer[(y * width) + x1], T(1.0));
+    }
+
     // Remove copying
     Zbuffer(const Zbuffer&) = delete;
     Zbuffer& operator=(const Zbuffer&) = delete;
@@ -112,4 +127,128 @@ public:
         }
         return *this;
     }
-};
\ No newline at end of file
+};
+
+// Depth buffer with each pixel's colour packed next to its depth, for lock-free triangle-parallel rasterization.
+// A pixel is one 64-bit word: the bits of the (positive) depth in the high half and the RGB colour in the low half.
+// Positive floats order like their bit patterns, so "nearer" is simply "smaller word", and a depth test with
+// its colour write is one atomic minimum (a CAS loop). Depth and colour can never be torn apart by another
+// thread, and equal depths resolve to the same colour whatever order the threads arrive in.
+class AtomicZbuffer {
+    static constexpr std::uint64_t CLEARED = static_cast<std::uint64_t>(std::bit_cast<std::uint32_t>(1.f)) << 32;  // Depth 1, black
+
+    std::unique_ptr<std::atomic<std::uint64_t>[]> buffer;
+    unsigned int width = 0, height = 0;
+
+public:
+    // Allocates the buffer and clears it
+    // Input Variables:
+    // - w: Width of the buffer.
+    // - h: Height of the buffer.
+    void create(unsigned int w, unsigned int h) {
+        width = w;
+        height = h;
+        buffer.reset(new std::atomic<std::uint64_t>[static_cast<size_t>(w) * h]);
+        for (size_t i = 0; i < static_cast<size_t>(w) * h; i++)
+            buffer[i].store(CLEARED, std::memory_order_relaxed);
+    }
+
+    // Returns the width of the buffer (0 before create)
+    unsigned int getWidth() const { return width; }
+
+    // Returns the depth currently stored at (x, y)
+    float depth(unsigned int x, unsigned int y) const {
+        return std::bit_cast<float>(static_cast<std::uint32_t>(buffer[(y * width) + x].load(std::memory_order_relaxed) >> 32));
+    }
+
+    // Depth test and write in one step - stores depth and colour if the depth is nearer than the stored one
+    // Input Variables:
+    // - x, y: Pixel coordinates.
+    // - z: Depth of the fragment (must be positive).
+    // - r, g, b: Colour of the fragment.
+    // Returns true if the fragment was stored
+    bool testAndWrite(unsigned int x, unsigned int y, float z, unsigned char r, unsigned char g, unsigned char b) {
+        std::uint64_t packed = (static_cast<std::uint64_t>(std::bit_cast<std::uint32_t>(z)) << 32) |
+                               (static_cast<std::uint64_t>(r) << 16) | (static_cast<std::uint64_t>(g) << 8) | b;
+        std::atomic<std::uint64_t>& pixel = buffer[(y * width) + x];
+        std::uint64_t current = pixel.load(std::memory_order_relaxed);
+        while (packed < current) {
+            if (pixel.compare_exchange_weak(current, packed, std::memory_order_relaxed)) return true;
+        }
+        return false;
+    }
+
+    // Copy the colours of a range of rows to a 3 bytes per pixel image, and clear those rows for the next frame
+    // Input Variables:
+    // - y0, y1: Rows to resolve (y1 exclusive).
+    // Output Variables:
+    // - image: Canvas back buffer.
+    void resolve(unsigned int y0, unsigned int y1, unsigned char* image) {
+        for (size_t i = static_cast<size_t>(y0) * width; i < static_cast<size_t>(y1) * width; i++) {
+            std::uint64_t value = buffer[i].load(std::memory_order_relaxed);  // Rasterization is over, no RMW needed
+            buffer[i].store(CLEARED, std::memory_order_relaxed);
+            image[3 * i] = static_cast<unsigned char>(value >> 16);
+            image[3 * i + 1] = static_cast<unsigned char>(value >> 8);
+            image[3 * i + 2] = static_cast<unsigned char>(value);
+        }
+    }
+};
+
+// Private depth + colour target of one thread for sort-last compositing.
+// Only its owner thread draws into it, so the depth test and write need no synchronisation at all; the
+// layers of all threads are merged into the canvas once the frame is drawn (see SortLastCompositor).
+// Colours are stored as 0x00RRGGBB words so the merge can select them 8 at a time with the depths.
+class DepthLayer {
+    std::unique_ptr<float[]> depthBuffer;
+    std::unique_ptr<std::uint32_t[]> colourBuffer;
+    unsigned int width = 0, height = 0;
+
+public:
+    int minX = INT_MAX, minY = INT_MAX, maxX = 0, maxY = 0;  // Pixels drawn since the last merge (max exclusive)
+
+    // Allocates the layer and clears it
+    // Input Variables:
+    // - w: Width of the layer.
+    // - h: Height of the layer.
+    void create(unsigned int w, unsigned int h) {
+        width = w;
+        height = h;
+        depthBuffer.reset(new float[static_cast<size_t>(w) * h]);
+        colourBuffer.reset(new std::uint32_t[static_cast<size_t>(w) * h]);
+        std::fill_n(depthBuffer.get(), static_cast<size_t>(w) * h, 1.f);
+        std::fill_n(colourBuffer.get(), static_cast<size_t>(w) * h, 0u);
+        resetBounds();
+    }
+
+    // Returns the width of the layer (0 before create)
+    unsigned int getWidth() const { return width; }
+
+    // Returns the first depth/colour of row y
+    float* depthRow(unsigned int y) { return &depthBuffer[static_cast<size_t>(y) * width]; }
+    std::uint32_t* colourRow(unsigned int y) { return &colourBuffer[static_cast<size_t>(y) * width]; }
+
+    // Accesses the depth value at the specified (x, y) coordinate.
+    float& depth(unsigned int x, unsigned int y) { return depthBuffer[(y * width) + x]; }
+
+    // Accesses the packed colour at the specified (x, y) coordinate.
+    std::uint32_t& colour(unsigned int x, unsigned int y) { return colourBuffer[(y * width) + x]; }
+
+    // Grow the drawn bounds by a rectangle (max exclusive), so the merge can skip the rest of the layer
+    void touch(int x0, int y0, int x1, int y1) {
+        minX = std::min(minX, x0);
+        minY = std::min(minY, y0);
+        maxX = std::max(maxX, x1);
+        maxY = std::max(maxY, y1);
+    }
+
+    // Returns true if the layer was drawn to inside the rectangle (max exclusive)
+    bool overlaps(int x0, int y0, int x1, int y1) const {
+        return minX < x1 && x0 < maxX && minY < y1 && y0 < maxY;
+    }
+
+    // Mark the layer as empty (its pixels must already be cleared)
+    void resetBounds() {
+        minX = minY = INT_MAX;
+        maxX = maxY = 0;
+    }
+};